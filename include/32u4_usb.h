@@ -1,15 +1,102 @@
 #pragma once
-#include "queue/queue.h"
+#include "monoqueue.h"
+#include "ring.h"
+#include "usb_requests.h"
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
+/**
+ * Size of the default control endpoint. 8, 16, 32 or 64 bytes.
+ */
+#if !defined(ATMEGA_XU4_EP0_SIZE)
+#define ATMEGA_XU4_EP0_SIZE 64
+#endif
+
+/**
+ * Endpoint FIFO memory shared by all endpoints, TRM 22.1.
+ */
+#define ATMEGA_XU4_DPRAM_SIZE 832
+
+/**
+ * UECFG1X EPSIZE field for an endpoint size in bytes, TRM 22.18.2.
+ */
+#define ATMEGA_XU4_EPSIZE(bytes) \
+    ((bytes) <= 8 ? 0 : (bytes) <= 16 ? 1 : (bytes) <= 32 ? 2 : \
+     (bytes) <= 64 ? 3 : (bytes) <= 128 ? 4 : (bytes) <= 256 ? 5 : 6)
+
+/**
+ * Capacity of the endpoint software queues, a power of two up to 128.
+ */
+#if !defined(ATMEGA_XU4_USB_SW_QUEUE_LEN)
+#define ATMEGA_XU4_USB_SW_QUEUE_LEN 128
+#endif
+
+// endpoint software queue: the ISR and the main loop each own one end
+RING_DEFINE(usb_ring, ATMEGA_XU4_USB_SW_QUEUE_LEN)
+
 typedef struct usb_ep_ctx_S usb_ep_ctx_t;
 typedef void (usb_ep_cb)(usb_ep_ctx_t *ctx);
 
+/**
+ * Number of transfers that can be submitted to one endpoint at a time.
+ */
+#if !defined(ATMEGA_XU4_XFER_SLOTS)
+#define ATMEGA_XU4_XFER_SLOTS 2
+#endif
+
 typedef enum {
+    // send a partial IN packet as soon as the queue runs dry, rather than
+    // hold it, see atmega_xu4_set_in_hold
     EP_FLUSH = 1,
+    // a SETUP packet was received and not yet handled
+    EP_SETUP = (1 << 1),
+    // the endpoint moves data for submitted transfers instead of its queue
+    EP_XFER = (1 << 2),
 } usb_ep_flags;
+
+typedef struct usb_xfer_S usb_xfer_t;
+typedef void (usb_xfer_cb)(usb_xfer_t *xfer);
+
+typedef enum {
+    USB_XFER_IDLE = 0,
+    USB_XFER_PENDING,
+    USB_XFER_DONE,
+} usb_xfer_status_t;
+
+typedef enum {
+    // IN: end a transfer that is a multiple of the endpoint size with a
+    // zero-length packet
+    USB_XFER_ZLP = 1,
+} usb_xfer_flags;
+
+/**
+ * A transfer on a bulk or interrupt endpoint, in the style of a USB request
+ * block. The buffer belongs to the caller, the driver copies straight
+ * between it and the endpoint banks. Neither may be touched until the
+ * transfer is complete.
+ * IN transfers send len bytes, in packets of the endpoint size; the last
+ * packet is short unless len is a multiple of it.
+ * OUT transfers complete when len bytes are received or the host ends the
+ * transfer with a short packet. len should be a multiple of the endpoint
+ * size, a packet that does not fit is continued in the next transfer.
+ */
+struct usb_xfer_S {
+    uint8_t *buf;
+    uint16_t len;
+    // bytes moved, the actual length once complete
+    volatile uint16_t actual;
+    // called in the ISR context on completion, may submit again. May be NULL.
+    usb_xfer_cb *complete;
+    // free for the owner of the transfer
+    void *user;
+    // IN only, may be NULL: send this queue instead of buf. len is set to
+    // its size on submission, and it is drained as packets are written.
+    mqueue_t *chain;
+    volatile uint8_t status;
+    uint8_t flags;
+};
 /**
  * Minimum data required by USB driver to connect SW to an endpoint.
  * Any data needed for the software may be attached to this struct, eg:
@@ -23,9 +110,12 @@ typedef enum {
  */
 struct usb_ep_ctx_S {
     // callbacks will run in the ISR context / with its priority.
-    // Do not put long-running code here.
+    // Do not put long-running code here, post it with sched_post.
     usb_ep_cb *callback;
-    queue_t *data;
+    // software queue of any capacity, eg. a usb_ring_t: the ISR and the main
+    // loop each own one end. NULL for an endpoint without one: the ISR then disables
+    // the endpoint's OUT / IN interrupts instead of moving data.
+    byte_ring_t *data;
     // do not remove volatile: will remove atomic access guarantee
     volatile char flags;
 };
@@ -36,6 +126,24 @@ void atmega_xu4_setup_usb(void);
 
 bool atmega_xu4_install_ep_handler(int epnum, usb_ep_ctx_t *handler_ctx);
 
+/**
+ * Install functions called in the USB ISR when the bus is suspended, once
+ * the USB clock is frozen and the PLL is off, and when it resumes, while the
+ * PLL relocks. Use them to sleep in power-down meanwhile, see
+ * sched_set_sleep_mode: WAKEUPI wakes the CPU. Either may be NULL.
+ */
+void atmega_xu4_set_suspend_hooks(void (*suspend)(void),
+        void (*resume)(void));
+
+/**
+ * Wake the host up from a suspended bus, if it has enabled remote wakeup.
+ * Restarts the USB clock, calling the resume hook, and signals resume; the
+ * host then resumes the bus. Waits 2ms first, for the 5ms of idle bus USB
+ * requires before, so call it from the main loop.
+ * @return false if the bus is not suspended or remote wakeup is not enabled
+ */
+bool atmega_xu4_remote_wakeup(void);
+
 /**
  * Request that an endpoint return STALL packets for any future requests.
  */
@@ -57,3 +165,181 @@ void atmega_xu4_ep_in_enable(int epnum, bool in_state);
  *     while(!atmega_xu4_ep_empty(epnum));
  */
 bool atmega_xu4_ep_flush(int epnum);
+
+/**
+ * Coalesce small writes to an IN endpoint fed from its software queue: when
+ * the queue runs dry with a partial packet in the bank, the packet waits
+ * for more data, until it fills up or for up to frames SOFs (1ms each).
+ * EP_FLUSH sends it at once. Reset to 0, no wait, by a bus reset.
+ * @param frames at most 127
+ */
+void atmega_xu4_set_in_hold(int epnum, uint8_t frames);
+
+/**
+ * Number of the current USB frame, from the last SOF: 11 bits, counting
+ * up every 1ms. The host sees the same numbers, eg. to correlate traces.
+ */
+uint16_t atmega_xu4_frame_number(void);
+
+/**
+ * Queue a transfer on an endpoint. Once an endpoint has taken a transfer,
+ * it no longer uses its software queue: with no transfer pending, IN
+ * endpoints stay idle and OUT endpoints NAK the host.
+ * @param epnum a configured non-control endpoint
+ * @param xfer the transfer, buf and len (and optionally complete, user and
+ * flags) set
+ * @return false if ATMEGA_XU4_XFER_SLOTS transfers are already pending
+ */
+bool atmega_xu4_submit(int epnum, usb_xfer_t *xfer);
+
+/**
+ * Handler for class or vendor requests on EP0, called in the ISR context
+ * with the SETUP packet. It answers with one of atmega_xu4_ep0_send,
+ * atmega_xu4_ep0_send_P, atmega_xu4_ep0_recv or atmega_xu4_ep0_status.
+ * @return false to refuse the request, which stalls EP0
+ */
+typedef bool (usb_req_handler)(const usb_req_std_t *req);
+
+/**
+ * Route class or vendor requests to a handler. Requests are looked up by
+ * type, recipient and, for interface and endpoint recipients, the number
+ * in wIndex, in a table: the cost does not depend on the number of
+ * handlers. A request with no handler is stalled. Standard requests are
+ * always handled by the driver.
+ * @param type USB_REQ_TYPE_CLASS or USB_REQ_TYPE_VENDOR
+ * @param rcpt USB_REQ_RCPT_DEVICE, _INTERFACE or _ENDPOINT
+ * @param index interface or endpoint number, ignored for the device
+ * @param handler the handler, or NULL to remove the current one
+ * @return false if there is no such type, recipient or index
+ */
+bool atmega_xu4_install_req_handler(usb_req_type_t type, usb_req_type_t rcpt,
+        uint8_t index, usb_req_handler *handler);
+
+/**
+ * Start the data stage of a control IN transfer.
+ * @param data the data to send, which must stay valid until the transfer is
+ * complete
+ * @param len size of data
+ * @param wlength wLength of the request, the data is truncated to it
+ */
+void atmega_xu4_ep0_send(const void *data, uint16_t len, uint16_t wlength);
+
+/**
+ * atmega_xu4_ep0_send for data in program memory, eg. descriptors.
+ */
+void atmega_xu4_ep0_send_P(const void *data, uint16_t len, uint16_t wlength);
+
+/**
+ * Start the data stage of a control OUT transfer.
+ * @param buf destination, at least wlength bytes
+ * @param wlength wLength of the request
+ * @param done called in the ISR context once all data is received, before
+ * the status stage. May be NULL.
+ */
+void atmega_xu4_ep0_recv(void *buf, uint16_t wlength, void (*done)(void));
+
+/**
+ * atmega_xu4_ep0_send for data in several pieces, eg. a header in RAM and
+ * a table in program memory, sent without copying them together.
+ * @param seg the first segment, see monoqueue.h. The chain must stay valid
+ * until the transfer is complete.
+ */
+void atmega_xu4_ep0_send_chain(const mqueue_seg_t *seg, uint16_t wlength);
+
+/**
+ * Accept a request without a data stage.
+ */
+void atmega_xu4_ep0_status(void);
+
+/**
+ * Read data received on a CDC ACM port. Does not block. While nothing is
+ * read, the receive queue of the port fills up and the host is NAKed on
+ * that port only.
+ * @param port index of the CDC-ACM function in the descriptors, see
+ * USB_ACM_FUNCTIONS. In bridge mode, port 0 sends its data to USART1.
+ * @param buf destination
+ * @param len size of buf
+ * @return number of bytes read, 0 if none are waiting.
+ */
+size_t usb_cdc_port_read(uint8_t port, void *buf, size_t len);
+
+/**
+ * Queue data to send on a CDC ACM port. Does not block. Port 0 sends the
+ * demo stream, or USART1 data in bridge mode, and takes none.
+ * @param port index of the CDC-ACM function in the descriptors
+ * @param buf data
+ * @param len size of buf
+ * @return number of bytes queued, less than len once the queue is full.
+ */
+size_t usb_cdc_port_write(uint8_t port, const void *buf, size_t len);
+
+/**
+ * SOFs a CDC ACM port holds a partial IN packet for, waiting for more data
+ * to fill it, see atmega_xu4_set_in_hold. 0 sends every write as it is.
+ */
+#if !defined(USB_CDC_HOLD_FRAMES)
+#define USB_CDC_HOLD_FRAMES 2
+#endif
+
+/**
+ * Send what is queued on a CDC ACM port without waiting for a full packet,
+ * eg. after a latency-critical write. Also for USART1 data in bridge mode.
+ */
+void usb_cdc_port_flush(uint8_t port);
+
+/**
+ * Change how long a port holds partial IN packets, USB_CDC_HOLD_FRAMES
+ * until then. Kept across configurations.
+ * @param frames SOFs, at most 127
+ */
+void usb_cdc_port_set_hold(uint8_t port, uint8_t frames);
+
+/**
+ * Raw bulk transport, built when the descriptors have a vendor-specific
+ * (class 0xFF) interface with a bulk IN and a bulk OUT endpoint. Both
+ * directions carry frames back to back: a little-endian 16 bit length, then
+ * the payload. Packet boundaries mean nothing, frames span them.
+ * Each direction has USB_RAW_SLOTS packets of buffer space.
+ */
+#if !defined(USB_RAW_SLOTS)
+#define USB_RAW_SLOTS 4
+#endif
+#define USB_RAW_HDR_SIZE 2
+// largest frame payload that fits the buffers
+#define USB_RAW_FRAME_MAX (USB_RAW_SLOTS * 64 - USB_RAW_HDR_SIZE)
+
+/**
+ * Queue a frame. Does not block. Full packets are sent as they fill up; a
+ * partial one waits while packets are in flight, so under load every packet
+ * is full.
+ * @param buf payload
+ * @param len payload size, at most USB_RAW_FRAME_MAX
+ * @return false if the frame does not fit now, nothing is queued then.
+ */
+bool usb_raw_send(const void *buf, uint16_t len);
+
+/**
+ * Take the next received frame, once it has arrived whole. Does not block.
+ * A frame longer than USB_RAW_FRAME_MAX cannot be received: what was
+ * received is dropped.
+ * @param buf destination
+ * @param len size of buf; set to the payload size. A larger payload is cut
+ * off at the size of buf.
+ * @return false if no whole frame is waiting.
+ */
+bool usb_raw_recv(void *buf, uint16_t *len);
+
+/**
+ * Set the functions called in the USB ISR when a packet is received and
+ * when send buffer space frees up, eg. to post work. Either may be NULL.
+ * tx is also called once the transport is configured.
+ */
+void usb_raw_set_hooks(void (*rx)(void), void (*tx)(void));
+
+#if !defined(ACM_BRIDGE)
+/**
+ * usb_cdc_port_read for port 0. Built without ACM_BRIDGE only: the bridge
+ * sends that data to USART1.
+ */
+size_t usb_cdc_read(void *buf, size_t len);
+#endif
@@ -0,0 +1,28 @@
+#pragma once
+/**
+ * Shared by USB_COM_vect in C (32u4_usb.c) and its assembly fast path
+ * (32u4_usb_isr.S, built with USB_ASM_ISR). Preprocessor definitions only,
+ * the assembler includes this too.
+ *
+ * The fast path serves the bulk endpoints of the USART1 bridge, whose
+ * rings are the UART rings at fixed addresses, see drivers/uart_isr.h. It
+ * moves one full packet between a ring and the endpoint and jumps to the
+ * C ISR for anything else: other endpoints or events, several endpoints at
+ * once, a short packet or a ring that cannot take or give a whole packet.
+ */
+#include "usb_descriptor_data.h"
+
+// bulk endpoints of CDC-ACM port 0, the one bridged to USART1
+#define USB_ISR_ACM_IN(intf, notify, in, out) in,
+#define USB_ISR_ACM_OUT(intf, notify, in, out) out,
+#define USB_ISR_FIRST_(first, ...) first
+#define USB_ISR_FIRST(...) USB_ISR_FIRST_(__VA_ARGS__)
+#define USB_ISR_IN_EP USB_ISR_FIRST(USB_ACM_FUNCTIONS(USB_ISR_ACM_IN) 0)
+#define USB_ISR_OUT_EP USB_ISR_FIRST(USB_ACM_FUNCTIONS(USB_ISR_ACM_OUT) 0)
+
+// packet size of both, checked against the endpoint plan in 32u4_usb.c
+#define USB_ISR_BULK_SIZE 64
+
+// the C ISR the fast path jumps to when it steps aside, named as the USART1
+// ones in drivers/uart_isr.h are
+#define USB_COM_SLOW_VECT __vector_usb_com_slow
@@ -2,20 +2,53 @@
 /**
  * AVR UART driver
  */
+#include "monoqueue.h"
+#include "ring.h"
+// UART_RX_LEN and UART_TX_LEN, the ring sizes
+#include "uart_isr.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum {
+    UART_PARITY_NONE = 0,
+    UART_PARITY_ODD = 1,
+    UART_PARITY_EVEN = 2,
+} uart_parity_t;
+
+// receive errors, passed to the error hook
+typedef enum {
+    UART_ERR_FRAMING = 1,
+    UART_ERR_PARITY = (1 << 1),
+    // a byte was lost, in the USART or because the receive ring was full
+    UART_ERR_OVERRUN = (1 << 2),
+    // the line was held low for a whole frame
+    UART_ERR_BREAK = (1 << 3),
+} uart_err_t;
 
 /**
- * Prepare the UART for interrupt-based communications
+ * Prepare the UART for interrupt-based communications, 8N1
  * @param baud baud rate
- * @param rxb buffer to store received bytes in
- * @param txb buffer in which bytes to send will be placed
- * @param rx_sz size in bytes of rxb
- * @param tx_sz size in bytes of txb
  */
-void configure_uart(
-        unsigned long baud,
-        char *rxb, char *txb,
-        int rx_sz, int tx_sz
-);
+void configure_uart(unsigned long baud);
+
+/**
+ * Change the baud rate and frame format. Takes effect immediately, a byte
+ * being shifted out at the time is garbled.
+ * @param baud baud rate, within 3% of what the clock can divide down to
+ * @param data_bits 5 to 8
+ * @param parity see uart_parity_t
+ * @param stop_bits 1 or 2
+ * @return false, with the settings unchanged, if they are not supported
+ */
+bool uart_set_line(unsigned long baud, uint8_t data_bits,
+        uart_parity_t parity, uint8_t stop_bits);
+
+/**
+ * Hold the TX line low (a break condition) until called again with false.
+ * Queued data waits in the transmit ring meanwhile.
+ */
+void uart_set_break(bool on);
 
 /**
  * Write a stream of data to the uart
@@ -27,9 +60,73 @@ void uart_puts(char *data, int len);
  */
 int uart_puts_noblock(char *data, int len);
 
+/**
+ * Send a queue, eg. a chain of segments in RAM and program memory, from
+ * where the data is, without copying it into the transmit ring. Data
+ * written with uart_puts meanwhile is sent after it.
+ * @param q the queue, left alone until done is called
+ * @param done called in the ISR context once the last byte is taken. May
+ * be NULL.
+ * @return false if q is empty, or if the transmit ring or a previous queue
+ * is still being sent
+ */
+bool uart_send_chain(mqueue_t *q, void (*done)(void));
+
+/**
+ * Number of bytes uart_puts_noblock can currently queue in full
+ */
+int uart_tx_room(void);
+
 /**
  * Read a stream from the uart without blocking for non-present data.
  * Returns the number of bytes written into buf, which will be less than or
  * equal to len.
  */
 int uart_gets(char *buf, int len);
+
+/**
+ * The receive and transmit rings, UART_RX_LEN and UART_TX_LEN bytes, for a
+ * driver that moves data in and out of the UART directly. It then takes the place of uart_gets / uart_puts as the
+ * consumer of the receive ring and the producer of the transmit ring.
+ */
+byte_ring_t *uart_rx_ring(void);
+byte_ring_t *uart_tx_ring(void);
+
+/**
+ * Start sending whatever was written to the transmit ring directly.
+ */
+void uart_tx_kick(void);
+
+/**
+ * Install functions called in the ISR context, once each time they are
+ * asked for with uart_rx_wake and uart_tx_wake. Either may be NULL.
+ */
+void uart_set_hooks(void (*rx)(void), void (*tx)(void));
+
+/**
+ * Call the rx hook after the next received byte is handled. Until then,
+ * and afterwards, bytes are queued without calling anything.
+ */
+void uart_rx_wake(void);
+
+/**
+ * Call the tx hook once taking a byte for transmission leaves at most level
+ * bytes in the transmit ring.
+ * @param level less than UART_TX_LEN
+ */
+void uart_tx_wake(uint8_t level);
+
+/**
+ * Install a function called in the ISR context when a received byte has
+ * errors, with uart_err_t flags. The byte is still queued, except for the
+ * zero byte a break reads as. May be NULL.
+ */
+void uart_set_error_hook(void (*err)(uint8_t errors));
+
+/**
+ * Call hook once, in the ISR context, when RXD1 is next low, eg. for the
+ * start bit of a byte. This is INT2 on a low level, which also wakes the
+ * CPU from power-down, where the USART does not run: the byte itself is
+ * lost then. NULL disarms it.
+ */
+void uart_set_line_hook(void (*hook)(void));
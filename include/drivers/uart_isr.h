@@ -0,0 +1,44 @@
+#pragma once
+/**
+ * Shared by the USART1 ISRs in C (uart.c) and their assembly fast paths
+ * (uart_isr.S, built with UART_ASM_ISR). Preprocessor definitions only, the
+ * assembler includes this too.
+ *
+ * A fast path queues or sends one plain byte and jumps to the C ISR for
+ * anything else: receive errors, a full receive ring, an empty transmit
+ * ring, a hook to call, a break or a chain being sent. The flags below tell
+ * it when to step aside; the C side keeps them up to date. GPIOR2 is
+ * scratch space for the fast paths, which never nest.
+ */
+
+#define UART_FLAGS GPIOR0
+// the rx hook is due after the next received byte, see uart_rx_wake
+#define UART_RX_WAKE 0
+// a break or a chain is being sent, only the C ISR can
+#define UART_TX_SLOW 1
+
+// the tx hook is due once taking a byte leaves fewer than this many in the
+// transmit ring, 0 for never, see uart_tx_wake
+#define UART_TX_WAKE_AT GPIOR1
+
+#define UART_ISR_SCRATCH GPIOR2
+
+// the C ISRs a fast path jumps to when it steps aside. avr-gcc only takes
+// ISRs whose names start with __vector.
+#define UART_RX_SLOW_VECT __vector_uart_rx_slow
+#define UART_UDRE_SLOW_VECT __vector_uart_udre_slow
+
+// sizes of the receive and transmit rings, powers of two up to 128. The
+// bridge moves whole packets out of the receive ring, which takes up the
+// bytes that arrive meanwhile: 1Mbaud brings about 100 a frame.
+#if !defined(UART_RX_LEN)
+#define UART_RX_LEN 128
+#endif
+#if !defined(UART_TX_LEN)
+#define UART_TX_LEN 128
+#endif
+
+// ring header layout, see RING_HEADER in ring.h, checked in uart.c
+#define UART_RING_HEAD 0
+#define UART_RING_TAIL 1
+#define UART_RING_BUF 3
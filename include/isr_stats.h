@@ -0,0 +1,84 @@
+#pragma once
+/**
+ * Optional ISR instrumentation, built when ISR_STATS is defined (meson option
+ * isr_stats). Instrumented ISRs read the free-running Timer1 on entry and
+ * exit and fold the duration into a per-vector min/max/log2 histogram.
+ *
+ * Interrupt latency is sampled by a probe: TIMER1_COMPA fires every
+ * ISR_STATS_PROBE_PERIOD ticks and records how late it ran, ie. how long an
+ * interrupt had to wait behind other ISRs and interrupts-off sections. The
+ * USART1 vectors have a lower priority than TIMER1_COMPA and may also wait
+ * for the probe itself, which is a few cycles.
+ *
+ * Histograms are read with the vendor request ISR_STATS_VENDOR_REQ_READ,
+ * wValue selecting the histogram, and cleared with ISR_STATS_VENDOR_REQ_CLEAR.
+ */
+
+#include <avr/io.h>
+
+#include <stdint.h>
+
+// bin 0 counts zero ticks, bin n counts [2^(n-1), 2^n), the last bin
+// everything above
+#define ISR_STATS_BINS 16
+
+// Timer1 ticks between latency probes, odd so they drift against the 1ms
+// frame and the UART byte clock
+#if !defined(ISR_STATS_PROBE_PERIOD)
+#define ISR_STATS_PROBE_PERIOD 997
+#endif
+
+// vendor requests (bmRequestType 0xC0 / 0x40) on EP0
+#define ISR_STATS_VENDOR_REQ_READ 0x02
+#define ISR_STATS_VENDOR_REQ_CLEAR 0x03
+
+typedef enum {
+    // durations
+    ISR_STATS_USB_GEN,
+    ISR_STATS_USB_COM,
+    ISR_STATS_USART1_RX,
+    ISR_STATS_USART1_UDRE,
+    // TIMER1_COMPA probe lateness
+    ISR_STATS_LATENCY,
+    ISR_STATS_NUM
+} isr_stats_id_t;
+
+// Timer1 ticks, counters saturate
+typedef struct {
+    uint16_t count;
+    uint16_t min;
+    uint16_t max;
+    uint16_t bins[ISR_STATS_BINS];
+} isr_stats_hist_t;
+
+#if defined(ISR_STATS)
+
+extern isr_stats_hist_t isr_stats[ISR_STATS_NUM];
+
+/**
+ * Start Timer1 and the latency probe, and clear the histograms.
+ */
+void isr_stats_init(void);
+
+/**
+ * Clear the histograms.
+ */
+void isr_stats_clear(void);
+
+/**
+ * Add a sample to a histogram. Call with interrupts disabled.
+ * @param id histogram
+ * @param ticks Timer1 ticks
+ */
+void isr_stats_record(isr_stats_id_t id, uint16_t ticks);
+
+// first and last statement of an instrumented ISR
+#define ISR_STATS_ENTER() uint16_t isr_stats_t0 = TCNT1
+#define ISR_STATS_EXIT(id) isr_stats_record((id), TCNT1 - isr_stats_t0)
+
+#else
+
+#define ISR_STATS_ENTER()
+#define ISR_STATS_EXIT(id)
+
+#endif
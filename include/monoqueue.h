@@ -8,14 +8,57 @@
  * Single-shot design for transfering data between layers in an asynchronous
  * manner. Re-initialize to reset.
  * Not MT safe.
+ *
+ * The data is read in place, from one buffer or from a chain of segments in
+ * RAM or program memory, eg. a header, a payload and a trailer that are
+ * never copied together. Consumers drain it a span at a time:
+ *     while((span = mqueue_peek_span(q, &n, &pgm))) {
+ *         ...copy n bytes, with pgm_read_byte if pgm...
+ *         mqueue_consume(q, n);
+ *     }
+ * or copy it out with mqueue_read.
  */
 
+typedef enum {
+    // buf is in program memory
+    MQUEUE_SEG_PGM = 1,
+} mqueue_seg_flags;
+
+typedef struct mqueue_seg_S mqueue_seg_t;
+
+/**
+ * One span of a chain. Segments and the data they point to belong to the
+ * caller and must stay valid until the queue is drained.
+ */
+struct mqueue_seg_S {
+    const uint_least8_t *buf;
+    size_t len;
+    uint8_t flags;
+    // the following segment, NULL at the end of the chain
+    const mqueue_seg_t *next;
+};
+
+#define MQUEUE_SEG(data, size, next_seg) \
+    {.buf = (const uint_least8_t *)(data), .len = (size), .flags = 0, \
+     .next = (next_seg)}
+#define MQUEUE_SEG_P(data, size, next_seg) \
+    {.buf = (const uint_least8_t *)(data), .len = (size), \
+     .flags = MQUEUE_SEG_PGM, .next = (next_seg)}
+
 typedef struct {
+    // span being read
     const uint_least8_t *head;
     const uint_least8_t *limit;
+    // bytes left in the queue, including the current span
+    size_t left;
+    // segment after the current span, NULL for the last or only span
+    const mqueue_seg_t *next;
+    // the current span is in program memory
+    bool pgm;
 } mqueue_t;
 
-#define MQUEUE_EMPTY(q) ((q)->head == (q)->limit)
+#define MQUEUE_EMPTY(q) (!(q)->left)
+#define MQUEUE_SIZE(q) ((q)->left)
 
 /**
  * Initialize a queue.
@@ -26,6 +69,20 @@ typedef struct {
  */
 mqueue_t *mqueue_init(mqueue_t *self, const uint_least8_t *buf, size_t size);
 
+/**
+ * mqueue_init for a buffer in program memory.
+ */
+mqueue_t *mqueue_init_P(mqueue_t *self, const uint_least8_t *buf, size_t size);
+
+/**
+ * Initialize a queue over a chain of segments.
+ * @param self the queue
+ * @param seg the first segment
+ * @param max the queue ends after this many bytes, if the chain is longer
+ * @return pointer to the initialized queue.
+ */
+mqueue_t *mqueue_init_chain(mqueue_t *self, const mqueue_seg_t *seg,
+        size_t max);
 
 /**
  * Get the first element of the queue
@@ -40,3 +97,38 @@ uint_least8_t mqueue_pop(mqueue_t *self);
  * @return value on top of queue.
  */
 uint_least8_t mqueue_peek(mqueue_t *self);
+
+/**
+ * View the contiguous data at the front of the queue without removal.
+ * @param self the queue
+ * @param n set to the length of the span
+ * @param pgm set if the span is in program memory. May be NULL for queues
+ * known to be in RAM.
+ * @return the span, NULL if the queue is empty
+ */
+const uint_least8_t *mqueue_peek_span(mqueue_t *self, size_t *n, bool *pgm);
+
+/**
+ * Remove n elements from the front of the queue, after mqueue_peek_span.
+ * @param n at most the length of the span
+ */
+void mqueue_consume(mqueue_t *self, size_t n);
+
+/**
+ * Remove up to n elements from the front of the queue without copying them.
+ * Only as many as the current span holds are removed.
+ * @param self the queue
+ * @param n number of elements wanted; set to the number actually removed
+ * @return pointer to the first removed element, valid as long as the
+ * underlying buffer is. Check mqueue_peek_span for where it is first.
+ */
+const uint_least8_t *mqueue_take(mqueue_t *self, size_t *n);
+
+/**
+ * Copy up to n elements out of the front of the queue, across spans.
+ * @param self the queue
+ * @param dst destination in RAM
+ * @param n size of dst
+ * @return number of elements copied
+ */
+size_t mqueue_read(mqueue_t *self, void *dst, size_t n);
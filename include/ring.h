@@ -0,0 +1,177 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Byte rings with a power-of-two capacity fixed at compile time.
+ * RING_DEFINE(name, cap) declares the type name_t and static inline
+ * operations specialised for cap, so indexing is a constant mask:
+ *
+ *     name_reset(r)              empty the ring, not concurrently with use
+ *     name_count(r)              bytes queued
+ *     name_space(r)              bytes free
+ *     name_push(r, c)            queue one byte, false if full
+ *     name_pop(r, &c)            take one byte, false if empty
+ *     name_write(r, src, n)      queue up to n bytes, return how many
+ *     name_read(r, dst, n)       take up to n bytes, return how many
+ *     name_write_span(r, &n)     contiguous free space: pointer, n bytes
+ *     name_commit(r, n)          publish n bytes written into the span
+ *     name_read_span(r, &n)      contiguous queued data: pointer, n bytes
+ *     name_consume(r, n)         release n bytes read from the span
+ *     name_any(r)                the ring as a byte_ring_t
+ *
+ * head and tail are free-running 8-bit counters, masked on access, so the
+ * capacity is at most 128. Only the producer writes tail and only the
+ * consumer writes head. Both fit in a single byte access, which makes one
+ * producer and one consumer, eg. an ISR and the main loop, safe without
+ * disabling interrupts. Several producers or consumers still need one.
+ *
+ * Every ring starts with the same header, so a driver can take rings of any
+ * capacity as byte_ring_t, eg. the USB endpoint queues, which the CDC-ACM
+ * bridge points at the USART1 rings. byte_ring_t has the same operations,
+ * masking with the capacity stored in the ring: initialise a ring with
+ * RING_INIT, or reset it, before handing it on.
+ */
+
+// keeps the compiler from moving buffer accesses across an index update
+#define RING_BARRIER() __asm__ __volatile__("" ::: "memory")
+
+// the header of every ring, the assembly fast paths rely on its layout, see
+// drivers/uart_isr.h
+#define RING_HEADER \
+    volatile uint8_t head; \
+    volatile uint8_t tail; \
+    /* capacity - 1, for byte_ring_t */ \
+    uint8_t mask;
+
+// static initialiser of a ring of capacity cap
+#define RING_INIT(cap) {.mask = (cap) - 1}
+
+// the operations of a ring type; cap is an expression of the ring r
+#define RING_OPS(name, type, cap) \
+static inline void name##_reset(type *r) { \
+    r->head = 0; \
+    r->tail = 0; \
+    r->mask = (cap) - 1; \
+} \
+\
+static inline uint8_t name##_count(const type *r) { \
+    return (uint8_t)(r->tail - r->head); \
+} \
+\
+static inline uint8_t name##_space(const type *r) { \
+    return (cap) - name##_count(r); \
+} \
+\
+static inline bool name##_push(type *r, uint8_t c) { \
+    uint8_t tail = r->tail; \
+    if((uint8_t)(tail - r->head) == (cap)) { \
+        return false; \
+    } \
+    r->buf[tail & ((cap) - 1)] = c; \
+    RING_BARRIER(); \
+    r->tail = tail + 1; \
+    return true; \
+} \
+\
+static inline bool name##_pop(type *r, uint8_t *c) { \
+    uint8_t head = r->head; \
+    if(head == r->tail) { \
+        return false; \
+    } \
+    *c = r->buf[head & ((cap) - 1)]; \
+    RING_BARRIER(); \
+    r->head = head + 1; \
+    return true; \
+} \
+\
+static inline uint8_t *name##_write_span(type *r, uint8_t *n) { \
+    uint8_t tail = r->tail; \
+    uint8_t space = (cap) - (uint8_t)(tail - r->head); \
+    uint8_t to_end = (cap) - (tail & ((cap) - 1)); \
+    *n = space < to_end ? space : to_end; \
+    return &r->buf[tail & ((cap) - 1)]; \
+} \
+\
+static inline void name##_commit(type *r, uint8_t n) { \
+    RING_BARRIER(); \
+    r->tail = r->tail + n; \
+} \
+\
+static inline const uint8_t *name##_read_span(type *r, uint8_t *n) { \
+    uint8_t head = r->head; \
+    uint8_t count = (uint8_t)(r->tail - head); \
+    uint8_t to_end = (cap) - (head & ((cap) - 1)); \
+    *n = count < to_end ? count : to_end; \
+    return &r->buf[head & ((cap) - 1)]; \
+} \
+\
+static inline void name##_consume(type *r, uint8_t n) { \
+    RING_BARRIER(); \
+    r->head = r->head + n; \
+} \
+\
+static inline uint8_t name##_write(type *r, const void *src, uint8_t n) { \
+    const uint8_t *from = src; \
+    uint8_t done = 0, len; \
+    uint8_t *span; \
+    /* at most two spans: up to the end of the buffer, then from the start */ \
+    for(uint8_t i = 0; i < 2 && done < n; i++) { \
+        span = name##_write_span(r, &len); \
+        if(!len) { \
+            break; \
+        } \
+        len = len < n - done ? len : n - done; \
+        memcpy(span, from + done, len); \
+        name##_commit(r, len); \
+        done += len; \
+    } \
+    return done; \
+} \
+\
+static inline uint8_t name##_read(type *r, void *dst, uint8_t n) { \
+    uint8_t *to = dst; \
+    uint8_t done = 0, len; \
+    const uint8_t *span; \
+    for(uint8_t i = 0; i < 2 && done < n; i++) { \
+        span = name##_read_span(r, &len); \
+        if(!len) { \
+            break; \
+        } \
+        len = len < n - done ? len : n - done; \
+        memcpy(to + done, span, len); \
+        name##_consume(r, len); \
+        done += len; \
+    } \
+    return done; \
+}
+
+/**
+ * A ring of any capacity, see name_any. byte_ring_reset keeps the capacity.
+ */
+typedef struct {
+    RING_HEADER
+    uint8_t buf[];
+} byte_ring_t;
+
+RING_OPS(byte_ring, byte_ring_t, (r->mask + 1))
+
+#define RING_DEFINE(name, cap) \
+_Static_assert((cap) > 0 && !((cap) & ((cap) - 1)) && (cap) <= 128, \
+        #name ": capacity must be a power of two no larger than 128"); \
+\
+typedef struct { \
+    RING_HEADER \
+    uint8_t buf[cap]; \
+} name##_t; \
+\
+_Static_assert(offsetof(name##_t, buf) == offsetof(byte_ring_t, buf), \
+        #name ": header does not match byte_ring_t"); \
+\
+RING_OPS(name, name##_t, (cap)) \
+\
+static inline byte_ring_t *name##_any(name##_t *r) { \
+    return (byte_ring_t *)r; \
+}
@@ -0,0 +1,66 @@
+#pragma once
+/**
+ * Deferred work. ISRs do the part of their job that cannot wait and post
+ * the rest as work items, which the main loop runs to completion, highest
+ * priority first, sleeping while nothing is pending: in SLEEP_MODE_IDLE, or
+ * the mode set with sched_set_sleep_mode.
+ *
+ * A work item is a function registered once with sched_add. Posting it
+ * queues its ID unless it is already queued, so a burst of posts runs it
+ * once. Each priority has a ring of IDs with room for every item, which
+ * the main loop takes from without disabling interrupts.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// work items that can be registered, a power of two no larger than 128
+#if !defined(SCHED_MAX_WORK)
+#define SCHED_MAX_WORK 8
+#endif
+
+// returned by sched_add when every item is taken
+#define SCHED_NONE 0xFF
+
+typedef enum {
+    SCHED_PRIO_HIGH,
+    SCHED_PRIO_LOW,
+    SCHED_NUM_PRIOS
+} sched_prio_t;
+
+typedef void (sched_fn)(void);
+
+/**
+ * Register a work item. Call before the ISRs that post it are enabled.
+ * @param fn run from the main loop each time the item was posted
+ * @param prio see sched_prio_t
+ * @return the ID to post, or SCHED_NONE if SCHED_MAX_WORK items exist
+ */
+uint8_t sched_add(sched_fn *fn, sched_prio_t prio);
+
+/**
+ * Queue a work item, unless it is already queued. Takes a few cycles and
+ * never blocks: safe in ISRs and from work items.
+ */
+void sched_post(uint8_t id);
+
+/**
+ * Run queued work until none is left. A high priority item posted
+ * meanwhile runs before the next low priority one.
+ * @return true if anything ran
+ */
+bool sched_run(void);
+
+/**
+ * Set the sleep mode of the main loop when no work is pending, eg.
+ * SLEEP_MODE_PWR_DOWN while the USB bus is suspended. Safe in ISRs, takes
+ * effect at the next sleep.
+ * @param mode one of the SLEEP_MODE_* values of avr/sleep.h
+ */
+void sched_set_sleep_mode(uint8_t mode);
+
+/**
+ * The main loop: run work, sleep until an interrupt when there is none.
+ * Does not return.
+ */
+void sched_loop(void) __attribute__((noreturn));
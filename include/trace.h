@@ -0,0 +1,109 @@
+#pragma once
+/**
+ * Deferred binary trace. Recording an event stores its ID, an 8-bit argument
+ * and a Timer1 timestamp in a RAM ring, which takes a few cycles and never
+ * blocks, so it is safe inside ISRs. The main loop drains the ring over the
+ * UART, or a host reads it through the USB vendor request
+ * TRACE_VENDOR_REQ_READ. Records are decoded on the host by
+ * tools/trace_decode.py.
+ *
+ * Define TRACE_DISABLE to compile every trace() call out.
+ */
+
+#include "trace_events.h"
+
+#include <avr/io.h>
+#include <util/atomic.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+// records in the ring, a power of two no larger than 128
+#if !defined(TRACE_LEN)
+#define TRACE_LEN 32
+#endif
+
+#if (TRACE_LEN & (TRACE_LEN - 1)) || TRACE_LEN > 128
+#error "TRACE_LEN must be a power of two no larger than 128"
+#endif
+
+// Timer1 clock select: clk/8, 0.5us per tick at 16MHz
+#if !defined(TRACE_TIMER_CS)
+#define TRACE_TIMER_CS _BV(CS11)
+#endif
+
+// vendor request (bmRequestType 0xC0) returning buffered records over EP0
+#define TRACE_VENDOR_REQ_READ 0x01
+
+// UART frame: sync bytes, then the record
+#define TRACE_SYNC0 0xA5
+#define TRACE_SYNC1 0x5A
+
+#define TRACE_ID(name, fmt) name,
+typedef enum {
+    TRACE_EVENTS(TRACE_ID)
+    TRACE_NUM_EVENTS
+} trace_event_t;
+#undef TRACE_ID
+
+typedef struct {
+    uint8_t id;
+    uint8_t arg;
+    uint16_t stamp;
+} trace_rec_t;
+
+extern trace_rec_t trace_ring[TRACE_LEN];
+// free-running indices. Only the writer moves head. Both readers, trace_drain
+// in the main loop and trace_read in the USB ISR, move tail, each taking a
+// record and advancing tail inside one atomic block.
+extern volatile uint8_t trace_head, trace_tail;
+// records lost to a full ring since the last drain
+extern volatile uint8_t trace_dropped;
+
+/**
+ * Start Timer1 free-running as the trace timebase.
+ */
+void trace_init(void);
+
+/**
+ * Record an event. A full ring drops the record and counts it.
+ * @param id event from trace_events.h
+ * @param arg event argument
+ */
+static inline void trace(uint8_t id, uint8_t arg) {
+#if !defined(TRACE_DISABLE)
+    // ISRs and the main loop may both record: claim the slot atomically. In
+    // an ISR this costs nothing more than saving SREG.
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        uint8_t head = trace_head;
+        if((uint8_t)(head - trace_tail) < TRACE_LEN) {
+            trace_rec_t *rec = &trace_ring[head & (TRACE_LEN - 1)];
+            rec->id = id;
+            rec->arg = arg;
+            rec->stamp = TCNT1;
+            trace_head = head + 1;
+        }
+        else if(trace_dropped != UINT8_MAX) {
+            trace_dropped++;
+        }
+    }
+#else
+    (void)id;
+    (void)arg;
+#endif
+}
+
+/**
+ * Move whole records out of the ring. A TRACE_DROPPED record is emitted first
+ * if records were lost.
+ * @param buf destination
+ * @param len size of buf in bytes
+ * @return bytes written, a multiple of sizeof(trace_rec_t)
+ */
+size_t trace_read(void *buf, size_t len);
+
+/**
+ * Send buffered records over the UART as framed binary, as many as fit in
+ * the UART transmit queue without blocking. Call from the main loop.
+ */
+void trace_drain(void);
@@ -0,0 +1,26 @@
+#pragma once
+/**
+ * Trace event list. Each entry is an event name and the format used to print
+ * it, with the event argument as the only parameter. The formats are not
+ * compiled into the firmware: tools/trace_decode.py reads them from this file.
+ * Append new events at the end so older captures still decode.
+ */
+#define TRACE_EVENTS(X) \
+    X(TRACE_DROPPED,            "%u records dropped") \
+    X(TRACE_USB_RESET,          "usb: bus reset") \
+    X(TRACE_USB_RESET_FAILED,   "usb: ep0 allocation failed") \
+    X(TRACE_USB_VBUS,           "usb: vbus transition") \
+    X(TRACE_USB_WAKEUP,         "usb: wakeup") \
+    X(TRACE_USB_SUSPEND,        "usb: suspend") \
+    X(TRACE_USB_SETUP,          "usb: SETUP bRequest 0x%02x") \
+    X(TRACE_USB_EP0_OUT,        "usb: ep0 OUT, stage %u") \
+    X(TRACE_USB_EP0_IN,         "usb: ep0 IN, stage %u") \
+    X(TRACE_USB_GET_DESC,       "usb: GET_DESCRIPTOR type %u") \
+    X(TRACE_USB_BAD_DESC,       "usb: unsupported descriptor type %u") \
+    X(TRACE_USB_SET_ADDRESS,    "usb: SET_ADDRESS %u") \
+    X(TRACE_USB_SET_CONFIG,     "usb: SET_CONFIGURATION %u") \
+    X(TRACE_USB_GET_STATUS,     "usb: GET_STATUS, recipient %u") \
+    X(TRACE_USB_BAD_REQ,        "usb: unsupported request 0x%02x") \
+    X(TRACE_USB_BAD_REQ_TYPE,   "usb: ... with bmRequestType 0x%02x") \
+    X(TRACE_USB_REMOTE_WAKEUP,  "usb: remote wakeup") \
+    X(TRACE_USB_IN_HOLD_DUE,    "usb: held IN packet due, frame %u")
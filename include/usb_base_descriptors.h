@@ -2,7 +2,10 @@
 
 #include <stdint.h>
 
-typedef struct {
+// descriptors go out on the wire as-is: they must not contain padding on any
+// compiler, including the host one used by the simulation build.
+
+typedef struct __attribute__((packed)) {
     uint8_t   bLength;
     uint8_t   bDescriptorType;
     uint16_t  bcdUSB;
@@ -19,7 +22,7 @@ typedef struct {
     uint8_t   bNumConfigurations;
 } usb_device_desc_t;
 
-typedef struct {
+typedef struct __attribute__((packed)) {
     uint8_t   bLength;
     uint8_t   bDescriptorType;
     uint16_t  wTotalLength;
@@ -30,13 +33,13 @@ typedef struct {
     uint8_t   bMaxPower;
 } usb_config_desc_t;
 
-typedef struct {
+typedef struct __attribute__((packed)) {
     uint8_t bLength;
     uint8_t bDescriptorType;
     uint8_t bString[];
 } usb_string_desc_t;
 
-typedef struct {
+typedef struct __attribute__((packed)) {
     uint8_t   bLength;
     uint8_t   bDescriptorType;
     uint8_t   bInterfaceNumber;
@@ -48,7 +51,7 @@ typedef struct {
     uint8_t   iInterface;
 } usb_interface_desc_t;
 
-typedef struct {
+typedef struct __attribute__((packed)) {
     uint8_t   bLength;
     uint8_t   bDescriptorType;
     uint8_t   bEndpointAddress;
@@ -57,7 +60,7 @@ typedef struct {
     uint8_t   bInterval;
 } usb_endpoint_desc_t;
 
-typedef struct {
+typedef struct __attribute__((packed)) {
     uint8_t bLength;
     uint8_t bDescriptortype;
     uint8_t bFirstInterface;
@@ -82,6 +85,13 @@ typedef enum {
     USB_DESC_INTERFACE_ASSOC = 11,
 } usb_desc_type_t;
 
+// bmAttributes of the configuration, Table 9-10 in USB2.0
+typedef enum {
+    USB_CONFIG_ATTRS_ONE = (1 << 7),
+    USB_CONFIG_ATTRS_SELF_POWERED = (1 << 6),
+    USB_CONFIG_ATTRS_REMOTE_WAKEUP = (1 << 5),
+} usb_config_attrs_t;
+
 // Table 9-13 in USB2.0
 typedef enum {
     USB_EP_ATTRS_CTRL = 0,
@@ -2,14 +2,14 @@
 
 #include <stdint.h>
 
-typedef struct {
+typedef struct __attribute__((packed)) {
     uint8_t bLength;
     uint8_t bDescriptorType;
     uint8_t bDescriptorSubtype;
     uint8_t data[];
 } usb_cdc_func_desc_t;
 
-typedef struct {
+typedef struct __attribute__((packed)) {
     uint8_t bLength;
     uint8_t bDescriptorType;
     uint8_t bDescriptorSubtype;
@@ -17,7 +17,7 @@ typedef struct {
 } usb_cdc_header_func_desc_t;
 
 // FIXME need a way to parameterize this for inclusion in a config desc
-typedef struct {
+typedef struct __attribute__((packed)) {
     uint8_t bLength;
     uint8_t bDescriptorType;
     uint8_t bDescriptorSubtype;
@@ -25,7 +25,7 @@ typedef struct {
     uint8_t bSubordinateInterfaces[];
 } usb_cdc_union_func_desc_t;
 
-typedef struct {
+typedef struct __attribute__((packed)) {
     uint8_t bLength;
     uint8_t bDescriptorType;
     uint8_t bDescriptorSubtype;
@@ -33,14 +33,14 @@ typedef struct {
     uint16_t wCountryCodes[];
 } usb_cdc_country_select_func_desc_t;
 
-typedef struct {
+typedef struct __attribute__((packed)) {
     uint8_t bLength;
     uint8_t bDescriptorType;
     uint8_t bDescriptorSubtype;
     uint8_t bmCapabilities;
 } usb_cdc_acm_func_desc_t;
 
-typedef struct {
+typedef struct __attribute__((packed)) {
     uint8_t bLength;
     uint8_t bDescriptorType;
     uint8_t bDescriptorSubtype;
@@ -74,3 +74,47 @@ typedef enum {
     USB_CDC_CALL_MGMT_CAP_DC = 1, // data class (1) or comm class (0)
     USB_CDC_CALL_MGMT_CAP_CM = (1 << 1), // handles call mgmt
 } usb_cdc_call_mgmt_cap_t;
+
+// class-specific requests for ACM, USBPSTN1.2 table 13
+typedef enum {
+    USB_CDC_REQ_SET_LINE_CODING = 0x20,
+    USB_CDC_REQ_GET_LINE_CODING = 0x21,
+    USB_CDC_REQ_SET_CONTROL_LINE_STATE = 0x22,
+    USB_CDC_REQ_SEND_BREAK = 0x23,
+} usb_cdc_req_t;
+
+// USBPSTN1.2 table 17
+typedef struct __attribute__((packed)) {
+    uint32_t dwDTERate;
+    uint8_t bCharFormat; // stop bits: 0 - 1, 1 - 1.5, 2 - 2
+    uint8_t bParityType; // none, odd, even, mark, space
+    uint8_t bDataBits;
+} usb_cdc_line_coding_t;
+
+// notifications on the interrupt IN endpoint, USBPSTN1.2 table 30
+typedef enum {
+    USB_CDC_NOTIFY_SERIAL_STATE = 0x20,
+} usb_cdc_notify_t;
+
+// SERIAL_STATE bitmap, USBPSTN1.2 table 31. DCD and DSR are steady state,
+// the others are sent once per event.
+typedef enum {
+    USB_CDC_SERIAL_STATE_DCD = 1, // bRxCarrier
+    USB_CDC_SERIAL_STATE_DSR = (1 << 1), // bTxCarrier
+    USB_CDC_SERIAL_STATE_BREAK = (1 << 2),
+    USB_CDC_SERIAL_STATE_RING = (1 << 3),
+    USB_CDC_SERIAL_STATE_FRAMING = (1 << 4),
+    USB_CDC_SERIAL_STATE_PARITY = (1 << 5),
+    USB_CDC_SERIAL_STATE_OVERRUN = (1 << 6),
+} usb_cdc_serial_state_t;
+
+// SERIAL_STATE notification: a header laid out like a SETUP packet, then
+// the bitmap. USBPSTN1.2 6.5.4
+typedef struct __attribute__((packed)) {
+    uint8_t bmRequestType; // 0xA1: class, interface, device to host
+    uint8_t bNotification;
+    uint16_t wValue;
+    uint16_t wIndex; // communication interface
+    uint16_t wLength;
+    uint16_t bmState;
+} usb_cdc_serial_state_notify_t;
@@ -2,12 +2,12 @@
 
 #include <stdint.h>
 
-typedef struct {
+typedef struct __attribute__((packed)) {
     uint8_t   bmRequestType;
     uint8_t   bRequest;
 } usb_req_hdr_t;
 
-typedef struct {
+typedef struct __attribute__((packed)) {
     uint8_t   bmRequestType;
     uint8_t   bRequest;
     uint16_t  wValue;
@@ -15,7 +15,7 @@ typedef struct {
     uint16_t  wLength;
 } usb_req_std_t;
 
-typedef struct {
+typedef struct __attribute__((packed)) {
     uint8_t   bmRequestType;
     uint8_t   bRequest;
     uint8_t   wValueLSB;
@@ -26,7 +26,7 @@ typedef struct {
     uint8_t   wLengthMSB;
 } usb_req_val_t;
 
-typedef struct {
+typedef struct __attribute__((packed)) {
     uint8_t   bmRequestType;
     uint8_t   bRequest;
     uint8_t   index;
@@ -48,3 +48,27 @@ typedef enum {
     USB_REQ_SET_INTERFACE = 11,
     USB_REQ_SYNCH_FRAME = 12,
 } usb_b_req_t;
+
+// feature selectors of SET_FEATURE and CLEAR_FEATURE, USB 2.0 table 9-6
+typedef enum {
+    USB_FEATURE_ENDPOINT_HALT = 0,
+    USB_FEATURE_DEVICE_REMOTE_WAKEUP = 1,
+    USB_FEATURE_TEST_MODE = 2,
+} usb_feature_t;
+
+// bmRequestType fields, USB 2.0 table 9-2
+typedef enum {
+    USB_REQ_RCPT_DEVICE = 0,
+    USB_REQ_RCPT_INTERFACE = 1,
+    USB_REQ_RCPT_ENDPOINT = 2,
+    USB_REQ_RCPT_OTHER = 3,
+    USB_REQ_RCPT_MASK = 0x1F,
+
+    USB_REQ_TYPE_STANDARD = (0 << 5),
+    USB_REQ_TYPE_CLASS = (1 << 5),
+    USB_REQ_TYPE_VENDOR = (2 << 5),
+    USB_REQ_TYPE_MASK = (3 << 5),
+
+    USB_REQ_DIR_OUT = 0,
+    USB_REQ_DIR_IN = (1 << 7),
+} usb_req_type_t;
@@ -0,0 +1,21 @@
+#pragma once
+/**
+ * Host stand-in for avr-libc's <avr/interrupt.h>. ISR() defines a plain
+ * function that the simulated controller calls; sei()/cli() drive the
+ * simulated SREG I flag.
+ */
+
+#include <avr/io.h>
+
+#define ISR_BLOCK
+#define ISR_NOBLOCK
+#define ISR_NAKED
+#define ISR_ALIASOF(v)
+
+#define ISR(vector, ...) void vector(void)
+
+void sim_sei(void);
+void sim_cli(void);
+
+#define sei() sim_sei()
+#define cli() sim_cli()
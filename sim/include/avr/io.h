@@ -0,0 +1,379 @@
+#pragma once
+/**
+ * Host stand-in for avr-libc's <avr/io.h>, used only by the simulation build.
+ * Register names expand to accessors of the simulated ATmega32U4 so that the
+ * hardware side effects of an access (DPRAM FIFO pointers, bank hand-over,
+ * interrupt flags) can be modelled. Bit names match iom32u4.h.
+ *
+ * Every register name must expand to exactly one accessor call per access in
+ * the source, which holds for all of the usual forms (REG = x, x = REG,
+ * REG |= x, REG &= x).
+ */
+
+#include <stdint.h>
+
+#define _BV(bit) (1 << (bit))
+
+typedef enum {
+    // core
+    SIM_SREG,
+    SIM_SMCR,
+    SIM_MCUCR,
+    SIM_PRR0,
+    SIM_PRR1,
+    SIM_GPIOR0,
+    SIM_GPIOR1,
+    SIM_GPIOR2,
+    // external interrupts
+    SIM_EICRA,
+    SIM_EIMSK,
+    // ports
+    SIM_DDRB,
+    SIM_PORTB,
+    SIM_PINB,
+    SIM_DDRC,
+    SIM_PORTC,
+    SIM_PINC,
+    SIM_DDRD,
+    SIM_PORTD,
+    SIM_PIND,
+    // timers
+    SIM_TCCR0A,
+    SIM_TCCR0B,
+    SIM_TCNT0,
+    SIM_OCR0A,
+    SIM_TIMSK0,
+    SIM_TIFR0,
+    SIM_TCCR1A,
+    SIM_TCCR1B,
+    SIM_TCCR1C,
+    SIM_TIMSK1,
+    SIM_TIFR1,
+    // USART1
+    SIM_UCSR1A,
+    SIM_UCSR1B,
+    SIM_UCSR1C,
+    SIM_UBRR1L,
+    SIM_UBRR1H,
+    // USB general
+    SIM_PLLCSR,
+    SIM_PLLFRQ,
+    SIM_UHWCON,
+    SIM_USBCON,
+    SIM_USBSTA,
+    SIM_USBINT,
+    SIM_UDCON,
+    SIM_UDINT,
+    SIM_UDIEN,
+    SIM_UDADDR,
+    SIM_UDFNUML,
+    SIM_UDFNUMH,
+    SIM_UDMFN,
+    SIM_UENUM,
+    SIM_UERST,
+    SIM_UEINT,
+    // USB per-endpoint, banked by UENUM
+    SIM_UEINTX,
+    SIM_UECONX,
+    SIM_UECFG0X,
+    SIM_UECFG1X,
+    SIM_UESTA0X,
+    SIM_UESTA1X,
+    SIM_UEIENX,
+    SIM_NUM_REGS
+} sim_reg_t;
+
+typedef enum {
+    SIM_TCNT1,
+    SIM_OCR1A,
+    SIM_OCR1B,
+    SIM_UBRR1,
+    SIM_NUM_REGS16
+} sim_reg16_t;
+
+volatile uint8_t *sim_reg(sim_reg_t reg);
+volatile uint16_t *sim_reg16(sim_reg16_t reg);
+volatile uint8_t *sim_uedatx(void);
+volatile uint8_t *sim_udr1(void);
+uint16_t sim_uebcx(void);
+
+#define SREG    (*sim_reg(SIM_SREG))
+#define SMCR    (*sim_reg(SIM_SMCR))
+#define MCUCR   (*sim_reg(SIM_MCUCR))
+#define PRR0    (*sim_reg(SIM_PRR0))
+#define PRR1    (*sim_reg(SIM_PRR1))
+#define GPIOR0  (*sim_reg(SIM_GPIOR0))
+#define GPIOR1  (*sim_reg(SIM_GPIOR1))
+#define GPIOR2  (*sim_reg(SIM_GPIOR2))
+
+#define EICRA   (*sim_reg(SIM_EICRA))
+#define EIMSK   (*sim_reg(SIM_EIMSK))
+
+#define DDRB    (*sim_reg(SIM_DDRB))
+#define PORTB   (*sim_reg(SIM_PORTB))
+#define PINB    (*sim_reg(SIM_PINB))
+#define DDRC    (*sim_reg(SIM_DDRC))
+#define PORTC   (*sim_reg(SIM_PORTC))
+#define PINC    (*sim_reg(SIM_PINC))
+#define DDRD    (*sim_reg(SIM_DDRD))
+#define PORTD   (*sim_reg(SIM_PORTD))
+#define PIND    (*sim_reg(SIM_PIND))
+
+#define TCCR0A  (*sim_reg(SIM_TCCR0A))
+#define TCCR0B  (*sim_reg(SIM_TCCR0B))
+#define TCNT0   (*sim_reg(SIM_TCNT0))
+#define OCR0A   (*sim_reg(SIM_OCR0A))
+#define TIMSK0  (*sim_reg(SIM_TIMSK0))
+#define TIFR0   (*sim_reg(SIM_TIFR0))
+#define TCCR1A  (*sim_reg(SIM_TCCR1A))
+#define TCCR1B  (*sim_reg(SIM_TCCR1B))
+#define TCCR1C  (*sim_reg(SIM_TCCR1C))
+#define TIMSK1  (*sim_reg(SIM_TIMSK1))
+#define TIFR1   (*sim_reg(SIM_TIFR1))
+#define TCNT1   (*sim_reg16(SIM_TCNT1))
+#define OCR1A   (*sim_reg16(SIM_OCR1A))
+#define OCR1B   (*sim_reg16(SIM_OCR1B))
+
+#define UCSR1A  (*sim_reg(SIM_UCSR1A))
+#define UCSR1B  (*sim_reg(SIM_UCSR1B))
+#define UCSR1C  (*sim_reg(SIM_UCSR1C))
+#define UBRR1L  (*sim_reg(SIM_UBRR1L))
+#define UBRR1H  (*sim_reg(SIM_UBRR1H))
+#define UBRR1   (*sim_reg16(SIM_UBRR1))
+#define UDR1    (*sim_udr1())
+
+#define PLLCSR  (*sim_reg(SIM_PLLCSR))
+#define PLLFRQ  (*sim_reg(SIM_PLLFRQ))
+#define UHWCON  (*sim_reg(SIM_UHWCON))
+#define USBCON  (*sim_reg(SIM_USBCON))
+#define USBSTA  (*sim_reg(SIM_USBSTA))
+#define USBINT  (*sim_reg(SIM_USBINT))
+#define UDCON   (*sim_reg(SIM_UDCON))
+#define UDINT   (*sim_reg(SIM_UDINT))
+#define UDIEN   (*sim_reg(SIM_UDIEN))
+#define UDADDR  (*sim_reg(SIM_UDADDR))
+#define UDFNUML (*sim_reg(SIM_UDFNUML))
+#define UDFNUMH (*sim_reg(SIM_UDFNUMH))
+#define UDMFN   (*sim_reg(SIM_UDMFN))
+#define UENUM   (*sim_reg(SIM_UENUM))
+#define UERST   (*sim_reg(SIM_UERST))
+#define UEINT   (*sim_reg(SIM_UEINT))
+#define UEINTX  (*sim_reg(SIM_UEINTX))
+#define UECONX  (*sim_reg(SIM_UECONX))
+#define UECFG0X (*sim_reg(SIM_UECFG0X))
+#define UECFG1X (*sim_reg(SIM_UECFG1X))
+#define UESTA0X (*sim_reg(SIM_UESTA0X))
+#define UESTA1X (*sim_reg(SIM_UESTA1X))
+#define UEIENX  (*sim_reg(SIM_UEIENX))
+#define UEDATX  (*sim_uedatx())
+#define UEBCX   (sim_uebcx())
+#define UEBCLX  ((uint8_t)sim_uebcx())
+#define UEBCHX  ((uint8_t)(sim_uebcx() >> 8))
+
+// SREG
+#define SREG_I 7
+
+// SMCR
+#define SM2 3
+#define SM2 3
+#define SM1 2
+#define SM0 1
+#define SE 0
+
+// PRR1
+#define PRUSB 7
+#define PRTIM3 3
+#define PRUSART1 0
+
+// EICRA / EIMSK
+#define ISC21 5
+#define ISC20 4
+#define INT2 2
+
+// ports
+#define PC7 7
+#define PC6 6
+#define PD3 3
+
+// timers
+#define WGM01 1
+#define WGM00 0
+#define CS02 2
+#define CS01 1
+#define CS00 0
+#define OCIE0A 1
+#define TOIE0 0
+#define OCF0A 1
+#define WGM11 1
+#define WGM10 0
+#define WGM13 4
+#define WGM12 3
+#define CS12 2
+#define CS11 1
+#define CS10 0
+#define OCIE1A 1
+#define TOIE1 0
+#define OCF1A 1
+#define TOV1 0
+
+// UCSR1A
+#define RXC1 7
+#define TXC1 6
+#define UDRE1 5
+#define FE1 4
+#define DOR1 3
+#define UPE1 2
+#define U2X1 1
+#define MPCM1 0
+
+// UCSR1B
+#define RXCIE1 7
+#define TXCIE1 6
+#define UDRIE1 5
+#define RXEN1 4
+#define TXEN1 3
+#define UCSZ12 2
+#define RXB81 1
+#define TXB81 0
+
+// UCSR1C
+#define UMSEL11 7
+#define UMSEL10 6
+#define UPM11 5
+#define UPM10 4
+#define USBS1 3
+#define UCSZ11 2
+#define UCSZ10 1
+#define UCPOL1 0
+
+// PLLCSR / PLLFRQ
+#define PINDIV 4
+#define PLLE 1
+#define PLOCK 0
+#define PINMUX 7
+#define PLLUSB 6
+#define PLLTM1 5
+#define PLLTM0 4
+#define PDIV3 3
+#define PDIV2 2
+#define PDIV1 1
+#define PDIV0 0
+
+// UHWCON
+#define UVREGE 0
+
+// USBCON
+#define USBE 7
+#define FRZCLK 5
+#define OTGPADE 4
+#define VBUSTE 0
+
+// USBSTA
+#define SPEED 3
+#define ID 1
+#define VBUS 0
+
+// USBINT
+#define VBUSTI 0
+
+// UDCON
+#define RSTCPU 3
+#define LSM 2
+#define RMWKUP 1
+#define DETACH 0
+
+// UDINT
+#define UPRSMI 6
+#define EORSMI 5
+#define WAKEUPI 4
+#define EORSTI 3
+#define SOFI 2
+#define SUSPI 0
+
+// UDIEN
+#define UPRSME 6
+#define EORSME 5
+#define WAKEUPE 4
+#define EORSTE 3
+#define SOFE 2
+#define SUSPE 0
+
+// UDADDR
+#define ADDEN 7
+
+// UDMFN
+#define FNCERR 4
+
+// UEINTX
+#define FIFOCON 7
+#define NAKINI 6
+#define RWAL 5
+#define NAKOUTI 4
+#define RXSTPI 3
+#define RXOUTI 2
+#define STALLEDI 1
+#define TXINI 0
+
+// UECONX
+#define STALLRQ 5
+#define STALLRQC 4
+#define RSTDT 3
+#define EPEN 0
+
+// UECFG0X
+#define EPTYPE1 7
+#define EPTYPE0 6
+#define EPDIR 0
+
+// UECFG1X
+#define EPSIZE2 6
+#define EPSIZE1 5
+#define EPSIZE0 4
+#define EPBK1 3
+#define EPBK0 2
+#define ALLOC 1
+
+// UESTA0X
+#define CFGOK 7
+#define OVERFI 6
+#define UNDERFI 5
+#define DTSEQ1 3
+#define DTSEQ0 2
+#define NBUSYBK1 1
+#define NBUSYBK0 0
+
+// UESTA1X
+#define CTRLDIR 2
+#define CURRBK1 1
+#define CURRBK0 0
+
+// UEIENX
+#define FLERRE 7
+#define NAKINE 6
+#define NAKOUTE 4
+#define RXSTPE 3
+#define RXOUTE 2
+#define STALLEDE 1
+#define TXINE 0
+
+/**
+ * Interrupt vectors. ISR(USB_COM_vect) defines sim_usb_com_vect(), which the
+ * simulated controller calls when the interrupt is pending and enabled.
+ */
+#define INT2_vect sim_int2_vect
+#define USB_GEN_vect sim_usb_gen_vect
+#define USB_COM_vect sim_usb_com_vect
+#define TIMER0_COMPA_vect sim_timer0_compa_vect
+#define TIMER1_COMPA_vect sim_timer1_compa_vect
+#define TIMER1_OVF_vect sim_timer1_ovf_vect
+#define USART1_RX_vect sim_usart1_rx_vect
+#define USART1_UDRE_vect sim_usart1_udre_vect
+
+void sim_int2_vect(void);
+void sim_usb_gen_vect(void);
+void sim_usb_com_vect(void);
+void sim_timer0_compa_vect(void);
+void sim_timer1_compa_vect(void);
+void sim_timer1_ovf_vect(void);
+void sim_usart1_rx_vect(void);
+void sim_usart1_udre_vect(void);
@@ -0,0 +1,18 @@
+#pragma once
+/**
+ * Host stand-in for avr-libc's <avr/pgmspace.h>. There is a single address
+ * space on the host, so program memory reads are plain loads.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+#define pgm_read_ptr(addr) (*(const void *const *)(addr))
+
+#define memcpy_P memcpy
+#define strlen_P strlen
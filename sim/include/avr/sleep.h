@@ -0,0 +1,21 @@
+#pragma once
+/**
+ * Host stand-in for avr-libc's <avr/sleep.h>. Sleeping takes no time in the
+ * simulation: sleep_cpu() counts the sleep and delivers pending interrupts,
+ * as the wake-up would.
+ */
+
+#include <avr/io.h>
+
+#define SLEEP_MODE_IDLE 0
+#define SLEEP_MODE_PWR_DOWN _BV(SM1)
+#define SLEEP_MODE_PWR_SAVE (_BV(SM0) | _BV(SM1))
+#define SLEEP_MODE_STANDBY (_BV(SM1) | _BV(SM2))
+
+void sim_sleep(void);
+
+#define set_sleep_mode(mode) \
+    (SMCR = (SMCR & ~(_BV(SM0) | _BV(SM1) | _BV(SM2))) | (mode))
+#define sleep_enable() (SMCR |= _BV(SE))
+#define sleep_disable() (SMCR &= ~_BV(SE))
+#define sleep_cpu() sim_sleep()
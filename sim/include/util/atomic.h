@@ -0,0 +1,22 @@
+#pragma once
+/**
+ * Host stand-in for avr-libc's <util/atomic.h>, built on the simulated SREG.
+ */
+
+#include <avr/interrupt.h>
+
+#include <stdint.h>
+
+uint8_t sim_sreg_save_cli(void);
+void sim_sreg_restore(const uint8_t *sreg);
+void sim_sreg_force_on(const uint8_t *sreg);
+void sim_sreg_force_off(const uint8_t *sreg);
+
+#define ATOMIC_RESTORESTATE sim_sreg_restore
+#define ATOMIC_FORCEON sim_sreg_force_on
+#define NONATOMIC_RESTORESTATE sim_sreg_restore
+#define NONATOMIC_FORCEOFF sim_sreg_force_off
+
+#define ATOMIC_BLOCK(type) \
+    for(uint8_t sim_sreg_save __attribute__((cleanup(type))) = sim_sreg_save_cli(), \
+        sim_todo = 1; sim_todo; sim_todo = 0)
@@ -0,0 +1,10 @@
+#pragma once
+/**
+ * Host stand-in for avr-libc's <util/delay.h>. Busy waits take no time in the
+ * simulation; the delay is only accounted for in the simulator statistics.
+ */
+
+void sim_delay_us(double us);
+
+#define _delay_us(us) sim_delay_us(us)
+#define _delay_ms(ms) sim_delay_us((ms) * 1000.0)
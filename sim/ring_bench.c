@@ -0,0 +1,149 @@
+/**
+ * Host comparison of the RING_DEFINE rings against base_queue's queue_t, on
+ * the access patterns of the drivers:
+ *   uart  one byte pushed and popped at a time, with a status check each,
+ *         as by uart_puts_noblock and USART1_UDRE_vect
+ *   ep    64-byte writes by the main loop, drained a bank at a time into a
+ *         FIFO register, as by the software-queue IN path (flush_queue)
+ *
+ * Times are host CPU time and only show the relative cost of the two. They
+ * are not AVR cycles.
+ */
+#include "ring.h"
+#include "queue/queue.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define RING_LEN 128
+#define BANK 64
+
+RING_DEFINE(bench_ring, RING_LEN)
+
+// stands in for UDR1 / UEDATX
+static volatile uint8_t fifo;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static unsigned long uart_queue(unsigned long bytes) {
+    static char buf[RING_LEN];
+    queue_t q;
+    unsigned long moved = 0;
+
+    queue_init(&q, buf, sizeof(buf));
+    for(unsigned long i = 0; i < bytes; i++) {
+        queue_push(&q, (char)i);
+        if(!q.op_ok) {
+            q.op_ok = true;
+        }
+        char c = queue_pop(&q);
+        if(!q.op_ok) {
+            q.op_ok = true;
+        }
+        else {
+            fifo = c;
+            moved++;
+        }
+    }
+    return moved;
+}
+
+static unsigned long uart_ring(unsigned long bytes) {
+    static bench_ring_t r;
+    unsigned long moved = 0;
+    uint8_t c;
+
+    bench_ring_reset(&r);
+    for(unsigned long i = 0; i < bytes; i++) {
+        bench_ring_push(&r, (uint8_t)i);
+        if(bench_ring_pop(&r, &c)) {
+            fifo = c;
+            moved++;
+        }
+    }
+    return moved;
+}
+
+static unsigned long ep_queue(unsigned long bytes) {
+    static char buf[RING_LEN];
+    static uint8_t src[BANK];
+    queue_t q;
+    unsigned long moved = 0;
+
+    queue_init(&q, buf, sizeof(buf));
+    while(moved < bytes) {
+        for(int i = 0; i < BANK; i++) {
+            queue_push(&q, src[i]);
+            if(!q.op_ok) {
+                q.op_ok = true;
+                break;
+            }
+        }
+        // flush_queue: check for data, burst a bank
+        uint16_t n = q.size < BANK ? q.size : BANK;
+        while(!QUEUE_EMPTY(&q) && n--) {
+            fifo = queue_pop(&q);
+            moved++;
+        }
+    }
+    return moved;
+}
+
+static unsigned long ep_ring(unsigned long bytes) {
+    static bench_ring_t r;
+    static uint8_t src[BANK];
+    unsigned long moved = 0;
+    const uint8_t *span;
+    uint8_t n, len;
+
+    bench_ring_reset(&r);
+    while(moved < bytes) {
+        bench_ring_write(&r, src, BANK);
+        n = bench_ring_count(&r) < BANK ? bench_ring_count(&r) : BANK;
+        while(n) {
+            span = bench_ring_read_span(&r, &len);
+            len = len < n ? len : n;
+            for(uint8_t i = 0; i < len; i++) {
+                fifo = span[i];
+            }
+            bench_ring_consume(&r, len);
+            n -= len;
+            moved += len;
+        }
+    }
+    return moved;
+}
+
+typedef struct {
+    const char *name;
+    unsigned long (*run)(unsigned long bytes);
+} path_t;
+
+static const path_t paths[] = {
+    {"uart, queue_t", uart_queue},
+    {"uart, ring", uart_ring},
+    {"ep, queue_t", ep_queue},
+    {"ep, ring", ep_ring},
+};
+
+int main(int argc, char **argv) {
+    unsigned long bytes = argc > 1 ? strtoul(argv[1], NULL, 0) : 20000000;
+    double start, secs;
+    unsigned long moved;
+
+    printf("ring vs queue_t, %lu bytes per path\n", bytes);
+    for(size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+        start = now();
+        moved = paths[i].run(bytes);
+        secs = now() - start;
+        printf("  %-24s %.2f ns/byte\n", paths[i].name,
+            moved ? secs * 1e9 / moved : 0);
+    }
+    return 0;
+}
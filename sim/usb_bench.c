@@ -0,0 +1,1345 @@
+/**
+ * Throughput benchmarks for the USB driver, run against the simulated
+ * controller. Each scenario scripts host traffic and reports bytes/s (host
+ * time, useful for comparing driver revisions only), USB ISR invocations per
+ * transfer and simulated register accesses per byte, overall and inside the
+ * USB ISRs.
+ *
+ * usage: usb_bench <scenario> [iterations]
+ */
+
+#include "usb_sim.h"
+
+#include "32u4_usb.h"
+#include "usb_requests.h"
+#include "usb_base_descriptors.h"
+#include "usb_cdc_descriptors.h"
+#include "usb_descriptors.h"
+#include "drivers/uart.h"
+
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NOTIFY_EP 1
+#define BULK_IN_EP 2
+#define BULK_OUT_EP 3
+#define BULK_PACKET 64
+// back-to-back tokens the host sends between two firmware service rounds
+#define BULK_TOKENS_PER_ROUND 4
+
+typedef struct {
+    const char *unit;
+    uint64_t bytes;
+    uint32_t transfers;
+    // tokens NAKed as flow control, which the scenario expects under load
+    uint32_t naks;
+    // anything else that went wrong: the benchmark fails
+    uint32_t failures;
+    // bytes received out of order or corrupted
+    uint32_t data_errors;
+    // register accesses from an event to the first packet after it, eg. a
+    // resume
+    uint64_t latency;
+    uint32_t latencies;
+    // 1ms bus frames the scenario ran for, 0 if it does not keep to them
+    uint32_t frames;
+} bench_result_t;
+
+typedef struct {
+    const char *name;
+    const char *description;
+    void (*run)(unsigned long iterations, bench_result_t *res);
+    unsigned long iterations;
+} bench_t;
+
+static void setup_req(uint8_t *setup, uint8_t type, uint8_t req,
+        uint16_t value, uint16_t index, uint16_t length) {
+    usb_req_std_t *std = (usb_req_std_t *)setup;
+    std->bmRequestType = type;
+    std->bRequest = req;
+    std->wValue = value;
+    std->wIndex = index;
+    std->wLength = length;
+}
+
+/**
+ * Count a token the device may NAK under load: a NAK is flow control, any
+ * other error a failure.
+ */
+static void count_nak(bench_result_t *res, int r) {
+    if(r == SIM_NAK) {
+        res->naks++;
+    }
+    else {
+        res->failures++;
+    }
+}
+
+static int get_descriptor(uint8_t type, uint8_t index, uint8_t *buf, uint16_t len) {
+    uint8_t setup[8];
+    setup_req(setup, 0x80, USB_REQ_GET_DESCRIPTOR, (type << 8) | index, 0, len);
+    return sim_usb_control(setup, buf);
+}
+
+static int no_data_request(uint8_t req, uint16_t value) {
+    uint8_t setup[8];
+    setup_req(setup, 0x00, req, value, 0, 0);
+    return sim_usb_control(setup, NULL);
+}
+
+static void device_power_on(void) {
+    sim_power_on();
+    configure_uart(115200);
+    atmega_xu4_setup_usb();
+    sei();
+}
+
+/**
+ * The request sequence a Linux host issues to enumerate the device.
+ * @return number of control transfers that failed
+ */
+static uint32_t enumerate(uint64_t *bytes, uint32_t *transfers) {
+    uint8_t buf[256];
+    uint32_t failures = 0;
+    int r;
+
+    sim_usb_bus_reset();
+    const struct {
+        uint8_t type;
+        uint16_t len;
+    } descs[] = {
+        {USB_DESC_DEVICE, 64},
+        {USB_DESC_DEVICE, sizeof(usb_device_desc_t)},
+        {USB_DESC_CONFIGURATION, sizeof(usb_config_desc_t)},
+        {USB_DESC_CONFIGURATION, 255},
+    };
+    for(size_t i = 0; i < sizeof(descs) / sizeof(descs[0]); i++) {
+        if(i == 1) {
+            failures += no_data_request(USB_REQ_SET_ADDRESS, 1) < 0;
+            (*transfers)++;
+        }
+        r = get_descriptor(descs[i].type, 0, buf, descs[i].len);
+        if(r < 0) {
+            failures++;
+        }
+        else {
+            *bytes += r;
+        }
+        (*transfers)++;
+    }
+    failures += no_data_request(USB_REQ_SET_CONFIGURATION, 1) < 0;
+    (*transfers)++;
+    return failures;
+}
+
+static void bench_ep0_enum(unsigned long iterations, bench_result_t *res) {
+    res->unit = "control transfers";
+    for(unsigned long i = 0; i < iterations; i++) {
+        res->failures += enumerate(&res->bytes, &res->transfers);
+    }
+}
+
+static void bench_ep0_config_desc(unsigned long iterations, bench_result_t *res) {
+    uint8_t buf[256];
+    uint32_t dummy = 0;
+    uint64_t dummy_bytes = 0;
+
+    enumerate(&dummy_bytes, &dummy);
+    sim_stats_reset();
+    res->unit = "control transfers";
+    for(unsigned long i = 0; i < iterations; i++) {
+        int r = get_descriptor(USB_DESC_CONFIGURATION, 0, buf, 255);
+        if(r < 0) {
+            res->failures++;
+        }
+        else {
+            res->bytes += r;
+        }
+        res->transfers++;
+    }
+}
+
+// A chain of RAM, program memory and empty segments, empty ones first, in
+// a row and last. Its segments cross the packet boundaries of EP0 and of
+// the interrupt and bulk endpoints.
+static const char chain_pgm[] PROGMEM =
+    "flash segment crossing a packet boundary, seventy bytes long, ok.....";
+static uint8_t chain_ram[64];
+static const mqueue_seg_t chain_segs[] = {
+    MQUEUE_SEG(chain_ram, 0, &chain_segs[1]),
+    MQUEUE_SEG(chain_ram, 10, &chain_segs[2]),
+    MQUEUE_SEG_P(chain_pgm, sizeof(chain_pgm) - 1, &chain_segs[3]),
+    MQUEUE_SEG_P(chain_pgm, 0, &chain_segs[4]),
+    MQUEUE_SEG(chain_ram + 10, 1, &chain_segs[5]),
+    MQUEUE_SEG(chain_ram, 0, &chain_segs[6]),
+    MQUEUE_SEG(chain_ram + 11, 53, &chain_segs[7]),
+    MQUEUE_SEG_P(chain_pgm, 0, NULL),
+};
+// what the chain reads as
+#define CHAIN_LEN (64 + sizeof(chain_pgm) - 1)
+static uint8_t chain_bytes[CHAIN_LEN];
+
+static void chain_setup(void) {
+    for(size_t k = 0; k < sizeof(chain_ram); k++) {
+        chain_ram[k] = 0x80 + k;
+    }
+    memcpy(chain_bytes, chain_ram, 10);
+    memcpy(chain_bytes + 10, chain_pgm, sizeof(chain_pgm) - 1);
+    memcpy(chain_bytes + 10 + sizeof(chain_pgm) - 1, chain_ram + 10, 54);
+}
+
+/**
+ * Count the bytes of data that differ from the chain, starting at byte pos
+ * of it.
+ */
+static uint32_t chain_errors(const uint8_t *data, size_t pos, size_t n) {
+    uint32_t errors = 0;
+    for(size_t k = 0; k < n; k++) {
+        errors += pos + k >= CHAIN_LEN || data[k] != chain_bytes[pos + k];
+    }
+    return errors;
+}
+
+// vendor request to interface 0, answered with the chain
+#define CHAIN_VENDOR_REQ 0x42
+
+static bool chain_request(const usb_req_std_t *req) {
+    if(req->bRequest != CHAIN_VENDOR_REQ) {
+        return false;
+    }
+    atmega_xu4_ep0_send_chain(chain_segs, req->wLength);
+    return true;
+}
+
+/**
+ * The chain as the data stage of a control IN transfer, whole and cut short
+ * by wLength in turn. Packets are 64 bytes at most, see ATMEGA_XU4_EP0_SIZE.
+ */
+static void bench_chain_ep0(unsigned long iterations, bench_result_t *res) {
+    static const uint16_t wlengths[] = {CHAIN_LEN + 16, CHAIN_LEN, 100, 64, 1};
+    uint8_t buf[CHAIN_LEN + 16];
+    uint8_t setup[8];
+    uint32_t dummy = 0;
+    uint64_t dummy_bytes = 0;
+    uint16_t wlength;
+    int r;
+
+    chain_setup();
+    res->unit = "control transfers";
+    res->failures = enumerate(&dummy_bytes, &dummy);
+    atmega_xu4_install_req_handler(USB_REQ_TYPE_VENDOR, USB_REQ_RCPT_INTERFACE,
+            0, chain_request);
+    sim_stats_reset();
+    for(unsigned long i = 0; i < iterations; i++) {
+        wlength = wlengths[i % (sizeof(wlengths) / sizeof(wlengths[0]))];
+        setup_req(setup, 0xC1, CHAIN_VENDOR_REQ, 0, 0, wlength);
+        memset(buf, 0, sizeof(buf));
+        r = sim_usb_control(setup, buf);
+        if(r != (int)(wlength < CHAIN_LEN ? wlength : CHAIN_LEN)) {
+            res->failures++;
+            continue;
+        }
+        res->data_errors += chain_errors(buf, 0, r);
+        res->bytes += r;
+        res->transfers++;
+    }
+}
+
+#if !defined(ACM_BRIDGE)
+static volatile bool chain_uart_done;
+
+static void chain_uart_sent(void) {
+    chain_uart_done = true;
+}
+
+/**
+ * The chain sent on USART1 with uart_send_chain, then bytes written with
+ * uart_puts_noblock while it is still going out, which follow it.
+ */
+static void bench_chain_uart(unsigned long iterations, bench_result_t *res) {
+    static char trailer[] = "\r\n";
+    uint8_t buf[CHAIN_LEN + sizeof(trailer)];
+    mqueue_t q;
+    size_t n, got;
+
+    chain_setup();
+    device_power_on();
+    res->unit = "chains";
+    sim_stats_reset();
+    for(unsigned long i = 0; i < iterations; i++) {
+        chain_uart_done = false;
+        mqueue_init_chain(&q, chain_segs, CHAIN_LEN);
+        if(!uart_send_chain(&q, chain_uart_sent)) {
+            res->failures++;
+            continue;
+        }
+        // a second chain has to wait for the first
+        res->failures += uart_send_chain(&q, NULL);
+        res->failures += uart_puts_noblock(trailer, sizeof(trailer) - 1)
+            != sizeof(trailer) - 1;
+        sim_service();
+        for(got = 0; (n = sim_uart_tx_drain(buf + got, sizeof(buf) - got)) > 0;
+                got += n) {
+            sim_service();
+        }
+        res->failures += !chain_uart_done || got != CHAIN_LEN + sizeof(trailer) - 1;
+        res->data_errors += chain_errors(buf, 0, got < CHAIN_LEN ? got : CHAIN_LEN);
+        if(got == CHAIN_LEN + sizeof(trailer) - 1) {
+            res->data_errors += memcmp(buf + CHAIN_LEN, trailer, sizeof(trailer) - 1) != 0;
+        }
+        res->bytes += got;
+        res->transfers++;
+    }
+}
+#endif
+
+#if !defined(ACM_BRIDGE) && USB_NUM_ACM_FUNCTIONS
+// the demo stream of port 0: transfers of two packets, each the message
+// repeated from its start, sent from a chain of program memory segments
+static const char demo_msg[] = "the cake is a lie\r\n";
+#define DEMO_XFER_LEN (2 * BULK_PACKET)
+
+static void bench_bulk_in(unsigned long iterations, bench_result_t *res) {
+    uint8_t buf[BULK_PACKET];
+    uint32_t dummy = 0;
+    uint64_t dummy_bytes = 0;
+    size_t pos = 0;
+
+    res->unit = "packets";
+    res->failures = enumerate(&dummy_bytes, &dummy);
+    sim_stats_reset();
+    // each round, the host sends a burst of IN tokens before the firmware
+    // gets to run: single-banked endpoints NAK all but the first
+    for(unsigned long i = 0; i < iterations; i++) {
+        for(int t = 0; t < BULK_TOKENS_PER_ROUND; t++) {
+            int r = sim_usb_in(BULK_IN_EP, buf, sizeof(buf));
+            if(r < 0) {
+                count_nak(res, r);
+                continue;
+            }
+            for(int k = 0; k < r; k++, pos = (pos + 1) % DEMO_XFER_LEN) {
+                res->data_errors += buf[k]
+                    != demo_msg[pos % (sizeof(demo_msg) - 1)];
+            }
+            res->bytes += r;
+            res->transfers++;
+        }
+        sim_service();
+    }
+}
+
+/**
+ * Host sends BULK_TOKENS_PER_ROUND packets of 0..63 per round, the firmware
+ * main loop reads up to read_per_round bytes with usb_cdc_read after it.
+ */
+static void bulk_out(unsigned long iterations, bench_result_t *res, size_t read_per_round) {
+    uint8_t packet[BULK_PACKET];
+    uint8_t rx[BULK_TOKENS_PER_ROUND * BULK_PACKET];
+    uint8_t expect = 0;
+    uint32_t dummy = 0;
+    uint64_t dummy_bytes = 0;
+    int r;
+
+    for(size_t i = 0; i < sizeof(packet); i++) {
+        packet[i] = i;
+    }
+    res->unit = "packets";
+    res->failures = enumerate(&dummy_bytes, &dummy);
+    sim_stats_reset();
+    for(unsigned long i = 0; i < iterations; i++) {
+        for(int t = 0; t < BULK_TOKENS_PER_ROUND; t++) {
+            r = sim_usb_out(BULK_OUT_EP, packet, sizeof(packet));
+            if(r == SIM_ACK) {
+                res->transfers++;
+            }
+            else {
+                count_nak(res, r);
+            }
+        }
+        sim_service();
+        size_t n = usb_cdc_read(rx, read_per_round);
+        for(size_t k = 0; k < n; k++) {
+            res->data_errors += rx[k] != expect;
+            expect = (expect + 1) % BULK_PACKET;
+        }
+        res->bytes += n;
+        sim_service();
+    }
+}
+
+static void bench_bulk_out(unsigned long iterations, bench_result_t *res) {
+    bulk_out(iterations, res, BULK_TOKENS_PER_ROUND * BULK_PACKET);
+}
+
+static void bench_bulk_out_slow_reader(unsigned long iterations, bench_result_t *res) {
+    bulk_out(iterations, res, BULK_PACKET / 2);
+}
+
+// OUT transfers kept in flight on the bulk OUT endpoint, in place of the
+// CDC receive queue
+#define XFER_OUT_LEN (4 * BULK_PACKET)
+static uint8_t xfer_out_bufs[2][XFER_OUT_LEN];
+static usb_xfer_t xfer_out[2];
+
+static void xfer_out_done(usb_xfer_t *xfer) {
+    bench_result_t *res = xfer->user;
+    for(uint16_t k = 0; k < xfer->actual; k++) {
+        res->data_errors += xfer->buf[k] != (k % BULK_PACKET);
+    }
+    res->bytes += xfer->actual;
+    atmega_xu4_submit(BULK_OUT_EP, xfer);
+}
+
+static void bench_bulk_out_xfer(unsigned long iterations, bench_result_t *res) {
+    uint8_t packet[BULK_PACKET];
+    uint32_t dummy = 0;
+    uint64_t dummy_bytes = 0;
+    int r;
+
+    for(size_t i = 0; i < sizeof(packet); i++) {
+        packet[i] = i;
+    }
+    res->unit = "packets";
+    res->failures = enumerate(&dummy_bytes, &dummy);
+    for(int i = 0; i < 2; i++) {
+        xfer_out[i].buf = xfer_out_bufs[i];
+        xfer_out[i].len = XFER_OUT_LEN;
+        xfer_out[i].complete = xfer_out_done;
+        xfer_out[i].user = res;
+        atmega_xu4_submit(BULK_OUT_EP, &xfer_out[i]);
+    }
+    sim_stats_reset();
+    for(unsigned long i = 0; i < iterations; i++) {
+        for(int t = 0; t < BULK_TOKENS_PER_ROUND; t++) {
+            r = sim_usb_out(BULK_OUT_EP, packet, sizeof(packet));
+            if(r == SIM_ACK) {
+                res->transfers++;
+            }
+            else {
+                count_nak(res, r);
+            }
+        }
+        sim_service();
+    }
+}
+
+// transfers smaller than a packet, and a host write of two full packets
+// and a short one: SMALL_XFER_LEN and the rest of the write
+#define SMALL_XFER_LEN 24
+#define SMALL_WRITE_TAIL 50
+#define SMALL_WRITE_LEN (2 * BULK_PACKET + SMALL_WRITE_TAIL)
+static uint16_t small_xfer_pos;
+static uint32_t small_stream_pos;
+
+static void small_xfer_done(usb_xfer_t *xfer) {
+    bench_result_t *res = xfer->user;
+    // full transfers until the short packet ends the write
+    uint16_t expect = SMALL_WRITE_LEN - small_xfer_pos < SMALL_XFER_LEN ?
+        SMALL_WRITE_LEN - small_xfer_pos : SMALL_XFER_LEN;
+
+    res->failures += xfer->actual != expect;
+    for(uint16_t k = 0; k < xfer->actual; k++) {
+        res->data_errors += xfer->buf[k] != (uint8_t)small_stream_pos++;
+    }
+    small_xfer_pos += xfer->actual;
+    if(small_xfer_pos == SMALL_WRITE_LEN) {
+        small_xfer_pos = 0;
+    }
+    res->bytes += xfer->actual;
+    atmega_xu4_submit(BULK_OUT_EP, xfer);
+}
+
+/**
+ * OUT transfers smaller than a packet: a packet spans several, and only the
+ * transfer that takes the last byte of the short packet ends early. Every
+ * completion is checked for its size.
+ */
+static void bench_bulk_out_xfer_small(unsigned long iterations, bench_result_t *res) {
+    uint8_t packet[BULK_PACKET];
+    uint8_t seq = 0;
+    uint32_t dummy = 0;
+    uint64_t dummy_bytes = 0;
+    size_t n;
+    int r;
+
+    res->unit = "packets";
+    res->failures = enumerate(&dummy_bytes, &dummy);
+    small_xfer_pos = 0;
+    small_stream_pos = 0;
+    for(int i = 0; i < 2; i++) {
+        xfer_out[i].buf = xfer_out_bufs[i];
+        xfer_out[i].len = SMALL_XFER_LEN;
+        xfer_out[i].complete = small_xfer_done;
+        xfer_out[i].user = res;
+        atmega_xu4_submit(BULK_OUT_EP, &xfer_out[i]);
+    }
+    sim_stats_reset();
+    for(unsigned long i = 0; i < iterations; i++) {
+        n = (i % 3 == 2) ? SMALL_WRITE_TAIL : BULK_PACKET;
+        for(size_t k = 0; k < n; k++) {
+            packet[k] = seq++;
+        }
+        // NAKed while both banks wait for a transfer, the host retries
+        for(int t = 0; t < BULK_TOKENS_PER_ROUND; t++) {
+            r = sim_usb_out(BULK_OUT_EP, packet, n);
+            if(r == SIM_ACK) {
+                break;
+            }
+            count_nak(res, r);
+            sim_service();
+        }
+        if(r == SIM_ACK) {
+            res->transfers++;
+        }
+        else {
+            res->failures++;
+        }
+        sim_service();
+    }
+}
+
+// interrupt IN transfers kept in flight on the notification endpoint
+#define NOTIFY_PACKET 16
+static uint8_t notify_buf[NOTIFY_PACKET];
+static usb_xfer_t notify_xfer;
+
+static void notify_done(usb_xfer_t *xfer) {
+    atmega_xu4_submit(NOTIFY_EP, xfer);
+}
+
+// IN transfers sent from the chain, see chain_segs
+static mqueue_t chain_queue;
+static usb_xfer_t chain_xfer;
+
+static void chain_xfer_submit(usb_xfer_t *xfer) {
+    mqueue_init_chain(xfer->chain, chain_segs, CHAIN_LEN);
+    atmega_xu4_submit(NOTIFY_EP, xfer);
+}
+
+/**
+ * The chain as the data of interrupt IN transfers, resubmitted as each
+ * completes. The host reads it in NOTIFY_PACKET byte packets, the last one
+ * short.
+ */
+static void bench_chain_xfer(unsigned long iterations, bench_result_t *res) {
+    uint8_t buf[NOTIFY_PACKET];
+    uint32_t dummy = 0;
+    uint64_t dummy_bytes = 0;
+    size_t pos;
+    int r;
+
+    chain_setup();
+    res->unit = "transfers";
+    res->failures = enumerate(&dummy_bytes, &dummy);
+    // take the SERIAL_STATE notification sent on configuration
+    sim_service();
+    while(sim_usb_in(NOTIFY_EP, buf, sizeof(buf)) > 0) {
+        sim_service();
+    }
+    chain_xfer.chain = &chain_queue;
+    chain_xfer.complete = chain_xfer_submit;
+    chain_xfer_submit(&chain_xfer);
+    sim_service();
+    sim_stats_reset();
+    for(unsigned long i = 0; i < iterations; i++) {
+        for(pos = 0; pos < CHAIN_LEN; pos += r) {
+            r = sim_usb_in(NOTIFY_EP, buf, sizeof(buf));
+            // every packet is full but the last
+            if(r < 0 || (r < NOTIFY_PACKET && pos + r < CHAIN_LEN)) {
+                res->failures++;
+                break;
+            }
+            res->data_errors += chain_errors(buf, pos, r);
+            res->bytes += r;
+            sim_service();
+        }
+        res->transfers++;
+    }
+}
+
+/**
+ * USB_COM_vect dispatch cost: every round, the host generates one event on
+ * each of n endpoints before the firmware runs, so a single ISR invocation
+ * serves them all.
+ *  1: bulk IN
+ *  2: bulk IN, bulk OUT
+ *  4: bulk IN, bulk OUT, interrupt IN, and a no-data control request
+ */
+static void dispatch(unsigned long iterations, bench_result_t *res, int n) {
+    uint8_t packet[BULK_PACKET] = {0};
+    uint8_t rx[BULK_PACKET];
+    uint8_t setup[8];
+    uint32_t dummy = 0;
+    uint64_t dummy_bytes = 0;
+    int r;
+
+    setup_req(setup, 0x21, 0x22, 0, 0, 0); // SET_CONTROL_LINE_STATE
+    res->unit = "endpoint events";
+    res->failures = enumerate(&dummy_bytes, &dummy);
+    if(n >= 4) {
+        notify_xfer.buf = notify_buf;
+        notify_xfer.len = sizeof(notify_buf);
+        notify_xfer.complete = notify_done;
+        atmega_xu4_submit(NOTIFY_EP, &notify_xfer);
+        sim_service();
+    }
+    // fill the IN banks
+    sim_service();
+    sim_stats_reset();
+    for(unsigned long i = 0; i < iterations; i++) {
+        r = sim_usb_in(BULK_IN_EP, NULL, 0);
+        res->bytes += r > 0 ? r : 0;
+        res->transfers++;
+        if(n >= 2) {
+            res->failures += sim_usb_out(BULK_OUT_EP, packet, sizeof(packet)) != SIM_ACK;
+            res->bytes += sizeof(packet);
+            res->transfers++;
+        }
+        if(n >= 4) {
+            r = sim_usb_in(NOTIFY_EP, NULL, 0);
+            res->bytes += r > 0 ? r : 0;
+            res->failures += r < 0;
+            res->failures += sim_usb_setup(0, setup) != SIM_ACK;
+            res->transfers += 2;
+        }
+        sim_service();
+        if(n >= 2) {
+            usb_cdc_read(rx, sizeof(rx));
+        }
+        if(n >= 4) {
+            // take the status stage ZLP
+            res->failures += sim_usb_in(0, NULL, 0) != 0;
+            sim_service();
+        }
+    }
+}
+
+static void bench_dispatch_1(unsigned long iterations, bench_result_t *res) {
+    dispatch(iterations, res, 1);
+}
+
+static void bench_dispatch_2(unsigned long iterations, bench_result_t *res) {
+    dispatch(iterations, res, 2);
+}
+
+static void bench_dispatch_4(unsigned long iterations, bench_result_t *res) {
+    dispatch(iterations, res, 4);
+}
+
+#if USB_NUM_ACM_FUNCTIONS > 1
+#define PORT_EPS(intf, notify, in, out) {in, out},
+// bulk IN and OUT endpoint of each port
+static const uint8_t port_eps[][2] = {
+    USB_ACM_FUNCTIONS(PORT_EPS)
+};
+
+/**
+ * Two ports, one stuck: port 0 has its receive queue and both OUT banks
+ * full and the host keeps sending to it, while the main loop echoes port 1.
+ * Port 1 must not lose a packet.
+ */
+static void bench_ports(unsigned long iterations, bench_result_t *res) {
+    uint8_t packet[BULK_PACKET];
+    uint8_t echo[BULK_PACKET];
+    uint8_t rx[BULK_PACKET];
+    uint8_t seq = 0, expect = 0;
+    uint32_t dummy = 0;
+    uint64_t dummy_bytes = 0;
+    int r;
+    size_t n;
+
+    memset(packet, 0, sizeof(packet));
+    res->unit = "packets";
+    res->failures = enumerate(&dummy_bytes, &dummy);
+    while(sim_usb_out(BULK_OUT_EP, packet, sizeof(packet)) == SIM_ACK) {
+        sim_service();
+    }
+    sim_stats_reset();
+    for(unsigned long i = 0; i < iterations; i++) {
+        for(size_t k = 0; k < sizeof(packet); k++) {
+            packet[k] = seq++;
+        }
+        if(sim_usb_out(port_eps[1][1], packet, sizeof(packet)) == SIM_ACK) {
+            res->transfers++;
+        }
+        else {
+            res->failures++;
+        }
+        // NAKed
+        sim_usb_out(BULK_OUT_EP, packet, sizeof(packet));
+        sim_service();
+        n = usb_cdc_port_read(1, echo, sizeof(echo));
+        res->failures += usb_cdc_port_write(1, echo, n) != n;
+        sim_service();
+        r = sim_usb_in(port_eps[1][0], rx, sizeof(rx));
+        if(r < 0) {
+            res->failures++;
+            continue;
+        }
+        for(int k = 0; k < r; k++) {
+            res->data_errors += rx[k] != expect++;
+        }
+        res->bytes += r;
+        sim_service();
+    }
+}
+#endif
+#elif defined(ACM_BRIDGE)
+// USART1 bytes per round in each direction: 1ms worth at 1Mbaud
+#define BRIDGE_BYTES 100
+
+/**
+ * USART1 <-> CDC bridge, full duplex: every round, BRIDGE_BYTES arrive on
+ * the USART1 receive line and the host sends as many on the bulk OUT
+ * endpoint. The host then reads the bulk IN endpoint until it NAKs and the
+ * line takes whatever USART1 transmitted, and the next frame starts. Both
+ * streams carry a counting pattern, so dropped, duplicated or reordered
+ * bytes are data errors.
+ */
+static void bench_bridge(unsigned long iterations, bench_result_t *res) {
+    uint8_t out[BRIDGE_BYTES], line[BRIDGE_BYTES];
+    uint8_t buf[BULK_PACKET];
+    uint8_t setup[8];
+    // 1Mbaud 8N1
+    usb_cdc_line_coding_t coding = {1000000, 0, 0, 8};
+    uint8_t line_seq = 0, out_seq = 0, in_expect = 0, tx_expect = 0;
+    uint32_t dummy = 0;
+    uint64_t dummy_bytes = 0;
+    size_t n, sent, len;
+    int r;
+
+    res->unit = "packets";
+    res->failures = enumerate(&dummy_bytes, &dummy);
+    setup_req(setup, 0x21, USB_CDC_REQ_SET_LINE_CODING, 0, 0, sizeof(coding));
+    res->failures += sim_usb_control(setup, (uint8_t *)&coding) != sizeof(coding);
+    // U2X: 16MHz / (8 * (1 + 1)), 8 data bits
+    res->failures += UBRR1L != 1 || UBRR1H != 0 || UCSR1C != (3 << UCSZ10);
+    sim_stats_reset();
+    // and a few more frames without data, for a held IN packet to come out
+    for(unsigned long i = 0; i < iterations + USB_CDC_HOLD_FRAMES + 1; i++) {
+        len = i < iterations ? BRIDGE_BYTES : 0;
+        for(size_t k = 0; k < len; k++) {
+            line[k] = line_seq++;
+        }
+        sim_uart_rx(line, len);
+        for(sent = 0; sent < len; sent += n) {
+            n = len - sent < BULK_PACKET ? len - sent : BULK_PACKET;
+            for(size_t k = 0; k < n; k++) {
+                out[k] = out_seq++;
+            }
+            r = sim_usb_out(BULK_OUT_EP, out, n);
+            if(r == SIM_ACK) {
+                res->transfers++;
+            }
+            else {
+                // NAKed, the host retries it
+                out_seq -= n;
+                n = 0;
+                count_nak(res, r);
+                sim_service();
+            }
+        }
+        sim_service();
+        while((r = sim_usb_in(BULK_IN_EP, buf, sizeof(buf))) > 0) {
+            for(int k = 0; k < r; k++) {
+                res->data_errors += buf[k] != in_expect++;
+            }
+            res->bytes += r;
+            res->transfers++;
+            sim_service();
+        }
+        while((n = sim_uart_tx_drain(buf, sizeof(buf))) > 0) {
+            for(size_t k = 0; k < n; k++) {
+                res->data_errors += buf[k] != tx_expect++;
+            }
+            res->bytes += n;
+        }
+        sim_usb_sof();
+    }
+    // whatever did not come out at all is missing
+    res->data_errors += (uint8_t)(line_seq - in_expect) + (uint8_t)(out_seq - tx_expect);
+}
+
+/**
+ * USART1 receive errors reported as SERIAL_STATE notifications: every
+ * round one byte arrives with an error, and the host polls the
+ * notification endpoint once, as it does every bInterval. A notification
+ * that is not there at that poll is a failure, a wrong one a data error.
+ */
+static void bench_serial_state(unsigned long iterations, bench_result_t *res) {
+    static const struct {
+        uint8_t c;
+        uint8_t flags;
+        uint16_t state;
+    } events[] = {
+        {0x55, _BV(FE1), USB_CDC_SERIAL_STATE_FRAMING},
+        {0x55, _BV(UPE1), USB_CDC_SERIAL_STATE_PARITY},
+        {0x55, _BV(DOR1), USB_CDC_SERIAL_STATE_OVERRUN},
+        {0x00, _BV(FE1), USB_CDC_SERIAL_STATE_BREAK},
+    };
+    const uint16_t lines = USB_CDC_SERIAL_STATE_DCD | USB_CDC_SERIAL_STATE_DSR;
+    usb_cdc_serial_state_notify_t n;
+    uint8_t buf[BULK_PACKET];
+    uint32_t dummy = 0;
+    uint64_t dummy_bytes = 0;
+    int r;
+
+    res->unit = "notifications";
+    res->failures = enumerate(&dummy_bytes, &dummy);
+    // the line state, sent on SET_CONFIGURATION
+    r = sim_usb_in(NOTIFY_EP, (uint8_t *)&n, sizeof(n));
+    res->failures += r != sizeof(n) || n.bmState != lines;
+    sim_stats_reset();
+    for(unsigned long i = 0; i < iterations; i++) {
+        size_t e = i % (sizeof(events) / sizeof(events[0]));
+        sim_uart_rx_error(events[e].c, events[e].flags);
+        r = sim_usb_in(NOTIFY_EP, (uint8_t *)&n, sizeof(n));
+        if(r != sizeof(n)) {
+            res->failures++;
+            continue;
+        }
+        res->data_errors += n.bmRequestType != 0xA1
+            || n.bNotification != USB_CDC_NOTIFY_SERIAL_STATE
+            || n.wLength != 2 || n.bmState != (lines | events[e].state);
+        res->bytes += r;
+        res->transfers++;
+        // the data bytes go to the bulk IN endpoint, not part of this
+        while(sim_usb_in(BULK_IN_EP, buf, sizeof(buf)) > 0) {
+            sim_service();
+        }
+    }
+}
+#endif
+
+#if defined(ACM_BRIDGE) || USB_NUM_ACM_FUNCTIONS > 1
+// bytes per 1ms frame of a 115200 baud line
+#define SLOW_LINE_BYTES 12
+
+/**
+ * IN coalescing: every round (a frame), SLOW_LINE_BYTES are queued on a
+ * port, arriving on USART1 in bridge builds and written to port 1
+ * otherwise. The host polls the bulk IN endpoint, then starts the next
+ * frame. Packets should carry several rounds' worth, but the oldest byte
+ * of a packet must not be more than USB_CDC_HOLD_FRAMES rounds old, or any
+ * older than that round with flush, which flushes every write.
+ */
+static void coalesce(unsigned long iterations, bench_result_t *res, bool flush) {
+#if defined(ACM_BRIDGE)
+    const uint8_t port = 0, in_ep = BULK_IN_EP;
+#else
+    const uint8_t port = 1, in_ep = port_eps[1][0];
+#endif
+    const unsigned long max_age = flush ? 0 : USB_CDC_HOLD_FRAMES;
+    uint8_t data[SLOW_LINE_BYTES], buf[BULK_PACKET];
+    uint32_t sent = 0, got = 0;
+    uint32_t dummy = 0;
+    uint64_t dummy_bytes = 0;
+    int r;
+
+    res->unit = "packets";
+    res->failures = enumerate(&dummy_bytes, &dummy);
+    sim_stats_reset();
+    // and a few more rounds without data, for the last of it to come out
+    for(unsigned long i = 0; i < iterations + max_age + 1; i++) {
+        if(i < iterations) {
+            for(size_t k = 0; k < sizeof(data); k++) {
+                data[k] = sent++;
+            }
+#if defined(ACM_BRIDGE)
+            sim_uart_rx(data, sizeof(data));
+#else
+            res->failures += usb_cdc_port_write(port, data, sizeof(data)) != sizeof(data);
+#endif
+            if(flush) {
+                usb_cdc_port_flush(port);
+                sim_service();
+            }
+        }
+        for(int t = 0; t < BULK_TOKENS_PER_ROUND; t++) {
+            r = sim_usb_in(in_ep, buf, sizeof(buf));
+            if(r <= 0) {
+                continue;
+            }
+            res->failures += i - got / SLOW_LINE_BYTES > max_age;
+            for(int k = 0; k < r; k++) {
+                res->data_errors += buf[k] != (uint8_t)got++;
+            }
+            res->bytes += r;
+            res->transfers++;
+            sim_service();
+        }
+        sim_usb_sof();
+    }
+    // whatever did not come out at all is missing
+    res->data_errors += sent - got;
+}
+
+static void bench_coalesce(unsigned long iterations, bench_result_t *res) {
+    coalesce(iterations, res, false);
+}
+
+static void bench_flush(unsigned long iterations, bench_result_t *res) {
+    coalesce(iterations, res, true);
+}
+#endif
+
+#if USB_NUM_ACM_FUNCTIONS
+// the main loop's sleep mode, which the suspend hooks set as in main.c
+static uint8_t bench_sleep_mode;
+#if defined(ACM_BRIDGE)
+static bool line_woke;
+
+static void line_hook(void) {
+    line_woke = true;
+}
+#endif
+
+static void bench_usb_suspend(void) {
+    bench_sleep_mode = SLEEP_MODE_PWR_DOWN;
+#if defined(ACM_BRIDGE)
+    uart_set_line_hook(line_hook);
+#endif
+}
+
+static void bench_usb_resume(void) {
+    bench_sleep_mode = SLEEP_MODE_IDLE;
+#if defined(ACM_BRIDGE)
+    uart_set_line_hook(NULL);
+#endif
+}
+
+/**
+ * Suspend and resume: every round the host suspends the bus, the main loop
+ * goes to sleep, and the host resumes and reads a packet: the demo stream,
+ * or in bridge builds one that arrived on USART1. The device must have
+ * stopped the PLL and frozen the USB clock by the time it powers down.
+ * With remote wakeup advertised and enabled, the device wakes the host up
+ * first: in bridge builds when the data arrives, as main.c does, otherwise
+ * every other round. The simulated USART keeps running while powered down,
+ * so unlike on the chip the first byte is not lost.
+ */
+static void bench_suspend(unsigned long iterations, bench_result_t *res) {
+    const bool remote = USB_CONFIG_ATTRIBUTES & USB_CONFIG_ATTRS_REMOTE_WAKEUP;
+    const uint8_t self_powered = USB_CONFIG_ATTRIBUTES & USB_CONFIG_ATTRS_SELF_POWERED;
+    uint8_t buf[BULK_PACKET];
+    uint8_t setup[8], status[2];
+#if defined(ACM_BRIDGE)
+    uint8_t data[BULK_PACKET];
+    uint8_t seq = 0;
+#endif
+    uint32_t dummy = 0;
+    uint64_t dummy_bytes = 0;
+    uint64_t start;
+    size_t got;
+    int r;
+
+    res->unit = "resumes";
+    res->failures = enumerate(&dummy_bytes, &dummy);
+    // stalled unless the configuration advertises it
+    r = no_data_request(USB_REQ_SET_FEATURE, USB_FEATURE_DEVICE_REMOTE_WAKEUP);
+    res->failures += (r >= 0) != remote;
+    setup_req(setup, 0x80, USB_REQ_GET_STATUS, 0, 0, sizeof(status));
+    r = sim_usb_control(setup, status);
+    res->failures += r != sizeof(status)
+        || status[0] != ((self_powered ? 1 : 0) | (remote ? 2 : 0));
+    atmega_xu4_set_suspend_hooks(bench_usb_suspend, bench_usb_resume);
+    sim_stats_reset();
+    for(unsigned long i = 0; i < iterations; i++) {
+        sim_usb_suspend();
+        res->failures += bench_sleep_mode != SLEEP_MODE_PWR_DOWN;
+        set_sleep_mode(bench_sleep_mode);
+        sleep_enable();
+        sleep_cpu();
+        sleep_disable();
+#if defined(ACM_BRIDGE)
+        for(size_t k = 0; k < sizeof(data); k++) {
+            data[k] = seq++;
+        }
+        line_woke = false;
+        sim_uart_rx(data, sizeof(data));
+        res->failures += !line_woke || atmega_xu4_remote_wakeup() != remote;
+#else
+        if(i & 1) {
+            res->failures += atmega_xu4_remote_wakeup() != remote;
+        }
+#endif
+        start = sim_stats.reg_accesses;
+        sim_usb_resume();
+        res->failures += bench_sleep_mode != SLEEP_MODE_IDLE;
+        for(got = 0; got < sizeof(buf); got += r) {
+            // NAKed until the data is there
+            for(int t = 0; t < BULK_TOKENS_PER_ROUND
+                    && (r = sim_usb_in(BULK_IN_EP, buf + got, sizeof(buf) - got)) <= 0; t++) {
+                sim_service();
+            }
+            if(r <= 0) {
+                break;
+            }
+            if(!got) {
+                res->latency += sim_stats.reg_accesses - start;
+                res->latencies++;
+            }
+        }
+        if(got != sizeof(buf)) {
+            res->failures++;
+            continue;
+        }
+#if defined(ACM_BRIDGE)
+        res->data_errors += memcmp(buf, data, sizeof(data)) != 0;
+#endif
+        res->bytes += got;
+        res->transfers++;
+        sim_service();
+    }
+    res->failures += sim_stats.power_down_clocks_on + sim_stats.bad_remote_wakeups;
+}
+#endif
+
+#if USB_NUM_RAW_FUNCTIONS
+#define RAW_EPS(intf, in, out) {in, out},
+// bulk IN and OUT endpoint of the raw interface
+static const uint8_t raw_eps[][2] = {
+    USB_RAW_FUNCTIONS(RAW_EPS)
+};
+// payload of every frame: frames span packets
+#define RAW_FRAME_LEN 100
+
+/**
+ * Host side of the raw stream: frames of RAW_FRAME_LEN bytes, payload byte
+ * k of frame n is n + k.
+ */
+typedef struct {
+    uint8_t frame;
+    uint16_t pos;
+} raw_stream_t;
+
+static uint8_t raw_stream_next(raw_stream_t *s) {
+    uint8_t c;
+
+    if(s->pos < USB_RAW_HDR_SIZE) {
+        c = s->pos ? RAW_FRAME_LEN >> 8 : RAW_FRAME_LEN & 0xFF;
+    }
+    else {
+        c = s->frame + s->pos - USB_RAW_HDR_SIZE;
+    }
+    if(++s->pos == USB_RAW_HDR_SIZE + RAW_FRAME_LEN) {
+        s->pos = 0;
+        s->frame++;
+    }
+    return c;
+}
+
+static void raw_frame_fill(uint8_t *frame, uint8_t n) {
+    for(int k = 0; k < RAW_FRAME_LEN; k++) {
+        frame[k] = n + k;
+    }
+}
+
+static void raw_connect(bench_result_t *res) {
+    uint32_t dummy = 0;
+    uint64_t dummy_bytes = 0;
+
+    res->unit = "packets";
+    res->failures = enumerate(&dummy_bytes, &dummy);
+    sim_stats_reset();
+}
+
+// the most 64 byte bulk transactions a full-speed frame carries, USB 2.0
+// table 5-9: 1216 bytes/ms
+#define RAW_FRAME_PACKETS 19
+
+/**
+ * The main loop keeps queueing frames as long as they fit, between the IN
+ * tokens of the host, which checks the stream. The host is the bottleneck,
+ * so every packet should be full.
+ * @param frames each round is a bus frame of RAW_FRAME_PACKETS tokens, the
+ * firmware runs after each. Otherwise it only runs after bursts of
+ * BULK_TOKENS_PER_ROUND.
+ */
+static void raw_in(unsigned long iterations, bench_result_t *res, bool frames) {
+    uint8_t frame[RAW_FRAME_LEN];
+    uint8_t rx[BULK_PACKET];
+    uint8_t seq = 0;
+    raw_stream_t host = {0};
+    int tokens = frames ? RAW_FRAME_PACKETS : BULK_TOKENS_PER_ROUND;
+    int r;
+
+    raw_connect(res);
+    raw_frame_fill(frame, seq);
+    for(unsigned long i = 0; i < iterations; i++) {
+        for(int t = 0; t < tokens; t++) {
+            while(usb_raw_send(frame, sizeof(frame))) {
+                raw_frame_fill(frame, ++seq);
+            }
+            r = sim_usb_in(raw_eps[0][0], rx, sizeof(rx));
+            if(frames) {
+                sim_service();
+            }
+            if(r <= 0) {
+                res->failures++;
+                continue;
+            }
+            for(int k = 0; k < r; k++) {
+                res->data_errors += rx[k] != raw_stream_next(&host);
+            }
+            // short packets under load are what the batching avoids
+            res->data_errors += r != BULK_PACKET;
+            res->bytes += r;
+            res->transfers++;
+        }
+        sim_service();
+        if(frames) {
+            sim_usb_sof();
+            res->frames++;
+        }
+    }
+}
+
+static void bench_raw_in(unsigned long iterations, bench_result_t *res) {
+    raw_in(iterations, res, false);
+}
+
+static void bench_raw_in_frames(unsigned long iterations, bench_result_t *res) {
+    raw_in(iterations, res, true);
+}
+
+/**
+ * The host sends full packets, the main loop takes whole frames.
+ * @param frames as for raw_in. A NAKed packet is sent again in the next
+ * slot.
+ */
+static void raw_out(unsigned long iterations, bench_result_t *res, bool frames) {
+    uint8_t packet[BULK_PACKET];
+    uint8_t frame[USB_RAW_FRAME_MAX];
+    uint8_t expect[RAW_FRAME_LEN];
+    uint8_t seq = 0;
+    raw_stream_t host = {0};
+    uint16_t len;
+    int tokens = frames ? RAW_FRAME_PACKETS : BULK_TOKENS_PER_ROUND;
+    int r;
+
+    raw_connect(res);
+    for(size_t k = 0; k < sizeof(packet); k++) {
+        packet[k] = raw_stream_next(&host);
+    }
+    for(unsigned long i = 0; i < iterations; i++) {
+        for(int t = 0; t < tokens; t++) {
+            r = sim_usb_out(raw_eps[0][1], packet, sizeof(packet));
+            if(r == SIM_ACK) {
+                res->transfers++;
+                for(size_t k = 0; k < sizeof(packet); k++) {
+                    packet[k] = raw_stream_next(&host);
+                }
+            }
+            else {
+                count_nak(res, r);
+            }
+            if(!frames && t + 1 < tokens) {
+                continue;
+            }
+            sim_service();
+            len = sizeof(frame);
+            while(usb_raw_recv(frame, &len)) {
+                raw_frame_fill(expect, seq++);
+                res->data_errors += len != RAW_FRAME_LEN
+                    || memcmp(frame, expect, RAW_FRAME_LEN);
+                res->bytes += USB_RAW_HDR_SIZE + len;
+                len = sizeof(frame);
+            }
+            sim_service();
+        }
+        if(frames) {
+            sim_usb_sof();
+            res->frames++;
+        }
+    }
+}
+
+static void bench_raw_out(unsigned long iterations, bench_result_t *res) {
+    raw_out(iterations, res, false);
+}
+
+static void bench_raw_out_frames(unsigned long iterations, bench_result_t *res) {
+    raw_out(iterations, res, true);
+}
+
+/**
+ * One small frame per round with the link idle: it must go out at the next
+ * IN token rather than wait for more.
+ */
+static void bench_raw_idle(unsigned long iterations, bench_result_t *res) {
+    uint8_t msg[10] = {0};
+    uint8_t rx[BULK_PACKET];
+    int r;
+
+    raw_connect(res);
+    for(unsigned long i = 0; i < iterations; i++) {
+        msg[0] = i;
+        res->failures += !usb_raw_send(msg, sizeof(msg));
+        r = sim_usb_in(raw_eps[0][0], rx, sizeof(rx));
+        if(r != USB_RAW_HDR_SIZE + sizeof(msg)) {
+            res->failures++;
+            continue;
+        }
+        res->data_errors += rx[0] != sizeof(msg) || rx[2] != (uint8_t)i;
+        res->bytes += r;
+        res->transfers++;
+        sim_service();
+    }
+}
+#endif
+
+static const bench_t benches[] = {
+    {"ep0_enum", "full enumeration sequence", bench_ep0_enum, 2000},
+    {"ep0_config_desc", "GET_DESCRIPTOR(configuration)", bench_ep0_config_desc, 5000},
+    {"chain_ep0", "control IN data sent from a segment chain", bench_chain_ep0, 5000},
+#if !defined(ACM_BRIDGE)
+    {"chain_uart", "USART1 data sent from a segment chain", bench_chain_uart, 5000},
+#endif
+#if !defined(ACM_BRIDGE) && USB_NUM_ACM_FUNCTIONS
+    {"bulk_in", "CDC data IN, bursts of IN tokens", bench_bulk_in, 20000},
+    {"chain_xfer", "interrupt IN transfers sent from a segment chain",
+        bench_chain_xfer, 20000},
+    {"bulk_out", "CDC data OUT, bursts of 64 byte packets", bench_bulk_out, 20000},
+    {"bulk_out_slow_reader", "CDC data OUT, reader takes 32 bytes per burst",
+        bench_bulk_out_slow_reader, 20000},
+    {"bulk_out_xfer", "CDC data OUT into submitted 256 byte transfers",
+        bench_bulk_out_xfer, 20000},
+    {"bulk_out_xfer_small", "CDC data OUT into 24 byte transfers, short packets",
+        bench_bulk_out_xfer_small, 20000},
+    {"dispatch_1", "USB ISR cost, 1 endpoint active per ISR", bench_dispatch_1, 20000},
+    {"dispatch_2", "USB ISR cost, 2 endpoints active per ISR", bench_dispatch_2, 20000},
+    {"dispatch_4", "USB ISR cost, 4 endpoints active per ISR", bench_dispatch_4, 20000},
+#if USB_NUM_ACM_FUNCTIONS > 1
+    {"ports", "port 1 echo while port 0 is stuck", bench_ports, 20000},
+    {"coalesce", "port 1, small writes held for full packets", bench_coalesce, 20000},
+    {"flush", "port 1, small writes flushed at once", bench_flush, 20000},
+#endif
+    {"suspend", "suspend, resume, then a packet", bench_suspend, 20000},
+#elif defined(ACM_BRIDGE)
+    {"bridge", "USART1 <-> CDC bridge, full duplex", bench_bridge, 20000},
+    {"remote_wakeup", "suspend, USART1 data wakes the host up",
+        bench_suspend, 20000},
+    {"coalesce", "slow USART1 data held for full packets", bench_coalesce, 20000},
+    {"flush", "slow USART1 data flushed at once", bench_flush, 20000},
+    {"serial_state", "USART1 errors as SERIAL_STATE notifications",
+        bench_serial_state, 20000},
+#endif
+#if USB_NUM_RAW_FUNCTIONS
+    {"raw_in", "raw bulk IN, frames queued while they fit", bench_raw_in, 20000},
+    {"raw_out", "raw bulk OUT, frames taken whole", bench_raw_out, 20000},
+    {"raw_in_frames", "raw bulk IN, 19 packets per 1ms frame",
+        bench_raw_in_frames, 5000},
+    {"raw_out_frames", "raw bulk OUT, 19 packets per 1ms frame",
+        bench_raw_out_frames, 5000},
+    {"raw_idle", "raw bulk IN, one small frame on an idle link", bench_raw_idle, 20000},
+#endif
+};
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const bench_t *b, const bench_result_t *res, double secs) {
+    uint32_t isrs = sim_usb_isr_calls();
+    uint64_t max_isr = sim_stats.isr_max_reg_accesses[SIM_VECT_USB_GEN];
+    if(sim_stats.isr_max_reg_accesses[SIM_VECT_USB_COM] > max_isr) {
+        max_isr = sim_stats.isr_max_reg_accesses[SIM_VECT_USB_COM];
+    }
+    printf("%s: %s\n", b->name, b->description);
+    printf("  %-24s %lu\n", "transfers", (unsigned long)res->transfers);
+    printf("  %-24s %lu\n", "NAKed", (unsigned long)res->naks);
+    printf("  %-24s %lu\n", "failed", (unsigned long)res->failures);
+    printf("  %-24s %llu\n", "bytes", (unsigned long long)res->bytes);
+    printf("  %-24s %lu\n", "data errors", (unsigned long)res->data_errors);
+    printf("  %-24s %.0f\n", "bytes/s (host)", secs > 0 ? res->bytes / secs : 0);
+    printf("  %-24s %lu (GEN %lu, COM %lu)\n", "USB ISR invocations",
+        (unsigned long)isrs,
+        (unsigned long)sim_stats.isr_calls[SIM_VECT_USB_GEN],
+        (unsigned long)sim_stats.isr_calls[SIM_VECT_USB_COM]);
+    printf("  %-24s %.2f\n", "ISR invocations/transfer",
+        res->transfers ? (double)isrs / res->transfers : 0);
+    printf("  %-24s %.2f\n", "reg accesses/byte",
+        res->bytes ? (double)sim_stats.reg_accesses / res->bytes : 0);
+    printf("  %-24s %.2f\n", "USB ISR reg acc./byte",
+        res->bytes ? (double)sim_usb_isr_reg_accesses() / res->bytes : 0);
+    printf("  %-24s %.2f\n", "USB ISR reg acc./call",
+        isrs ? (double)sim_usb_isr_reg_accesses() / isrs : 0);
+    // everything but the UEDATX accesses: dispatch and bank handling
+    printf("  %-24s %.2f\n", "overhead acc./transfer",
+        res->transfers ?
+            (double)(sim_usb_isr_reg_accesses() - sim_stats.dpram_bytes) / res->transfers : 0);
+    printf("  %-24s %llu (GEN %llu, COM %llu)\n", "longest USB ISR (acc.)",
+        (unsigned long long)max_isr,
+        (unsigned long long)sim_stats.isr_max_reg_accesses[SIM_VECT_USB_GEN],
+        (unsigned long long)sim_stats.isr_max_reg_accesses[SIM_VECT_USB_COM]);
+    printf("  %-24s %lu\n", "DPRAM overruns", (unsigned long)sim_stats.dpram_overruns);
+    printf("  %-24s %llu\n", "UART bytes sent", (unsigned long long)sim_stats.uart_tx_bytes);
+    printf("  %-24s %.2f\n", "UART ISR reg acc./byte",
+        res->bytes ? (double)(sim_stats.isr_reg_accesses[SIM_VECT_USART1_RX]
+            + sim_stats.isr_reg_accesses[SIM_VECT_USART1_UDRE]) / res->bytes : 0);
+    // the bus rate: what the firmware kept up with in the frames it was given
+    if(res->frames) {
+        printf("  %-24s %.1f\n", "bytes/frame",
+            (double)res->bytes / res->frames);
+        printf("  %-24s %.0f\n", "bytes/s (1ms frames)",
+            res->bytes * 1000.0 / res->frames);
+    }
+    if(res->latencies) {
+        printf("  %-24s %.2f\n", "acc. to first packet",
+            (double)res->latency / res->latencies);
+    }
+    // standing in for the suspend current: power-down with a clock left
+    // running draws mA, not uA
+    if(sim_stats.power_down_sleeps) {
+        printf("  %-24s %lu (clocks on %lu)\n", "power-down sleeps",
+            (unsigned long)sim_stats.power_down_sleeps,
+            (unsigned long)sim_stats.power_down_clocks_on);
+    }
+    if(sim_stats.remote_wakeups || sim_stats.bad_remote_wakeups) {
+        printf("  %-24s %lu (bad %lu)\n", "remote wakeups",
+            (unsigned long)sim_stats.remote_wakeups,
+            (unsigned long)sim_stats.bad_remote_wakeups);
+    }
+}
+
+int main(int argc, char **argv) {
+    const bench_t *b = NULL;
+    bench_result_t res = {0};
+    unsigned long iterations;
+    double start;
+
+    if(argc < 2) {
+        fprintf(stderr, "usage: %s <scenario> [iterations]\n", argv[0]);
+        for(size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+            fprintf(stderr, "  %-16s %s\n", benches[i].name, benches[i].description);
+        }
+        return 1;
+    }
+    for(size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        if(!strcmp(argv[1], benches[i].name)) {
+            b = &benches[i];
+        }
+    }
+    if(!b) {
+        fprintf(stderr, "unknown scenario %s\n", argv[1]);
+        return 1;
+    }
+    iterations = argc > 2 ? strtoul(argv[2], NULL, 0) : b->iterations;
+
+    device_power_on();
+    sim_stats_reset();
+    start = now();
+    b->run(iterations, &res);
+    report(b, &res, now() - start);
+    // meson test and meson benchmark fail on any other exit status
+    return res.failures || res.data_errors ? 1 : 0;
+}
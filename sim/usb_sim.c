@@ -0,0 +1,943 @@
+#include "usb_sim.h"
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include <util/delay.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// abort if the firmware makes this many accesses without the host acting,
+// eg. while busy-waiting on a flag the host will never set
+#define SIM_WATCHDOG 10000000UL
+// polling rounds a host helper waits for the device before giving up
+#define SIM_RETRIES 256
+#define SIM_UART_FIFO_LEN 4096
+
+// maximum endpoint sizes, TRM 22.1
+static const uint16_t ep_max_size[SIM_NUM_EPS] = {64, 256, 64, 64, 64, 64, 64};
+
+typedef struct {
+    uint8_t data[256];
+    uint16_t len;
+    uint16_t rpos;
+    // IN: handed to the host, OUT: filled by the host
+    bool busy;
+    // control endpoints only: bank holds IN data (else SETUP/OUT data)
+    bool in;
+} sim_bank_t;
+
+typedef struct {
+    uint8_t regs[SIM_NUM_REGS - SIM_UEINTX];
+    // register values as of the last sync, used to detect firmware writes
+    uint8_t shadow[SIM_NUM_REGS - SIM_UEINTX];
+    uint16_t size;
+    uint16_t offset;
+    uint8_t nbanks;
+    bool allocated;
+    sim_bank_t bank[2];
+    uint8_t fw_bank;
+    uint8_t host_bank;
+    // host polling
+    bool armed;
+    uint8_t *arm_buf;
+    size_t arm_cap;
+    size_t arm_len;
+    uint32_t arm_packets;
+    uint16_t arm_last;
+} sim_ep_t;
+
+#define EPREG(ep, r) ((ep)->regs[(r) - SIM_UEINTX])
+#define EPSHADOW(ep, r) ((ep)->shadow[(r) - SIM_UEINTX])
+
+sim_stats_t sim_stats;
+
+static uint8_t regs[SIM_UEINTX];
+static uint8_t regs_shadow[SIM_UEINTX];
+static uint16_t regs16[SIM_NUM_REGS16];
+static sim_ep_t eps[SIM_NUM_EPS];
+
+static uint8_t uart_rx_fifo[SIM_UART_FIFO_LEN];
+// UCSR1A error flags of each received byte
+static uint8_t uart_rx_errors[SIM_UART_FIFO_LEN];
+static size_t uart_rx_head, uart_rx_tail;
+static uint8_t uart_rx_byte;
+// RXD1 is low, in a start bit or a break
+static bool uart_rx_line_low;
+static uint8_t uart_tx_log[SIM_UART_FIFO_LEN];
+static size_t uart_tx_head, uart_tx_tail;
+
+// address the host sends tokens to, set once a SET_ADDRESS completes
+static uint8_t host_addr;
+// no SOFs or tokens until the host resumes
+static bool bus_suspended;
+// frame number of the last SOF
+static uint16_t frame;
+
+static uint8_t dummy_reg;
+static unsigned long watchdog;
+static int isr_active = -1;
+static void (*idle_fn)(void);
+
+static void sync_all(void);
+
+static void sim_fatal(const char *what) {
+    fprintf(stderr, "sim: %s\n", what);
+    exit(2);
+}
+
+static void kick(void) {
+    sim_stats.reg_accesses++;
+    if(isr_active >= 0) {
+        sim_stats.isr_reg_accesses[isr_active]++;
+    }
+    if(++watchdog > SIM_WATCHDOG) {
+        sim_fatal(isr_active >= 0 ?
+            "watchdog: firmware spinning inside an ISR" :
+            "watchdog: firmware spinning outside of an ISR");
+    }
+}
+
+static inline sim_ep_t *cur_ep(void) {
+    return &eps[regs[SIM_UENUM] & 0x7];
+}
+
+static inline bool ep_is_control(sim_ep_t *ep) {
+    return ((EPREG(ep, SIM_UECFG0X) >> EPTYPE0) & 0x3) == 0;
+}
+
+static inline bool ep_is_in(sim_ep_t *ep) {
+    return EPREG(ep, SIM_UECFG0X) & _BV(EPDIR);
+}
+
+static inline bool usb_running(void) {
+    return (regs[SIM_USBCON] & _BV(USBE))
+        && !(regs[SIM_USBCON] & _BV(FRZCLK))
+        && !(regs[SIM_UDCON] & _BV(DETACH));
+}
+
+// whether a token from the host reaches the device
+static inline bool bus_active(void) {
+    return usb_running() && !bus_suspended;
+}
+
+static void ep_reset_banks(sim_ep_t *ep) {
+    memset(ep->bank, 0, sizeof(ep->bank));
+    ep->fw_bank = 0;
+    ep->host_bank = 0;
+}
+
+/**
+ * Lay out DPRAM in ascending endpoint order, as the hardware does. Returns
+ * false if the allocated endpoints do not fit.
+ */
+static bool dpram_layout(void) {
+    uint16_t offset = 0;
+    for(int i = 0; i < SIM_NUM_EPS; i++) {
+        if(eps[i].allocated) {
+            eps[i].offset = offset;
+            offset += eps[i].size * eps[i].nbanks;
+        }
+    }
+    return offset <= SIM_DPRAM_SIZE;
+}
+
+static void ep_configure(int epnum) {
+    sim_ep_t *ep = &eps[epnum];
+    uint8_t cfg = EPREG(ep, SIM_UECFG1X);
+    uint8_t epsize = (cfg >> EPSIZE0) & 0x7;
+    uint8_t epbk = (cfg >> EPBK0) & 0x3;
+
+    EPREG(ep, SIM_UESTA0X) &= ~_BV(CFGOK);
+    ep->allocated = false;
+    ep_reset_banks(ep);
+    if(!(cfg & _BV(ALLOC))) {
+        dpram_layout();
+        return;
+    }
+    for(int i = epnum + 1; i < SIM_NUM_EPS; i++) {
+        if(eps[i].allocated) {
+            // hardware slides the memory of higher endpoints, corrupting it
+            sim_stats.dpram_conflicts++;
+        }
+    }
+    ep->size = 8 << epsize;
+    ep->nbanks = epbk ? 2 : 1;
+    if(epsize > 6 || epbk > 1 || ep->size > ep_max_size[epnum]
+            || (ep->nbanks > 1 && ep_is_control(ep))) {
+        return;
+    }
+    ep->allocated = true;
+    if(!dpram_layout()) {
+        ep->allocated = false;
+        dpram_layout();
+        return;
+    }
+    EPREG(ep, SIM_UESTA0X) |= _BV(CFGOK);
+    if(ep_is_control(ep) || ep_is_in(ep)) {
+        EPREG(ep, SIM_UEINTX) |= _BV(TXINI);
+    }
+}
+
+/**
+ * Deliver every bank handed over on an armed IN endpoint.
+ */
+static void ep_drain_armed(sim_ep_t *ep) {
+    while(ep->armed && ep->allocated) {
+        int r = sim_usb_in(ep - eps, NULL, 0);
+        if(r < 0) {
+            break;
+        }
+    }
+}
+
+/**
+ * Recompute the level-sensitive status bits of an endpoint.
+ */
+static void ep_update_status(sim_ep_t *ep) {
+    uint8_t busy = 0;
+    uint8_t *ueintx = &EPREG(ep, SIM_UEINTX);
+    sim_bank_t *cur = &ep->bank[ep->fw_bank];
+
+    for(int i = 0; i < ep->nbanks; i++) {
+        busy += ep->bank[i].busy;
+    }
+    EPREG(ep, SIM_UESTA0X) = (EPREG(ep, SIM_UESTA0X) & ~0x3) | busy;
+    EPREG(ep, SIM_UESTA1X) = ep->fw_bank;
+    if(!ep->allocated) {
+        *ueintx &= ~(_BV(RWAL) | _BV(FIFOCON));
+    }
+    else if(ep_is_control(ep)) {
+        *ueintx &= ~(_BV(RWAL) | _BV(FIFOCON));
+        if(!cur->busy) {
+            *ueintx |= _BV(TXINI);
+        }
+    }
+    else if(ep_is_in(ep)) {
+        if(!cur->busy) {
+            *ueintx |= _BV(FIFOCON);
+        }
+        else {
+            *ueintx &= ~_BV(FIFOCON);
+        }
+        if(!cur->busy && cur->len < ep->size) {
+            *ueintx |= _BV(RWAL);
+        }
+        else {
+            *ueintx &= ~_BV(RWAL);
+        }
+    }
+    else {
+        if(cur->busy) {
+            *ueintx |= _BV(FIFOCON);
+        }
+        else {
+            *ueintx &= ~_BV(FIFOCON);
+        }
+        if(cur->busy && cur->rpos < cur->len) {
+            *ueintx |= _BV(RWAL);
+        }
+        else {
+            *ueintx &= ~_BV(RWAL);
+        }
+    }
+}
+
+/**
+ * Apply the side effects of firmware writes to an endpoint's registers.
+ */
+static void ep_sync(int epnum) {
+    sim_ep_t *ep = &eps[epnum];
+    uint8_t *ueconx = &EPREG(ep, SIM_UECONX);
+    uint8_t *ueintx = &EPREG(ep, SIM_UEINTX);
+    uint8_t old, cleared;
+
+    if(*ueconx & _BV(STALLRQC)) {
+        *ueconx &= ~(_BV(STALLRQC) | _BV(STALLRQ));
+    }
+    *ueconx &= ~_BV(RSTDT);
+    if(!(*ueconx & _BV(EPEN)) && ep->allocated) {
+        ep_reset_banks(ep);
+    }
+
+    // firmware can only clear interrupt flags, except for the read-only
+    // status bits which are recomputed below
+    old = EPSHADOW(ep, SIM_UEINTX);
+    cleared = old & ~*ueintx;
+    *ueintx = old & ~cleared;
+
+    if(EPREG(ep, SIM_UECFG1X) != EPSHADOW(ep, SIM_UECFG1X)
+            || EPREG(ep, SIM_UECFG0X) != EPSHADOW(ep, SIM_UECFG0X)) {
+        ep_configure(epnum);
+        cleared = 0;
+    }
+
+    if(ep->allocated) {
+        sim_bank_t *cur = &ep->bank[ep->fw_bank];
+        if(ep_is_control(ep)) {
+            if(cleared & (_BV(RXSTPI) | _BV(RXOUTI))) {
+                // SETUP/OUT data acknowledged, bank is free again
+                memset(cur, 0, sizeof(*cur));
+            }
+            else if((cleared & _BV(TXINI)) && !cur->busy) {
+                // hand IN data (or a zero length packet) to the host
+                cur->busy = true;
+                cur->in = true;
+            }
+        }
+        else if(ep_is_in(ep)) {
+            if((cleared & _BV(FIFOCON)) && !cur->busy) {
+                cur->busy = true;
+                ep->fw_bank = (ep->fw_bank + 1) % ep->nbanks;
+                if(!ep->bank[ep->fw_bank].busy) {
+                    *ueintx |= _BV(TXINI);
+                }
+            }
+        }
+        else {
+            if((cleared & _BV(FIFOCON)) && cur->busy) {
+                memset(cur, 0, sizeof(*cur));
+                ep->fw_bank = (ep->fw_bank + 1) % ep->nbanks;
+                if(ep->bank[ep->fw_bank].busy) {
+                    *ueintx |= _BV(RXOUTI);
+                }
+            }
+        }
+    }
+    ep_update_status(ep);
+    memcpy(ep->shadow, ep->regs, sizeof(ep->regs));
+    ep_drain_armed(ep);
+}
+
+static void sync_all(void) {
+    uint8_t ueint = 0;
+
+    if(regs[SIM_PLLCSR] & _BV(PLLE)) {
+        regs[SIM_PLLCSR] |= _BV(PLOCK);
+    }
+    else {
+        regs[SIM_PLLCSR] &= ~_BV(PLOCK);
+    }
+
+    uint8_t uerst = regs[SIM_UERST] & ~regs_shadow[SIM_UERST];
+    for(int i = 0; i < SIM_NUM_EPS; i++) {
+        if(uerst & _BV(i)) {
+            ep_reset_banks(&eps[i]);
+        }
+        ep_sync(i);
+        if(EPREG(&eps[i], SIM_UEINTX) & EPREG(&eps[i], SIM_UEIENX) & 0x5F) {
+            ueint |= _BV(i);
+        }
+    }
+    regs[SIM_UEINT] = ueint;
+
+    // the device drives resume signaling for as long as RMWKUP stays set,
+    // then the controller clears it and raises UPRSMI. It only works on a
+    // suspended bus with the clock running.
+    if(regs[SIM_UDCON] & _BV(RMWKUP)) {
+        if(bus_suspended && usb_running() && (regs[SIM_UDINT] & _BV(SUSPI))) {
+            sim_stats.remote_wakeups++;
+        }
+        else {
+            sim_stats.bad_remote_wakeups++;
+        }
+        regs[SIM_UDCON] &= ~_BV(RMWKUP);
+        regs[SIM_UDINT] |= _BV(UPRSMI);
+    }
+
+    regs[SIM_UCSR1A] &= ~(_BV(RXC1) | _BV(FE1) | _BV(DOR1) | _BV(UPE1));
+    if(uart_rx_head != uart_rx_tail) {
+        regs[SIM_UCSR1A] |= _BV(RXC1) | uart_rx_errors[uart_rx_tail];
+    }
+    regs[SIM_UCSR1A] |= _BV(UDRE1);
+
+    memcpy(regs_shadow, regs, sizeof(regs));
+}
+
+/******************************************************************************/
+// firmware side accessors, see avr/io.h
+
+volatile uint8_t *sim_reg(sim_reg_t reg) {
+    // general purpose I/O registers are flag storage, no dearer than RAM:
+    // not counted as peripheral accesses
+    if(reg >= SIM_GPIOR0 && reg <= SIM_GPIOR2) {
+        return &regs[reg];
+    }
+    kick();
+    sync_all();
+    if(reg >= SIM_UEINTX) {
+        return &EPREG(cur_ep(), reg);
+    }
+    return &regs[reg];
+}
+
+volatile uint16_t *sim_reg16(sim_reg16_t reg) {
+    kick();
+    if(reg == SIM_UBRR1) {
+        regs16[reg] = regs[SIM_UBRR1L] | (regs[SIM_UBRR1H] << 8);
+    }
+    return &regs16[reg];
+}
+
+volatile uint8_t *sim_uedatx(void) {
+    sim_ep_t *ep;
+    sim_bank_t *bank;
+    bool read;
+
+    kick();
+    sync_all();
+    ep = cur_ep();
+    bank = &ep->bank[ep->fw_bank];
+    if(ep_is_control(ep)) {
+        read = EPREG(ep, SIM_UEINTX) & (_BV(RXSTPI) | _BV(RXOUTI));
+    }
+    else {
+        read = !ep_is_in(ep);
+    }
+
+    if(!ep->allocated) {
+        sim_stats.dpram_overruns++;
+        return &dummy_reg;
+    }
+    if(read) {
+        if(bank->busy && !bank->in && bank->rpos < bank->len) {
+            sim_stats.dpram_bytes++;
+            return &bank->data[bank->rpos++];
+        }
+    }
+    else if(!bank->busy && bank->len < ep->size) {
+        sim_stats.dpram_bytes++;
+        return &bank->data[bank->len++];
+    }
+    sim_stats.dpram_overruns++;
+    return &dummy_reg;
+}
+
+uint16_t sim_uebcx(void) {
+    sim_ep_t *ep;
+    sim_bank_t *bank;
+
+    kick();
+    sync_all();
+    ep = cur_ep();
+    bank = &ep->bank[ep->fw_bank];
+    if(bank->busy && !bank->in) {
+        return bank->len - bank->rpos;
+    }
+    if(!bank->busy) {
+        return bank->len;
+    }
+    return 0;
+}
+
+volatile uint8_t *sim_udr1(void) {
+    kick();
+    if(isr_active == SIM_VECT_USART1_RX) {
+        if(uart_rx_head != uart_rx_tail) {
+            uart_rx_byte = uart_rx_fifo[uart_rx_tail];
+            uart_rx_tail = (uart_rx_tail + 1) % SIM_UART_FIFO_LEN;
+        }
+        return &uart_rx_byte;
+    }
+    sim_stats.uart_tx_bytes++;
+    volatile uint8_t *slot = &uart_tx_log[uart_tx_head];
+    uart_tx_head = (uart_tx_head + 1) % SIM_UART_FIFO_LEN;
+    if(uart_tx_head == uart_tx_tail) {
+        uart_tx_tail = (uart_tx_tail + 1) % SIM_UART_FIFO_LEN;
+    }
+    return slot;
+}
+
+void sim_sei(void) {
+    regs[SIM_SREG] |= _BV(SREG_I);
+    sim_service();
+}
+
+void sim_cli(void) {
+    regs[SIM_SREG] &= ~_BV(SREG_I);
+}
+
+uint8_t sim_sreg_save_cli(void) {
+    uint8_t sreg = regs[SIM_SREG];
+    regs[SIM_SREG] &= ~_BV(SREG_I);
+    return sreg;
+}
+
+void sim_sreg_restore(const uint8_t *sreg) {
+    regs[SIM_SREG] = *sreg;
+    sim_service();
+}
+
+void sim_sreg_force_on(const uint8_t *sreg) {
+    (void)sreg;
+    sim_sei();
+}
+
+void sim_sreg_force_off(const uint8_t *sreg) {
+    (void)sreg;
+    sim_cli();
+}
+
+void sim_delay_us(double us) {
+    sim_stats.delay_us += us;
+}
+
+void sim_sleep(void) {
+    sim_stats.sleeps++;
+    if((regs[SIM_SMCR] & (_BV(SM0) | _BV(SM1) | _BV(SM2))) == _BV(SM1)) {
+        sim_stats.power_down_sleeps++;
+        if((regs[SIM_PLLCSR] & _BV(PLLE)) || !(regs[SIM_USBCON] & _BV(FRZCLK))) {
+            sim_stats.power_down_clocks_on++;
+        }
+    }
+    sim_service();
+}
+
+// vectors the firmware does not define go here, like __bad_interrupt
+__attribute__((weak)) void sim_int2_vect(void) {}
+__attribute__((weak)) void sim_usb_gen_vect(void) {}
+__attribute__((weak)) void sim_usb_com_vect(void) {}
+__attribute__((weak)) void sim_timer0_compa_vect(void) {}
+__attribute__((weak)) void sim_timer1_compa_vect(void) {}
+__attribute__((weak)) void sim_timer1_ovf_vect(void) {}
+__attribute__((weak)) void sim_usart1_rx_vect(void) {}
+__attribute__((weak)) void sim_usart1_udre_vect(void) {}
+
+static void (*const vectors[SIM_NUM_VECTS])(void) = {
+    [SIM_VECT_INT2] = sim_int2_vect,
+    [SIM_VECT_USB_GEN] = sim_usb_gen_vect,
+    [SIM_VECT_USB_COM] = sim_usb_com_vect,
+    [SIM_VECT_TIMER1_COMPA] = sim_timer1_compa_vect,
+    [SIM_VECT_TIMER1_OVF] = sim_timer1_ovf_vect,
+    [SIM_VECT_TIMER0_COMPA] = sim_timer0_compa_vect,
+    [SIM_VECT_USART1_RX] = sim_usart1_rx_vect,
+    [SIM_VECT_USART1_UDRE] = sim_usart1_udre_vect,
+};
+
+static int pending_vector(void) {
+    sync_all();
+    // INT2 on a low level, the only trigger that works without a clock
+    if((regs[SIM_EIMSK] & _BV(INT2)) && uart_rx_line_low
+            && !(regs[SIM_EICRA] & (_BV(ISC21) | _BV(ISC20)))) {
+        return SIM_VECT_INT2;
+    }
+    if((regs[SIM_UDINT] & regs[SIM_UDIEN] & 0x7D)
+            || ((regs[SIM_USBINT] & _BV(VBUSTI))
+                && (regs[SIM_USBCON] & _BV(VBUSTE)))) {
+        return SIM_VECT_USB_GEN;
+    }
+    if(regs[SIM_UEINT]) {
+        return SIM_VECT_USB_COM;
+    }
+    if((regs[SIM_UCSR1B] & _BV(RXCIE1)) && (regs[SIM_UCSR1B] & _BV(RXEN1))
+            && uart_rx_head != uart_rx_tail) {
+        return SIM_VECT_USART1_RX;
+    }
+    if((regs[SIM_UCSR1B] & _BV(UDRIE1)) && (regs[SIM_UCSR1B] & _BV(TXEN1))) {
+        return SIM_VECT_USART1_UDRE;
+    }
+    return -1;
+}
+
+void sim_service(void) {
+    int vect;
+    int prev = isr_active;
+
+    while((regs[SIM_SREG] & _BV(SREG_I)) && (vect = pending_vector()) >= 0) {
+        regs[SIM_SREG] &= ~_BV(SREG_I);
+        isr_active = vect;
+        watchdog = 0;
+        sim_stats.isr_calls[vect]++;
+        uint64_t start = sim_stats.isr_reg_accesses[vect];
+        vectors[vect]();
+        if(sim_stats.isr_reg_accesses[vect] - start > sim_stats.isr_max_reg_accesses[vect]) {
+            sim_stats.isr_max_reg_accesses[vect] = sim_stats.isr_reg_accesses[vect] - start;
+        }
+        isr_active = prev;
+        regs[SIM_SREG] |= _BV(SREG_I);
+        sync_all();
+    }
+}
+
+void sim_set_idle(void (*idle)(void)) {
+    idle_fn = idle;
+}
+
+/**
+ * One round of device activity: pending interrupts, then the main loop.
+ */
+static void device_step(void) {
+    watchdog = 0;
+    sim_service();
+    if(idle_fn) {
+        idle_fn();
+        sim_service();
+    }
+}
+
+void sim_stats_reset(void) {
+    memset(&sim_stats, 0, sizeof(sim_stats));
+}
+
+uint32_t sim_usb_isr_calls(void) {
+    return sim_stats.isr_calls[SIM_VECT_USB_GEN]
+        + sim_stats.isr_calls[SIM_VECT_USB_COM];
+}
+
+uint64_t sim_usb_isr_reg_accesses(void) {
+    return sim_stats.isr_reg_accesses[SIM_VECT_USB_GEN]
+        + sim_stats.isr_reg_accesses[SIM_VECT_USB_COM];
+}
+
+void sim_power_on(void) {
+    memset(regs, 0, sizeof(regs));
+    memset(regs_shadow, 0, sizeof(regs_shadow));
+    memset(regs16, 0, sizeof(regs16));
+    memset(eps, 0, sizeof(eps));
+    uart_rx_head = uart_rx_tail = 0;
+    uart_rx_line_low = false;
+    uart_tx_head = uart_tx_tail = 0;
+    isr_active = -1;
+    watchdog = 0;
+    idle_fn = NULL;
+    host_addr = 0;
+    bus_suspended = false;
+    frame = 0;
+    sim_stats_reset();
+}
+
+/******************************************************************************/
+// host side
+
+void sim_usb_bus_reset(void) {
+    for(int i = 0; i < SIM_NUM_EPS; i++) {
+        sim_ep_t *ep = &eps[i];
+        bool armed = ep->armed;
+        uint8_t *arm_buf = ep->arm_buf;
+        size_t arm_cap = ep->arm_cap;
+        memset(ep, 0, sizeof(*ep));
+        ep->armed = armed;
+        ep->arm_buf = arm_buf;
+        ep->arm_cap = arm_cap;
+    }
+    dpram_layout();
+    regs[SIM_UDADDR] = 0;
+    host_addr = 0;
+    bus_suspended = false;
+    regs[SIM_UDINT] |= _BV(EORSTI);
+    device_step();
+}
+
+void sim_usb_sof(void) {
+    if(!bus_active()) {
+        return;
+    }
+    frame = (frame + 1) & 0x7FF;
+    regs[SIM_UDFNUML] = frame & 0xFF;
+    regs[SIM_UDFNUMH] = frame >> 8;
+    regs[SIM_UDINT] |= _BV(SOFI);
+    device_step();
+}
+
+void sim_usb_suspend(void) {
+    bus_suspended = true;
+    regs[SIM_UDINT] |= _BV(SUSPI);
+    device_step();
+}
+
+void sim_usb_resume(void) {
+    bus_suspended = false;
+    // WAKEUPI is raised even with the clock frozen, EORSMI once the resume
+    // signaling ends
+    regs[SIM_UDINT] |= _BV(WAKEUPI) | _BV(EORSMI);
+    device_step();
+}
+
+/**
+ * Whether the device answers tokens sent to the current host address. Until
+ * ADDEN is set it only answers address 0, TRM 22.18.1.
+ */
+static bool device_addressed(void) {
+    uint8_t udaddr = regs[SIM_UDADDR];
+    return ((udaddr & _BV(ADDEN)) ? (udaddr & 0x7F) : 0) == host_addr;
+}
+
+int sim_usb_setup(uint8_t epnum, const uint8_t setup[8]) {
+    sim_ep_t *ep = &eps[epnum];
+    sim_bank_t *bank = &ep->bank[0];
+
+    sync_all();
+    if(!bus_active() || !device_addressed() || !ep->allocated || !ep_is_control(ep)) {
+        return SIM_TIMEOUT;
+    }
+    // a SETUP clears a pending stall and aborts whatever was in the bank
+    EPREG(ep, SIM_UECONX) &= ~_BV(STALLRQ);
+    memset(bank, 0, sizeof(*bank));
+    memcpy(bank->data, setup, 8);
+    bank->len = 8;
+    bank->busy = true;
+    EPREG(ep, SIM_UEINTX) &= ~_BV(TXINI);
+    EPREG(ep, SIM_UEINTX) |= _BV(RXSTPI);
+    ep_update_status(ep);
+    memcpy(ep->shadow, ep->regs, sizeof(ep->regs));
+    sim_stats.host_out_packets++;
+    sim_stats.host_out_bytes += 8;
+    return SIM_ACK;
+}
+
+int sim_usb_in(uint8_t epnum, uint8_t *buf, uint16_t cap) {
+    sim_ep_t *ep = &eps[epnum];
+    uint8_t *ueintx = &EPREG(ep, SIM_UEINTX);
+    sim_bank_t *bank = &ep->bank[ep->host_bank];
+    uint16_t len;
+
+    if(!bus_active() || !device_addressed() || !ep->allocated
+            || !(EPREG(ep, SIM_UECONX) & _BV(EPEN))) {
+        return SIM_TIMEOUT;
+    }
+    if(EPREG(ep, SIM_UECONX) & _BV(STALLRQ)) {
+        *ueintx |= _BV(STALLEDI);
+        sim_stats.stalls++;
+        memcpy(ep->shadow, ep->regs, sizeof(ep->regs));
+        return SIM_STALL;
+    }
+    if(!bank->busy || (ep_is_control(ep) && !bank->in)) {
+        *ueintx |= _BV(NAKINI);
+        sim_stats.naks++;
+        memcpy(ep->shadow, ep->regs, sizeof(ep->regs));
+        return SIM_NAK;
+    }
+
+    len = bank->len;
+    if(buf) {
+        memcpy(buf, bank->data, len < cap ? len : cap);
+    }
+    if(ep->armed) {
+        if(ep->arm_buf && ep->arm_len < ep->arm_cap) {
+            size_t n = ep->arm_cap - ep->arm_len;
+            memcpy(ep->arm_buf + ep->arm_len, bank->data, len < n ? len : n);
+        }
+        ep->arm_len += len;
+        ep->arm_packets++;
+        ep->arm_last = len;
+    }
+    memset(bank, 0, sizeof(*bank));
+    if(!ep_is_control(ep)) {
+        ep->host_bank = (ep->host_bank + 1) % ep->nbanks;
+    }
+    if(!ep->bank[ep->fw_bank].busy) {
+        *ueintx |= _BV(TXINI);
+    }
+    ep_update_status(ep);
+    memcpy(ep->shadow, ep->regs, sizeof(ep->regs));
+    sim_stats.host_in_packets++;
+    sim_stats.host_in_bytes += len;
+    return len;
+}
+
+int sim_usb_out(uint8_t epnum, const uint8_t *buf, uint16_t len) {
+    sim_ep_t *ep = &eps[epnum];
+    uint8_t *ueintx = &EPREG(ep, SIM_UEINTX);
+    sim_bank_t *bank = &ep->bank[ep->host_bank];
+
+    sync_all();
+    if(!bus_active() || !device_addressed() || !ep->allocated
+            || !(EPREG(ep, SIM_UECONX) & _BV(EPEN))) {
+        return SIM_TIMEOUT;
+    }
+    if(EPREG(ep, SIM_UECONX) & _BV(STALLRQ)) {
+        *ueintx |= _BV(STALLEDI);
+        sim_stats.stalls++;
+        memcpy(ep->shadow, ep->regs, sizeof(ep->regs));
+        return SIM_STALL;
+    }
+    if(bank->busy) {
+        *ueintx |= _BV(NAKOUTI);
+        sim_stats.naks++;
+        memcpy(ep->shadow, ep->regs, sizeof(ep->regs));
+        return SIM_NAK;
+    }
+
+    if(len > ep->size) {
+        len = ep->size;
+    }
+    if(len) {
+        memcpy(bank->data, buf, len);
+    }
+    bank->len = len;
+    bank->rpos = 0;
+    bank->busy = true;
+    bank->in = false;
+    if(ep_is_control(ep)) {
+        *ueintx &= ~_BV(TXINI);
+        *ueintx |= _BV(RXOUTI);
+    }
+    else {
+        ep->host_bank = (ep->host_bank + 1) % ep->nbanks;
+        if(ep->bank[ep->fw_bank].busy) {
+            *ueintx |= _BV(RXOUTI);
+        }
+    }
+    ep_update_status(ep);
+    memcpy(ep->shadow, ep->regs, sizeof(ep->regs));
+    sim_stats.host_out_packets++;
+    sim_stats.host_out_bytes += len;
+    return SIM_ACK;
+}
+
+void sim_usb_arm_in(uint8_t epnum, uint8_t *buf, size_t cap) {
+    sim_ep_t *ep = &eps[epnum];
+    ep->armed = true;
+    ep->arm_buf = buf;
+    ep->arm_cap = cap;
+    ep->arm_len = 0;
+    ep->arm_packets = 0;
+    ep_drain_armed(ep);
+}
+
+size_t sim_usb_disarm_in(uint8_t epnum) {
+    eps[epnum].armed = false;
+    return eps[epnum].arm_len;
+}
+
+size_t sim_usb_armed_bytes(uint8_t epnum) {
+    return eps[epnum].arm_len;
+}
+
+uint32_t sim_usb_armed_packets(uint8_t epnum) {
+    return eps[epnum].arm_packets;
+}
+
+int sim_usb_control(const uint8_t setup[8], uint8_t *data) {
+    bool dir_in = setup[0] & 0x80;
+    uint16_t wlength = setup[6] | (setup[7] << 8);
+    uint16_t maxpacket;
+    size_t done = 0;
+    int r = SIM_TIMEOUT;
+    int i;
+
+    // the host keeps polling EP0 for the whole transfer, so a status stage
+    // ZLP is taken as soon as the firmware commits it
+    sim_usb_arm_in(0, dir_in ? data : NULL, dir_in ? wlength : 0);
+    if(sim_usb_setup(0, setup) != SIM_ACK) {
+        goto done;
+    }
+    maxpacket = eps[0].size;
+
+    if(dir_in && wlength) {
+        // data stage ends on a short packet or after wLength bytes
+        for(i = 0; i < SIM_RETRIES; i++) {
+            size_t prev = sim_usb_armed_bytes(0);
+            device_step();
+            done = sim_usb_armed_bytes(0);
+            if(done >= wlength
+                    || (sim_usb_armed_packets(0) && eps[0].arm_last < maxpacket)) {
+                break;
+            }
+            if(EPREG(&eps[0], SIM_UECONX) & _BV(STALLRQ)) {
+                r = SIM_STALL;
+                sim_stats.stalls++;
+                goto done;
+            }
+            if(done == prev) {
+                sim_stats.naks++;
+            }
+        }
+        if(i == SIM_RETRIES) {
+            goto done;
+        }
+        sim_usb_disarm_in(0);
+        for(i = 0; i < SIM_RETRIES; i++) {
+            r = sim_usb_out(0, NULL, 0);
+            if(r != SIM_NAK) {
+                break;
+            }
+            device_step();
+        }
+        device_step();
+        if(r == SIM_ACK) {
+            r = done < wlength ? done : wlength;
+        }
+    }
+    else {
+        if(wlength) {
+            while(done < wlength) {
+                uint16_t n = wlength - done;
+                n = n > maxpacket ? maxpacket : n;
+                for(i = 0; i < SIM_RETRIES; i++) {
+                    device_step();
+                    r = sim_usb_out(0, data + done, n);
+                    if(r != SIM_NAK) {
+                        break;
+                    }
+                }
+                if(r != SIM_ACK) {
+                    goto done;
+                }
+                done += n;
+            }
+        }
+        // status stage: wait for the zero length IN packet
+        for(i = 0; i < SIM_RETRIES; i++) {
+            device_step();
+            if(sim_usb_armed_packets(0)) {
+                break;
+            }
+            if(EPREG(&eps[0], SIM_UECONX) & _BV(STALLRQ)) {
+                r = SIM_STALL;
+                sim_stats.stalls++;
+                goto done;
+            }
+        }
+        r = (i == SIM_RETRIES) ? SIM_TIMEOUT : (int)done;
+        // the host moves to the new address once SET_ADDRESS is acknowledged
+        if(r >= 0 && setup[0] == 0 && setup[1] == 5) {
+            host_addr = setup[2] & 0x7F;
+        }
+    }
+done:
+    sim_usb_disarm_in(0);
+    return r;
+}
+
+static bool uart_rx_queue(uint8_t c, uint8_t errors) {
+    size_t next = (uart_rx_head + 1) % SIM_UART_FIFO_LEN;
+    if(next == uart_rx_tail) {
+        return false;
+    }
+    uart_rx_fifo[uart_rx_head] = c;
+    uart_rx_errors[uart_rx_head] = errors;
+    uart_rx_head = next;
+    uart_rx_line_low = true;
+    return true;
+}
+
+void sim_uart_rx(const uint8_t *data, size_t len) {
+    for(size_t i = 0; i < len; i++) {
+        if(!uart_rx_queue(data[i], 0)) {
+            break;
+        }
+    }
+    device_step();
+    uart_rx_line_low = false;
+}
+
+void sim_uart_rx_error(uint8_t c, uint8_t errors) {
+    uart_rx_queue(c, errors & (_BV(FE1) | _BV(DOR1) | _BV(UPE1)));
+    device_step();
+    uart_rx_line_low = false;
+}
+
+size_t sim_uart_tx_drain(uint8_t *buf, size_t cap) {
+    size_t n = 0;
+    while(uart_tx_tail != uart_tx_head && n < cap) {
+        if(buf) {
+            buf[n] = uart_tx_log[uart_tx_tail];
+        }
+        n++;
+        uart_tx_tail = (uart_tx_tail + 1) % SIM_UART_FIFO_LEN;
+    }
+    return n;
+}
@@ -0,0 +1,206 @@
+#pragma once
+/**
+ * Register-level simulation of the ATmega32U4 USB controller and USART1, used
+ * to run the drivers natively on the build machine. The host side of the bus
+ * is scripted through the sim_usb_* functions; firmware interrupts are
+ * delivered by calling the ISR() bodies directly whenever the corresponding
+ * flag and enable bits are set and the simulated SREG I flag is set.
+ *
+ * The model is transaction-level: a host token completes instantly, and time
+ * only advances through _delay_ms/_delay_us. Register accesses are counted as
+ * a rough, deterministic stand-in for firmware cost.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SIM_NUM_EPS 7
+#define SIM_DPRAM_SIZE 832
+
+/**
+ * Host handshake results. Non-negative values are byte counts.
+ */
+typedef enum {
+    SIM_ACK = 0,
+    SIM_NAK = -1,
+    SIM_STALL = -2,
+    SIM_TIMEOUT = -3,
+} sim_handshake_t;
+
+/**
+ * Simulated interrupt sources, in AVR priority order (highest first).
+ */
+typedef enum {
+    SIM_VECT_INT2,
+    SIM_VECT_USB_GEN,
+    SIM_VECT_USB_COM,
+    SIM_VECT_TIMER1_COMPA,
+    SIM_VECT_TIMER1_OVF,
+    SIM_VECT_TIMER0_COMPA,
+    SIM_VECT_USART1_RX,
+    SIM_VECT_USART1_UDRE,
+    SIM_NUM_VECTS
+} sim_vect_t;
+
+typedef struct {
+    uint32_t isr_calls[SIM_NUM_VECTS];
+    // every simulated I/O register access made by the firmware, in total and
+    // per interrupt vector
+    uint64_t reg_accesses;
+    uint64_t isr_reg_accesses[SIM_NUM_VECTS];
+    // the most register accesses made by a single ISR invocation, a stand-in
+    // for worst-case ISR duration
+    uint64_t isr_max_reg_accesses[SIM_NUM_VECTS];
+    // bytes moved through UEDATX by the firmware
+    uint64_t dpram_bytes;
+    // bytes carried on the bus, per direction
+    uint64_t host_in_bytes;
+    uint64_t host_out_bytes;
+    uint32_t host_in_packets;
+    uint32_t host_out_packets;
+    uint32_t naks;
+    uint32_t stalls;
+    // UEDATX accesses with no bank available (data lost on hardware)
+    uint32_t dpram_overruns;
+    // endpoint (re)allocated below an already allocated endpoint
+    uint32_t dpram_conflicts;
+    uint64_t uart_tx_bytes;
+    double delay_us;
+    // sleep_cpu() calls
+    uint32_t sleeps;
+    // ... in SLEEP_MODE_PWR_DOWN, and how many of those with the PLL or the
+    // USB clock still running, which would keep drawing current
+    uint32_t power_down_sleeps;
+    uint32_t power_down_clocks_on;
+    // upstream resumes signaled with RMWKUP, and those signaled on a bus
+    // that was not suspended or with the USB clock frozen
+    uint32_t remote_wakeups;
+    uint32_t bad_remote_wakeups;
+} sim_stats_t;
+
+extern sim_stats_t sim_stats;
+
+/**
+ * Power-on reset: clear every register, endpoint and host buffer, and the
+ * statistics.
+ */
+void sim_power_on(void);
+
+/**
+ * Deliver pending interrupts until none remain or the I flag is cleared.
+ */
+void sim_service(void);
+
+/**
+ * Install a function that stands in for the firmware main loop. The host
+ * helpers call it while waiting for the device to make progress.
+ */
+void sim_set_idle(void (*idle)(void));
+
+/**
+ * Clear the statistics without touching device state.
+ */
+void sim_stats_reset(void);
+
+/**
+ * Total ISR invocations over all USB vectors.
+ */
+uint32_t sim_usb_isr_calls(void);
+
+/**
+ * Register accesses made inside the USB ISRs.
+ */
+uint64_t sim_usb_isr_reg_accesses(void);
+
+/**
+ * Host drives a bus reset, raising EORSTI.
+ */
+void sim_usb_bus_reset(void);
+
+/**
+ * Host starts a frame: the frame number counts up and SOFI is raised. Does
+ * nothing while the bus is suspended or the device is not running.
+ */
+void sim_usb_sof(void);
+
+/**
+ * Host suspends the bus: it stops sending SOFs, and the device sees SUSPI
+ * 3ms later. Tokens time out until sim_usb_resume.
+ */
+void sim_usb_suspend(void);
+
+/**
+ * Host resumes the suspended bus, which raises WAKEUPI, as it does after a
+ * remote wakeup.
+ */
+void sim_usb_resume(void);
+
+/**
+ * Host sends a SETUP packet to a control endpoint. SETUP is always ACKed.
+ * @param ep endpoint number
+ * @param setup the 8-byte request
+ */
+int sim_usb_setup(uint8_t ep, const uint8_t setup[8]);
+
+/**
+ * Host sends one IN token.
+ * @param ep endpoint number
+ * @param buf where the data packet is stored, may be NULL
+ * @param cap size of buf
+ * @return packet length, or SIM_NAK / SIM_STALL / SIM_TIMEOUT
+ */
+int sim_usb_in(uint8_t ep, uint8_t *buf, uint16_t cap);
+
+/**
+ * Host sends one OUT token and data packet.
+ * @return SIM_ACK, SIM_NAK, SIM_STALL or SIM_TIMEOUT
+ */
+int sim_usb_out(uint8_t ep, const uint8_t *buf, uint16_t len);
+
+/**
+ * Have the host poll an IN endpoint continuously: every bank the firmware
+ * hands over is read immediately, as a full-speed host does with bulk and
+ * control pipes that have a transfer pending.
+ * @param buf received data is appended here, NULL to discard
+ * @param cap size of buf
+ */
+void sim_usb_arm_in(uint8_t ep, uint8_t *buf, size_t cap);
+
+/**
+ * Stop polling an IN endpoint.
+ * @return number of bytes received while armed
+ */
+size_t sim_usb_disarm_in(uint8_t ep);
+
+/**
+ * Bytes and packets received so far on an armed endpoint.
+ */
+size_t sim_usb_armed_bytes(uint8_t ep);
+uint32_t sim_usb_armed_packets(uint8_t ep);
+
+/**
+ * Run a complete control transfer on endpoint 0: SETUP, data stage in the
+ * direction given by bmRequestType, then the status stage.
+ * @param setup the 8-byte request
+ * @param data data stage buffer, wLength bytes
+ * @return bytes moved in the data stage, or a negative sim_handshake_t
+ */
+int sim_usb_control(const uint8_t setup[8], uint8_t *data);
+
+/**
+ * Queue bytes on the USART1 receive line. RXD1, which is also INT2, is low
+ * while they are handled.
+ */
+void sim_uart_rx(const uint8_t *data, size_t len);
+
+/**
+ * Queue one byte on the USART1 receive line that arrives with errors.
+ * @param errors UCSR1A error flags: _BV(FE1), _BV(DOR1) and/or _BV(UPE1)
+ */
+void sim_uart_rx_error(uint8_t c, uint8_t errors);
+
+/**
+ * Collect bytes the firmware transmitted on USART1 since the last call.
+ */
+size_t sim_uart_tx_drain(uint8_t *buf, size_t cap);
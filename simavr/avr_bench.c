@@ -0,0 +1,562 @@
+/**
+ * Cycle counts of the firmware image under simavr. Loads main.elf into a
+ * simulated ATmega32U4, plays a USB host and a USART1 peer against it and
+ * prints one metric per line, "<name> <value>", in CPU cycles. All of them
+ * are costs: tools/avr_bench_check.py fails when one grows.
+ *
+ * ISR time is measured from the PC landing on the vector to the reti that
+ * sets the I flag again, so it includes the vector jump and the prologue.
+ * The firmware never nests ISRs.
+ *
+ * With --bridge, for images built with acm_bridge, it also streams USART1
+ * at 2Mbaud into the bulk IN endpoint and counts the bytes lost on the way,
+ * and times the USB ISR while every bulk IN packet is a full one. The 2Mbaud
+ * stream keeps to the line rate, a byte every 80 cycles, however far behind
+ * the firmware is.
+ *
+ * usage: avr_bench [--bridge] <main.elf>
+ */
+#include "sim_avr.h"
+#include "sim_cycle_timers.h"
+#include "sim_elf.h"
+#include "sim_irq.h"
+#include "avr_uart.h"
+#include "avr_usb.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MCU "atmega32u4"
+#define CPU_FREQ 16000000
+
+// ATmega32U4 vectors are a jmp each, 4 bytes
+#define VECTOR_SIZE 4
+#define NUM_VECTORS 43
+#define VECT_USB_GEN 10
+#define VECT_USB_COM 11
+#define VECT_USART1_RX 25
+#define VECT_USART1_UDRE 26
+
+// data space addresses of the USART1 registers
+#define UCSR1A_ADDR 0xC8
+#define UDR1_ADDR 0xCE
+#define DOR1_BIT 3
+// the receive buffer behind UDR1, not counting the shift register
+#define UDR1_FIFO 2
+
+// the host retries a NAKed token after this many cycles, about 4 µs
+#define POLL_CYCLES 64
+// a stage that takes longer than this failed, 100 ms
+#define TIMEOUT_CYCLES (CPU_FREQ / 10)
+// the OUT loop stops at the first packet NAKed for this long, 1 ms
+#define OUT_STALL_CYCLES (CPU_FREQ / 1000)
+
+#define BULK_IN_PACKETS 256
+#define BULK_OUT_PACKETS 256
+// one UART RX ring's worth
+#define UART_RX_BYTES 64
+// 80 cycles a byte at 16MHz
+#define MEGABAUD 2000000
+#define MEGABAUD_BYTES 4096
+#define MEGABAUD_BYTE_CYCLES (CPU_FREQ * 10 / MEGABAUD)
+// the firmware's UART receive ring, UART_RX_LEN
+#define UART_RX_RING 128
+#define FULL_PACKETS 32
+
+typedef struct {
+    uint32_t calls;
+    uint64_t cycles;
+    uint64_t max;
+} isr_time_t;
+
+static avr_t *avr;
+static isr_time_t isr_times[NUM_VECTORS];
+// vector being run, -1 outside ISRs
+static int isr_vector = -1;
+static avr_cycle_count_t isr_start;
+
+static avr_irq_t *uart_in;
+static bool uart_xon = true;
+
+/*
+ * The USART1 line at 2Mbaud, a byte of a counting pattern every
+ * MEGABAUD_BYTE_CYCLES. simavr queues whatever it is given for as long as
+ * the firmware takes, so a byte only goes to it once the UDR1 buffer has
+ * room, and until then waits here, in the shift register. It is lost, and
+ * DOR1 set, if it still waits when the next one starts. simavr only raises
+ * RXC1 a byte time after it gets a byte, so each one goes to it at its
+ * start bit. One that had to wait gets to UDR1 up to a byte time late, which
+ * only errs towards overruns.
+ */
+static uint32_t line_left;
+static uint8_t line_next;
+static bool line_waiting;
+static uint8_t line_shift;
+// bytes given to simavr and UDR1 reads by the firmware, since line_start
+static uint32_t line_fed, line_read;
+static uint32_t line_overruns;
+
+static uint8_t ep0_size = 8;
+static uint8_t bulk_in_ep, bulk_out_ep;
+static uint16_t bulk_in_size = 64, bulk_out_size = 64;
+
+static void fail(const char *what) {
+    fprintf(stderr, "avr_bench: %s (cycle %llu, pc 0x%04x)\n", what,
+        (unsigned long long)avr->cycle, (unsigned)avr->pc);
+    exit(1);
+}
+
+static void line_deliver(void) {
+    if(line_waiting && line_fed - line_read < UDR1_FIFO) {
+        avr_raise_irq(uart_in, line_shift);
+        line_fed++;
+        line_waiting = false;
+    }
+}
+
+static avr_cycle_count_t line_tick(avr_t *avr, avr_cycle_count_t when,
+        void *param) {
+    // the start bit of the next byte, and the end of the one waiting
+    if(line_waiting && line_fed - line_read >= UDR1_FIFO) {
+        line_waiting = false;
+        line_overruns++;
+        avr->data[UCSR1A_ADDR] |= 1 << DOR1_BIT;
+    }
+    line_deliver();
+    if(!line_left) {
+        return 0;
+    }
+    line_shift = line_next++;
+    line_waiting = true;
+    line_left--;
+    line_deliver();
+    return when + MEGABAUD_BYTE_CYCLES;
+}
+
+static void line_start(uint32_t bytes) {
+    line_left = bytes;
+    line_next = 0;
+    line_waiting = false;
+    line_fed = line_read = 0;
+    avr_cycle_timer_register(avr, MEGABAUD_BYTE_CYCLES, line_tick, NULL);
+}
+
+static void line_stop(void) {
+    avr_cycle_timer_cancel(avr, line_tick, NULL);
+    line_left = 0;
+    line_waiting = false;
+}
+
+/**
+ * The firmware reads UDR1 with lds, in C and in uart_isr.S.
+ */
+static bool reads_udr1(avr_flashaddr_t pc) {
+    uint16_t op = avr->flash[pc] | avr->flash[pc + 1] << 8;
+    uint16_t k = avr->flash[pc + 2] | avr->flash[pc + 3] << 8;
+
+    return (op & 0xFE0F) == 0x9000 && k == UDR1_ADDR;
+}
+
+/**
+ * Run one instruction, or one sleep period, and account ISR time.
+ */
+static void step(void) {
+    avr_flashaddr_t pc = avr->pc;
+    bool running = avr->state == cpu_Running;
+    int state = avr_run(avr);
+
+    if(state == cpu_Done || state == cpu_Crashed) {
+        fail("firmware stopped");
+    }
+    // reading UDR1 frees a place in its buffer and clears DOR1
+    if(running && reads_udr1(pc)) {
+        // not counting bytes from before line_start
+        line_read += line_read < line_fed;
+        avr->data[UCSR1A_ADDR] &= ~(1 << DOR1_BIT);
+        line_deliver();
+    }
+    if(isr_vector < 0) {
+        if(!avr->sreg[S_I] && avr->pc && !(avr->pc % VECTOR_SIZE)
+                && avr->pc < NUM_VECTORS * VECTOR_SIZE) {
+            isr_vector = avr->pc / VECTOR_SIZE;
+            isr_start = avr->cycle;
+        }
+    }
+    else if(avr->sreg[S_I]) {
+        isr_time_t *t = &isr_times[isr_vector];
+        uint64_t took = avr->cycle - isr_start;
+
+        t->calls++;
+        t->cycles += took;
+        if(took > t->max) {
+            t->max = took;
+        }
+        isr_vector = -1;
+    }
+}
+
+static void run_for(avr_cycle_count_t cycles) {
+    avr_cycle_count_t end = avr->cycle + cycles;
+
+    while(avr->cycle < end) {
+        step();
+    }
+}
+
+/**
+ * One USB token, retried while the device NAKs it.
+ * @param sz in: size of buf, out: bytes transferred
+ * @return AVR_IOCTL_USB_OK, or the last answer if it never succeeded
+ */
+static int usb_token(uint32_t op, uint8_t ep, uint8_t *buf, uint32_t *sz,
+        avr_cycle_count_t timeout) {
+    avr_cycle_count_t end = avr->cycle + timeout;
+    struct avr_io_usb io;
+    int r;
+
+    for(;;) {
+        io.pipe = ep;
+        io.sz = *sz;
+        io.buf = buf;
+        r = avr_ioctl(avr, op, &io);
+        if(r != AVR_IOCTL_USB_NAK || avr->cycle >= end) {
+            break;
+        }
+        run_for(POLL_CYCLES);
+    }
+    *sz = io.sz;
+    return r;
+}
+
+/**
+ * A control transfer on EP0.
+ * @param data IN: filled with up to wLength bytes, OUT: wLength bytes sent
+ * @return bytes of data stage transferred
+ */
+static uint16_t control(uint8_t bmRequestType, uint8_t bRequest,
+        uint16_t wValue, uint16_t wIndex, uint16_t wLength, uint8_t *data) {
+    uint8_t setup[8] = {
+        bmRequestType, bRequest, wValue, wValue >> 8,
+        wIndex, wIndex >> 8, wLength, wLength >> 8
+    };
+    uint32_t sz = sizeof(setup);
+    uint16_t done = 0;
+
+    if(usb_token(AVR_IOCTL_USB_SETUP, 0, setup, &sz, TIMEOUT_CYCLES)) {
+        fail("SETUP not taken");
+    }
+    while(done < wLength) {
+        sz = wLength - done < ep0_size ? wLength - done : ep0_size;
+        if(usb_token(bmRequestType & 0x80 ? AVR_IOCTL_USB_READ
+                    : AVR_IOCTL_USB_WRITE, 0, data + done, &sz,
+                    TIMEOUT_CYCLES)) {
+            fail("control data stage");
+        }
+        done += sz;
+        if(sz < ep0_size) {
+            break;
+        }
+    }
+    // status stage, a zero length packet the other way
+    sz = 0;
+    if(usb_token(bmRequestType & 0x80 ? AVR_IOCTL_USB_WRITE
+                : AVR_IOCTL_USB_READ, 0, NULL, &sz, TIMEOUT_CYCLES)) {
+        fail("control status stage");
+    }
+    return done;
+}
+
+/**
+ * Pick the first bulk IN and bulk OUT endpoints of the configuration, which
+ * is the CDC data interface or the raw interface with the stock descriptors.
+ */
+static void find_bulk_endpoints(const uint8_t *config, uint16_t len) {
+    for(uint16_t at = 0; at + 1 < len && config[at]; at += config[at]) {
+        const uint8_t *d = config + at;
+
+        // endpoint descriptor, bulk
+        if(d[1] != 5 || (d[3] & 3) != 2) {
+            continue;
+        }
+        if((d[2] & 0x80) && !bulk_in_ep) {
+            bulk_in_ep = d[2] & 0x0F;
+            bulk_in_size = d[4] | d[5] << 8;
+        }
+        else if(!(d[2] & 0x80) && !bulk_out_ep) {
+            bulk_out_ep = d[2];
+            bulk_out_size = d[4] | d[5] << 8;
+        }
+    }
+    if(!bulk_in_ep || !bulk_out_ep) {
+        fail("no bulk endpoints in the configuration");
+    }
+}
+
+static uint64_t isr_cycles(int vector) {
+    return isr_times[vector].cycles;
+}
+
+static uint32_t isr_calls(int vector) {
+    return isr_times[vector].calls;
+}
+
+static void print_avg(const char *name, uint64_t cycles, uint32_t n) {
+    printf("%s %.1f\n", name, n ? (double)cycles / n : 0.0);
+}
+
+static void enumerate(void) {
+    uint8_t buf[255];
+    avr_cycle_count_t start;
+    uint64_t isr;
+    uint16_t len;
+
+    // VBUS up, give clock_init and the attach some time, then a bus reset
+    avr_ioctl(avr, AVR_IOCTL_USB_VBUS, (void *)1);
+    run_for(CPU_FREQ / 100);
+    avr_ioctl(avr, AVR_IOCTL_USB_RESET, NULL);
+    run_for(CPU_FREQ / 1000);
+
+    start = avr->cycle;
+    isr = isr_cycles(VECT_USB_GEN) + isr_cycles(VECT_USB_COM);
+    // the first 8 bytes of the device descriptor hold bMaxPacketSize0
+    control(0x80, 6, 0x0100, 0, 8, buf);
+    ep0_size = buf[7];
+    control(0x00, 5, 1, 0, 0, NULL);
+    control(0x80, 6, 0x0100, 0, 18, buf);
+    control(0x80, 6, 0x0200, 0, 9, buf);
+    len = control(0x80, 6, 0x0200, 0, sizeof(buf), buf);
+    control(0x00, 9, 1, 0, 0, NULL);
+    printf("enum_cycles %llu\n", (unsigned long long)(avr->cycle - start));
+    printf("enum_usb_isr_cycles %llu\n", (unsigned long long)(
+        isr_cycles(VECT_USB_GEN) + isr_cycles(VECT_USB_COM) - isr));
+    find_bulk_endpoints(buf, len);
+}
+
+/**
+ * Feed USART1 while its input buffer has room. Keeps the bridge build's
+ * bulk IN endpoint busy, and exercises the RX ISR of the others.
+ */
+static uint32_t uart_feed(uint32_t max) {
+    uint32_t n = 0;
+
+    while(n < max && uart_xon) {
+        avr_raise_irq(uart_in, 'a' + n % 26);
+        n++;
+    }
+    return n;
+}
+
+static void bulk_in(void) {
+    uint8_t buf[512];
+    avr_cycle_count_t start = avr->cycle;
+    uint64_t isr = isr_cycles(VECT_USB_COM);
+    uint32_t calls = isr_calls(VECT_USB_COM);
+    uint32_t bytes = 0, packets = 0, sz;
+
+    while(packets < BULK_IN_PACKETS) {
+        uart_feed(bulk_in_size);
+        sz = bulk_in_size;
+        if(usb_token(AVR_IOCTL_USB_READ, bulk_in_ep, buf, &sz,
+                    TIMEOUT_CYCLES)) {
+            break;
+        }
+        bytes += sz;
+        packets++;
+    }
+    if(!bytes) {
+        fail("nothing on the bulk IN endpoint");
+    }
+    print_avg("bulk_in_cycles_per_byte", avr->cycle - start, bytes);
+    print_avg("bulk_in_usb_isr_cycles", isr_cycles(VECT_USB_COM) - isr,
+        isr_calls(VECT_USB_COM) - calls);
+}
+
+/**
+ * OUT packets until the device stops taking them: without a reader the
+ * CDC receive ring and both banks fill after a few packets.
+ */
+static void bulk_out(void) {
+    uint8_t buf[512];
+    uint64_t isr = isr_cycles(VECT_USB_COM);
+    uint32_t packets = 0, sz;
+
+    memset(buf, 'x', sizeof(buf));
+    while(packets < BULK_OUT_PACKETS) {
+        sz = bulk_out_size;
+        if(usb_token(AVR_IOCTL_USB_WRITE, bulk_out_ep, buf, &sz,
+                    OUT_STALL_CYCLES)) {
+            break;
+        }
+        packets++;
+    }
+    if(!packets) {
+        fail("bulk OUT endpoint took nothing");
+    }
+    print_avg("bulk_out_usb_isr_cycles_per_packet",
+        isr_cycles(VECT_USB_COM) - isr, packets);
+}
+
+static void uart_rx(void) {
+    uint32_t sent = 0;
+
+    // 10 bits each at 115200 baud
+    while(sent < UART_RX_BYTES) {
+        sent += uart_feed(UART_RX_BYTES - sent);
+        run_for(CPU_FREQ / 11520);
+    }
+    run_for(CPU_FREQ / 100);
+}
+
+/**
+ * USART1 at 2Mbaud through the bridge: every byte of the pattern has to
+ * come out of bulk IN, in order. An RX ISR that falls behind the line loses
+ * some to overruns, a receive ring that fills up loses them later.
+ */
+static void bridge_megabaud(void) {
+    uint8_t coding[7] = {
+        MEGABAUD & 0xFF, MEGABAUD >> 8 & 0xFF, MEGABAUD >> 16 & 0xFF,
+        MEGABAUD >> 24, 0, 0, 8
+    };
+    uint8_t buf[512];
+    uint32_t got = 0, misordered = 0, overruns = line_overruns, sz;
+    uint8_t expect = 0;
+
+    // whatever the earlier scenarios left in the rings
+    do {
+        sz = bulk_in_size;
+    } while(!usb_token(AVR_IOCTL_USB_READ, bulk_in_ep, buf, &sz,
+                CPU_FREQ / 50));
+    // SET_LINE_CODING, port 0
+    control(0x21, 0x20, 0, 0, sizeof(coding), coding);
+
+    line_start(MEGABAUD_BYTES);
+    while(got < MEGABAUD_BYTES) {
+        sz = bulk_in_size;
+        if(usb_token(AVR_IOCTL_USB_READ, bulk_in_ep, buf, &sz,
+                    TIMEOUT_CYCLES)) {
+            break;
+        }
+        for(uint32_t i = 0; i < sz; i++) {
+            misordered += buf[i] != expect;
+            expect = buf[i] + 1;
+        }
+        got += sz;
+    }
+    line_stop();
+    printf("bridge_2mbaud_overruns %u\n",
+        (unsigned)(line_overruns - overruns));
+    printf("bridge_2mbaud_lost_bytes %u\n", (unsigned)(MEGABAUD_BYTES - got));
+    printf("bridge_2mbaud_misordered %u\n", (unsigned)misordered);
+}
+
+/**
+ * Bulk IN through the bridge with the host reading a little faster than
+ * USART1 fills the receive ring, which is filled up first: whenever a bank
+ * frees up, a whole packet waits in the ring. This is the case the
+ * USB_COM_vect fast path of usb_asm builds is for. Runs after
+ * bridge_megabaud, at 2Mbaud. Per packet, the USB ISR time compares with
+ * and without usb_asm: the C ISR may take more than one call for a packet.
+ */
+static void bridge_full_packets(void) {
+    uint8_t buf[512];
+    avr_cycle_count_t next;
+    uint64_t isr;
+    uint32_t calls, full = 0, sz;
+
+    // the first bytes take both banks, the next ring's worth waits
+    line_start(2 + UART_RX_RING + FULL_PACKETS * bulk_in_size);
+    run_for((2 + UART_RX_RING) * MEGABAUD_BYTE_CYCLES + POLL_CYCLES);
+
+    isr = isr_cycles(VECT_USB_COM);
+    calls = isr_calls(VECT_USB_COM);
+    for(uint32_t i = 0; i < FULL_PACKETS; i++) {
+        next = avr->cycle + (bulk_in_size - 4) * MEGABAUD_BYTE_CYCLES;
+        sz = bulk_in_size;
+        if(usb_token(AVR_IOCTL_USB_READ, bulk_in_ep, buf, &sz,
+                    TIMEOUT_CYCLES)) {
+            fail("bridge bulk IN stopped");
+        }
+        full += sz == bulk_in_size;
+        if(avr->cycle < next) {
+            run_for(next - avr->cycle);
+        }
+    }
+    line_stop();
+    print_avg("bridge_full_in_usb_isr_cycles", isr_cycles(VECT_USB_COM) - isr,
+        isr_calls(VECT_USB_COM) - calls);
+    print_avg("bridge_full_in_usb_isr_cycles_per_packet",
+        isr_cycles(VECT_USB_COM) - isr, FULL_PACKETS);
+    printf("bridge_full_in_short_packets %u\n", (unsigned)(FULL_PACKETS - full));
+}
+
+static void uart_xon_hook(struct avr_irq_t *irq, uint32_t value, void *p) {
+    uart_xon = true;
+}
+
+static void uart_xoff_hook(struct avr_irq_t *irq, uint32_t value, void *p) {
+    uart_xon = false;
+}
+
+int main(int argc, char **argv) {
+    elf_firmware_t fw;
+    uint32_t flags = 0;
+    bool bridge = argc == 3 && !strcmp(argv[1], "--bridge");
+    const char *elf = argv[argc - 1];
+
+    if(argc != 2 && !bridge) {
+        fprintf(stderr, "usage: %s [--bridge] <main.elf>\n", argv[0]);
+        return 2;
+    }
+    memset(&fw, 0, sizeof(fw));
+    if(elf_read_firmware(elf, &fw)) {
+        fprintf(stderr, "avr_bench: cannot read %s\n", elf);
+        return 1;
+    }
+    avr = avr_make_mcu_by_name(MCU);
+    if(!avr) {
+        fprintf(stderr, "avr_bench: simavr has no " MCU "\n");
+        return 1;
+    }
+    avr_init(avr);
+    avr_load_firmware(avr, &fw);
+    avr->frequency = CPU_FREQ;
+    avr->log = LOG_ERROR;
+
+    // USART1 output is trace records, or bridged data: keep it off stdout
+    avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS('1'), &flags);
+    flags &= ~AVR_UART_FLAG_STDIO;
+    avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS('1'), &flags);
+    uart_in = avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('1'), UART_IRQ_INPUT);
+    avr_irq_register_notify(
+        avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('1'), UART_IRQ_OUT_XON),
+        uart_xon_hook, NULL);
+    avr_irq_register_notify(
+        avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('1'), UART_IRQ_OUT_XOFF),
+        uart_xoff_hook, NULL);
+
+    enumerate();
+    bulk_in();
+    bulk_out();
+    if(bridge) {
+        bridge_megabaud();
+        bridge_full_packets();
+    }
+    uart_rx();
+
+    printf("usb_isr_max_cycles %llu\n", (unsigned long long)(
+        isr_times[VECT_USB_COM].max > isr_times[VECT_USB_GEN].max
+        ? isr_times[VECT_USB_COM].max : isr_times[VECT_USB_GEN].max));
+    print_avg("uart_rx_isr_cycles", isr_cycles(VECT_USART1_RX),
+        isr_calls(VECT_USART1_RX));
+    printf("uart_rx_isr_max_cycles %llu\n",
+        (unsigned long long)isr_times[VECT_USART1_RX].max);
+    // trace records or bridged OUT data went out meanwhile
+    print_avg("uart_udre_isr_cycles", isr_cycles(VECT_USART1_UDRE),
+        isr_calls(VECT_USART1_UDRE));
+    printf("uart_udre_isr_max_cycles %llu\n",
+        (unsigned long long)isr_times[VECT_USART1_UDRE].max);
+    return 0;
+}
@@ -1,4 +1,5 @@
 #include "32u4_usb.h"
+#include "32u4_usb_isr.h"
 
 #include "usb_descriptors.h"
 
@@ -6,25 +7,22 @@
 #include "usb_cdc_descriptors.h"
 #include "usb_requests.h"
 
-#include "queue/queue.h"
-
-// for debugging
+#include "monoqueue.h"
+#include "trace.h"
+#include "isr_stats.h"
 #include "drivers/uart.h"
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
 #include <util/delay.h>
 #include <util/atomic.h>
 
 #include <stdbool.h>
+#include <string.h>
 
-#define NUM_EPS 1
-
-#if !defined(ATMEGA_XU4_USB_SW_QUEUE_LEN)
-#define ATMEGA_XU4_USB_SW_QUEUE_LEN 128
-#endif
-
-#define EP0_LEN ATMEGA_XU4_USB_SW_QUEUE_LEN
+// hardware endpoints, TRM 22.1
+#define NUM_EPS 7
 
 #define min(x, y) (((x) > (y)) ? (y):(x))
 
@@ -38,239 +36,1554 @@
  */
 
 static void handle_setup(usb_ep_ctx_t *ctx);
+static bool handle_vendor(const usb_req_std_t *req);
 
 static inline void set_flush_lock(int epnum);
 static inline void clear_flush_lock(int epnum);
 static inline bool is_flush_locked(int epnum);
 
+// holds the last SETUP packet, from the start of the buffer
 __attribute__((aligned(4)))
-char ep0_buf[EP0_LEN];
-queue_t ep0_queue;
+usb_ring_t ep0_queue = RING_INIT(ATMEGA_XU4_USB_SW_QUEUE_LEN);
+
+// default endpoint 0 handler
+usb_ep_ctx_t ep0_handler = {
+    .callback = handle_setup,
+    // usb_ring_any, in a constant initialiser
+    .data = (byte_ring_t *)&ep0_queue,
+    .flags = 0
+};
+
+// array of endpoint handlers
+static volatile usb_ep_ctx_t *usb_ep_handlers[NUM_EPS];
+
+// transfers submitted to each endpoint, oldest first
+typedef struct {
+    usb_xfer_t *slots[ATMEGA_XU4_XFER_SLOTS];
+    uint8_t head;
+    uint8_t count;
+    // OUT: length of the packet in the bank being copied out, as first
+    // seen, 0 between packets. A packet can span transfers, and UEBCX then
+    // only counts what is left of it.
+    uint16_t bank_len;
+} xfer_ring_t;
+
+static xfer_ring_t xfer_rings[NUM_EPS];
+
+// IN endpoints fed from their queue coalesce small writes: a partial packet
+// left in the bank when the queue runs dry waits for more data, for up to
+// in_hold_frames SOFs, unless EP_FLUSH is set. See flush_queue.
+static uint8_t in_hold_frames[NUM_EPS];
+// endpoints holding a partial packet, by bit, and the frame (UDFNUML) each
+// one is due at. Only the USB ISRs use them.
+static uint8_t in_held;
+static uint8_t in_hold_due[NUM_EPS];
+
+/**
+ * Stages of a control transfer on EP0, USB 2.0 8.5.3. A SETUP packet always
+ * starts a new transfer, aborting the one in progress. Every stage moves on
+ * from an interrupt, nothing in the ISR waits for the host.
+ */
+typedef enum {
+    EP0_IDLE,
+    EP0_DATA_IN,
+    EP0_DATA_OUT,
+    // zero-length IN packet ending a no-data or control write transfer
+    EP0_STATUS_IN,
+    // zero-length OUT packet from the host ending a control read transfer
+    EP0_STATUS_OUT,
+} ep0_stage_t;
+
+static ep0_stage_t ep0_stage;
+// SET_ADDRESS is pending: enable the address once its status stage is done
+static bool ep0_address_pending;
+
+// data stage of the current control IN transfer, read straight from its
+// source (eg. a descriptor) into the EP0 bank
+static mqueue_t ep0_in;
+// the data stage is shorter than wLength, so it must end with a short packet
+static bool ep0_in_short;
+
+// data stage of the current control OUT transfer, copied from the EP0 bank
+// into the destination as each packet arrives
+static uint8_t *ep0_out_buf;
+static uint16_t ep0_out_len;
+static uint16_t ep0_out_pos;
+static void (*ep0_out_done)(void);
+
+
+// the bus is suspended: the USB clock is frozen and the PLL is off, see
+// USB_GEN_vect
+static volatile bool usb_suspended;
+// the host allows remote wakeup, SET_FEATURE(DEVICE_REMOTE_WAKEUP)
+static bool usb_remote_wakeup;
+static void (*suspend_hook)(void);
+static void (*resume_hook)(void);
+
+static void clock_init(void) {
+    // 96MHz USB clock
+    PLLCSR = 0x12;
+    PLLFRQ = _BV(PLLUSB) | _BV(PLLTM1) | 0xA;
+    // enabling the controller unfreezes its clock, which must be locked
+    // by then, TRM 21.12
+    while(!(PLLCSR & _BV(PLOCK)));
+}
+
+/**
+ * Restart the PLL and unfreeze the USB clock after a suspend, if they are
+ * stopped. The resume hook runs while the PLL locks, PLLFRQ is kept from
+ * clock_init. Called with interrupts off.
+ */
+static void clock_resume(void) {
+    if(!(USBCON & _BV(FRZCLK))) {
+        return;
+    }
+    PLLCSR |= _BV(PLLE);
+    if(resume_hook) {
+        resume_hook();
+    }
+    while(!(PLLCSR & _BV(PLOCK)));
+    USBCON &= ~_BV(FRZCLK);
+}
+
+// ACM STUFF
+
+// One port per CDC-ACM function in the descriptors, see USB_ACM_FUNCTIONS.
+// Port 0 carries the demo stream, or the USART1 bridge. Any other port is a
+// byte pipe for the main loop, see usb_cdc_port_read and usb_cdc_port_write.
+#define ACM_PORTS USB_NUM_ACM_FUNCTIONS
+
+// bulk data is moved in chunks of a full-speed packet. The banks are set
+// up from the endpoint descriptors, see USB_ENDPOINTS.
+#define ACM_BULK_SIZE 64
+
+#if defined(ACM_BRIDGE) && !ACM_PORTS
+#error "ACM_BRIDGE needs a CDC-ACM function in the descriptors"
+#endif
+
+#if ACM_PORTS
+typedef struct acm_port_S acm_port_t;
+
+// endpoint handler context of a port, see usb_ep_ctx_t
+typedef struct {
+    usb_ep_ctx_t header;
+    acm_port_t *port;
+} acm_ep_t;
+
+struct acm_port_S {
+    // comm interface, from the descriptors
+    uint8_t intf;
+    uint8_t notify_ep;
+    uint8_t in_ep;
+    uint8_t out_ep;
+    acm_ep_t notify;
+    acm_ep_t in;
+    acm_ep_t out;
+    // received data and data to send, the ISR owns one end of each
+    usb_ring_t rx;
+    usb_ring_t tx;
+    // line coding last set by the host, 115200 8N1 until then
+    usb_cdc_line_coding_t line_coding;
+    // SOFs a partial IN packet waits for more data, see usb_cdc_port_set_hold
+    uint8_t hold_frames;
+    // SERIAL_STATE notifications
+    usb_cdc_serial_state_notify_t notify_buf;
+    usb_xfer_t notify_xfer;
+    // events that happened while a notification was in flight
+    uint8_t notify_events;
+    bool notify_due;
+};
+
+#define ACM_PORT_INIT(intf_num, notify_num, in_num, out_num) { \
+    .intf = (intf_num), \
+    .notify_ep = (notify_num), \
+    .in_ep = (in_num), \
+    .out_ep = (out_num), \
+    .hold_frames = USB_CDC_HOLD_FRAMES, \
+    .line_coding = { \
+        .dwDTERate = 115200, \
+        .bCharFormat = 0, \
+        .bParityType = 0, \
+        .bDataBits = 8 \
+    }, \
+},
+static acm_port_t acm_ports[ACM_PORTS] = {
+    USB_ACM_FUNCTIONS(ACM_PORT_INIT)
+};
+
+static void acm_handler(usb_ep_ctx_t *ctx) {
+    // stub: data waits in the port rings, transfers complete on their own
+}
+
+/**
+ * The port a class request is for.
+ * @return NULL if intf is not a comm interface
+ */
+static acm_port_t *acm_port_find(uint16_t intf) {
+    for(uint8_t i = 0; i < ACM_PORTS; i++) {
+        if(acm_ports[i].intf == intf) {
+            return &acm_ports[i];
+        }
+    }
+    return NULL;
+}
+
+// SET_LINE_CODING data stage, applied to its port once complete. EP0 has
+// one request at a time.
+static usb_cdc_line_coding_t acm_line_coding_req;
+static acm_port_t *acm_line_coding_port;
+
+/**
+ * Take the line coding the host sent. In bridge mode, USART1 is reconfigured
+ * to match port 0; a coding it does not support is ignored, so
+ * GET_LINE_CODING keeps reporting what the line actually uses.
+ */
+static void acm_set_line_coding(void) {
+    acm_port_t *port = acm_line_coding_port;
+#if defined(ACM_BRIDGE)
+    // bCharFormat: 0 is 1 stop bit, 2 is 2 stop bits, 1.5 is not supported.
+    // bParityType above even is mark/space, not supported either.
+    if(port == &acm_ports[0] && (acm_line_coding_req.bCharFormat == 1
+            || !uart_set_line(acm_line_coding_req.dwDTERate,
+                acm_line_coding_req.bDataBits,
+                acm_line_coding_req.bParityType,
+                acm_line_coding_req.bCharFormat ? 2 : 1))) {
+        return;
+    }
+#endif
+    port->line_coding = acm_line_coding_req;
+}
+
+/**
+ * CDC class requests to a communication interface, CDC PSTN 6.3.
+ */
+static bool acm_request(const usb_req_std_t *req) {
+    acm_port_t *port = acm_port_find(req->wIndex);
+
+    if(!port) {
+        return false;
+    }
+    switch(req->bRequest) {
+        case USB_CDC_REQ_SET_LINE_CODING:
+            if(req->wLength != sizeof(acm_line_coding_req)) {
+                return false;
+            }
+            acm_line_coding_port = port;
+            atmega_xu4_ep0_recv(&acm_line_coding_req, req->wLength,
+                    acm_set_line_coding);
+        break;
+
+        case USB_CDC_REQ_GET_LINE_CODING:
+            atmega_xu4_ep0_send(&port->line_coding, sizeof(port->line_coding),
+                    req->wLength);
+        break;
+
+        case USB_CDC_REQ_SET_CONTROL_LINE_STATE:
+            atmega_xu4_ep0_status();
+        break;
+
+        case USB_CDC_REQ_SEND_BREAK:
+            // wValue is the length in ms. Hosts send 0xFFFF to start a break
+            // and 0 to end it; a timed break lasts until the next request.
+#if defined(ACM_BRIDGE)
+            if(port == &acm_ports[0]) {
+                uart_set_break(req->wValue != 0);
+            }
+#endif
+            atmega_xu4_ep0_status();
+        break;
+
+        default:
+            return false;
+    }
+    return true;
+}
+
+// SERIAL_STATE notifications on the notification endpoint of each port.
+// USART1 has no modem control lines, so DCD and DSR are always reported as
+// on.
+#define ACM_SERIAL_STATE_LINES \
+    (USB_CDC_SERIAL_STATE_DCD | USB_CDC_SERIAL_STATE_DSR)
+
+static void acm_notify_done(usb_xfer_t *xfer);
+
+static void acm_notify_send(acm_port_t *port) {
+    port->notify_buf.bmState = ACM_SERIAL_STATE_LINES | port->notify_events;
+    port->notify_events = 0;
+    port->notify_due = false;
+    port->notify_xfer.buf = (uint8_t *)&port->notify_buf;
+    port->notify_xfer.len = sizeof(port->notify_buf);
+    port->notify_xfer.complete = acm_notify_done;
+    port->notify_xfer.user = port;
+    atmega_xu4_submit(port->notify_ep, &port->notify_xfer);
+}
+
+static void acm_notify_done(usb_xfer_t *xfer) {
+    acm_port_t *port = xfer->user;
+    if(port->notify_due) {
+        acm_notify_send(port);
+    }
+}
+
+/**
+ * Report line events to the host with a SERIAL_STATE notification. The
+ * notification goes into the endpoint bank at once if it is free, otherwise
+ * events are merged into the next one. Call in the ISR context only: the
+ * USB and USART1 interrupts do not nest.
+ * @param events usb_cdc_serial_state_t bits, or 0 to resend the line state
+ */
+static void acm_serial_event(acm_port_t *port, uint8_t events) {
+    port->notify_events |= events;
+    port->notify_due = true;
+    if(port->notify_xfer.status != USB_XFER_PENDING) {
+        acm_notify_send(port);
+    }
+}
+
+/**
+ * Start notifications under a new configuration, beginning with the line
+ * state.
+ */
+static void acm_notify_start(acm_port_t *port) {
+    port->notify_buf = (usb_cdc_serial_state_notify_t){
+        .bmRequestType = USB_REQ_DIR_IN | USB_REQ_TYPE_CLASS
+            | USB_REQ_RCPT_INTERFACE,
+        .bNotification = USB_CDC_NOTIFY_SERIAL_STATE,
+        .wValue = 0,
+        .wIndex = port->intf,
+        .wLength = sizeof(port->notify_buf.bmState),
+    };
+    // a transfer of the previous configuration was dropped
+    port->notify_xfer.status = USB_XFER_IDLE;
+    port->notify_events = 0;
+    acm_serial_event(port, 0);
+}
+
+#if defined(ACM_BRIDGE)
+_Static_assert(UART_TX_LEN > ACM_BULK_SIZE,
+    "the bridge waits for a bank of room in the UART transmit ring");
+
+// USART1 RX bytes go straight from the UART receive ring into the port 0
+// bulk IN banks, and bulk OUT banks straight into the UART transmit ring:
+// each byte is copied once. Both rings have one producer and one consumer,
+// all in ISRs, which do not nest. The UART only calls back when an
+// endpoint is waiting for it, see uart_rx_wake and uart_tx_wake, so the
+// USART1 ISRs stay on their fast path otherwise.
+
+/**
+ * Enable interrupts of an endpoint from outside the USB ISR.
+ */
+static inline void bridge_ep_enable(uint8_t epnum, uint8_t ints) {
+    uint8_t prev = UENUM;
+    UENUM = epnum;
+    UEIENX |= ints;
+    UENUM = prev;
+}
+
+static void bridge_in_handler(usb_ep_ctx_t *ctx) {
+    // flush_queue disables TXINE once the ring runs dry, the next received
+    // byte restarts it. UENUM is the bulk IN endpoint.
+    if(!(UEIENX & _BV(TXINE))) {
+        uart_rx_wake();
+    }
+}
+
+static void bridge_out_handler(usb_ep_ctx_t *ctx) {
+    // fill_queue disables RXOUTE when the ring has no room for the bank,
+    // it restarts once a whole bank fits. UENUM is the bulk OUT endpoint.
+    if(!(UEIENX & _BV(RXOUTE))) {
+        uart_tx_wake(UART_TX_LEN - ACM_BULK_SIZE);
+    }
+    if(byte_ring_count(ctx->data)) {
+        uart_tx_kick();
+    }
+}
+
+// USART1_RX_vect, a byte came in while bulk IN was idle
+static void bridge_rx_hook(void) {
+    bridge_ep_enable(acm_ports[0].in_ep, _BV(TXINE));
+}
+
+// USART1_UDRE_vect, a bank fits in the transmit ring again
+static void bridge_tx_hook(void) {
+    bridge_ep_enable(acm_ports[0].out_ep, _BV(RXOUTE));
+}
+
+static void bridge_error_hook(uint8_t errors) {
+    acm_serial_event(&acm_ports[0],
+        ((errors & UART_ERR_FRAMING) ? USB_CDC_SERIAL_STATE_FRAMING : 0)
+        | ((errors & UART_ERR_PARITY) ? USB_CDC_SERIAL_STATE_PARITY : 0)
+        | ((errors & UART_ERR_OVERRUN) ? USB_CDC_SERIAL_STATE_OVERRUN : 0)
+        | ((errors & UART_ERR_BREAK) ? USB_CDC_SERIAL_STATE_BREAK : 0));
+}
+
+/**
+ * Hand the bulk endpoints of port 0 to the UART rings, before they are
+ * installed.
+ */
+static void acm_bridge_init(acm_port_t *port) {
+    port->in.header.callback = bridge_in_handler;
+    port->in.header.data = uart_rx_ring();
+    port->out.header.callback = bridge_out_handler;
+    port->out.header.data = uart_tx_ring();
+}
+
+static void acm_bridge_start(acm_port_t *port) {
+    // the receive ring may already hold data. A wake left over from the
+    // previous configuration only enables an interrupt that turns itself
+    // off again.
+    UENUM = port->in_ep;
+    UEIENX |= _BV(TXINE);
+    uart_set_hooks(bridge_rx_hook, bridge_tx_hook);
+    uart_set_error_hook(bridge_error_hook);
+}
+#else
+static const char msg[] PROGMEM = "the cake is a lie\r\n";
+// each transfer is the message repeated over two full packets, sent from
+// flash by a chain of segments that all point to it. Two transfers are kept
+// in flight so the next one is ready when a bank frees up.
+#define ACM_STREAM_LEN (2 * ACM_BULK_SIZE)
+#define ACM_STREAM_SEGS \
+    ((ACM_STREAM_LEN + sizeof(msg) - 2) / (sizeof(msg) - 1))
+static mqueue_seg_t acm_stream_segs[ACM_STREAM_SEGS];
+static mqueue_t acm_stream_queues[2];
+static usb_xfer_t acm_stream_xfers[2];
+
+static void acm_stream_next(usb_xfer_t *xfer) {
+    mqueue_init_chain(xfer->chain, acm_stream_segs, ACM_STREAM_LEN);
+    atmega_xu4_submit(acm_ports[0].in_ep, xfer);
+}
+
+static void acm_stream_start(void) {
+    for(size_t i = 0; i < ACM_STREAM_SEGS; i++) {
+        acm_stream_segs[i] = (mqueue_seg_t)MQUEUE_SEG_P(msg, sizeof(msg) - 1,
+                i + 1 < ACM_STREAM_SEGS ? &acm_stream_segs[i + 1] : NULL);
+    }
+    for(size_t i = 0; i < 2; i++) {
+        acm_stream_xfers[i].chain = &acm_stream_queues[i];
+        acm_stream_xfers[i].complete = acm_stream_next;
+        acm_stream_next(&acm_stream_xfers[i]);
+    }
+}
+#endif
+
+/**
+ * Install the endpoint handlers of a port and start it with empty rings.
+ */
+static void acm_port_start(acm_port_t *port) {
+    usb_ring_reset(&port->rx);
+    usb_ring_reset(&port->tx);
+    port->notify = (acm_ep_t){{acm_handler, NULL, 0}, port};
+    port->in = (acm_ep_t){{acm_handler, usb_ring_any(&port->tx), 0}, port};
+    port->out = (acm_ep_t){{acm_handler, usb_ring_any(&port->rx), 0}, port};
+#if defined(ACM_BRIDGE)
+    if(port == &acm_ports[0]) {
+        acm_bridge_init(port);
+    }
+#else
+    if(port == &acm_ports[0]) {
+        // the IN stream is sent from transfers
+        port->in.header.data = NULL;
+    }
+#endif
+    atmega_xu4_install_ep_handler(port->notify_ep, &port->notify.header);
+    atmega_xu4_install_ep_handler(port->in_ep, &port->in.header);
+    atmega_xu4_install_ep_handler(port->out_ep, &port->out.header);
+    atmega_xu4_set_in_hold(port->in_ep, port->hold_frames);
+    UENUM = port->out_ep;
+    UEIENX |= _BV(RXOUTE);
+    acm_notify_start(port);
+    if(port == &acm_ports[0]) {
+#if defined(ACM_BRIDGE)
+        acm_bridge_start(port);
+#else
+        // start streaming
+        acm_stream_start();
+#endif
+    }
+}
+
+static void acm_start(void) {
+    for(uint8_t i = 0; i < ACM_PORTS; i++) {
+        acm_port_start(&acm_ports[i]);
+    }
+}
+
+static void acm_install(void) {
+    for(uint8_t i = 0; i < ACM_PORTS; i++) {
+        atmega_xu4_install_req_handler(USB_REQ_TYPE_CLASS,
+                USB_REQ_RCPT_INTERFACE, acm_ports[i].intf, acm_request);
+    }
+}
+
+size_t usb_cdc_port_read(uint8_t port, void *buf, size_t len) {
+    acm_port_t *p;
+    size_t n;
+
+#if defined(ACM_BRIDGE)
+    // port 0 data goes to USART1
+    if(port == 0) {
+        return 0;
+    }
+#endif
+    if(port >= ACM_PORTS) {
+        return 0;
+    }
+    p = &acm_ports[port];
+    // the ISR only adds to rx, no need to lock it
+    n = usb_ring_read(&p->rx, buf, min(len, UINT8_MAX));
+    if(n) {
+        // there is room again, pick up any bank left behind. UENUM is shared
+        // with the ISR.
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            UENUM = p->out_ep;
+            UEIENX |= _BV(RXOUTE);
+        }
+    }
+    return n;
+}
+
+size_t usb_cdc_port_write(uint8_t port, const void *buf, size_t len) {
+    acm_port_t *p;
+    size_t n;
+
+    // port 0 sends the demo stream or USART1 data
+    if(port == 0 || port >= ACM_PORTS) {
+        return 0;
+    }
+    p = &acm_ports[port];
+    // the ISR only takes from tx, no need to lock it
+    n = usb_ring_write(&p->tx, buf, min(len, UINT8_MAX));
+    if(n) {
+        // flush_queue sends it from the next free bank and disables TXINE
+        // again once the ring is empty
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            UENUM = p->in_ep;
+            UEIENX |= _BV(TXINE);
+        }
+    }
+    return n;
+}
+
+void usb_cdc_port_flush(uint8_t port) {
+    // the demo stream is sent from transfers, not the queue
+    if(port >= ACM_PORTS || !acm_ports[port].in.header.data) {
+        return;
+    }
+    set_flush_lock(acm_ports[port].in_ep);
+}
+
+void usb_cdc_port_set_hold(uint8_t port, uint8_t frames) {
+    if(port >= ACM_PORTS) {
+        return;
+    }
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        acm_ports[port].hold_frames = frames;
+        atmega_xu4_set_in_hold(acm_ports[port].in_ep, frames);
+    }
+}
+
+#if !defined(ACM_BRIDGE)
+size_t usb_cdc_read(void *buf, size_t len) {
+    return usb_cdc_port_read(0, buf, len);
+}
+#endif
+#else
+static void acm_start(void) {
+}
+
+static void acm_install(void) {
+}
+#endif
+
+// END ACM STUFF
+
+// RAW STUFF
+
+// Vendor-specific bulk IN/OUT pair for binary streams, see usb_raw_send.
+// Each packet has a slot of its own, sent or received as one transfer.
+#define RAW_FUNCTIONS USB_NUM_RAW_FUNCTIONS
+// a slot is one full-speed packet
+#define RAW_BULK_SIZE 64
+#define RAW_SLOT_MASK (USB_RAW_SLOTS - 1)
+
+#if RAW_FUNCTIONS
+_Static_assert(RAW_FUNCTIONS == 1, "one raw bulk interface is supported");
+_Static_assert(!(USB_RAW_SLOTS & RAW_SLOT_MASK) && USB_RAW_SLOTS <= 128,
+    "USB_RAW_SLOTS must be a power of two no larger than 128"
+);
+
+#define RAW_EPS(intf, in, out) {in, out}
+// bulk IN and bulk OUT
+static const uint8_t raw_eps[2] = USB_RAW_FUNCTIONS(RAW_EPS);
+
+typedef struct {
+    uint8_t buf[RAW_BULK_SIZE];
+    usb_xfer_t xfer;
+} raw_slot_t;
+
+// Packets to send. Slot indices run freely and are masked on access:
+// [head, tail) are closed, the first submitted of them are in transfers,
+// and the main loop fills slot tail.
+static raw_slot_t raw_tx[USB_RAW_SLOTS];
+static volatile uint8_t raw_tx_head;
+static volatile uint8_t raw_tx_tail;
+static volatile uint8_t raw_tx_submitted;
+static volatile uint8_t raw_tx_fill;
+// set while the main loop adds to slot tail: the ISR leaves it alone
+static volatile bool raw_tx_writing;
+
+// Received packets: [head, tail) hold data, the next submitted slots wait for
+// it. The main loop reads slot head from pos on.
+static raw_slot_t raw_rx[USB_RAW_SLOTS];
+static volatile uint8_t raw_rx_head;
+static volatile uint8_t raw_rx_tail;
+static volatile uint8_t raw_rx_submitted;
+static uint8_t raw_rx_pos;
+
+static void (*raw_rx_hook)(void);
+static void (*raw_tx_hook)(void);
+
+static void raw_handler(usb_ep_ctx_t *ctx) {
+    // stub, the slots move on transfer completion
+}
+
+static void raw_in_event(usb_ep_ctx_t *ctx);
+
+usb_ep_ctx_t raw_in_handler = {
+    .callback = raw_in_event,
+    .data = NULL,
+    .flags = 0
+};
+usb_ep_ctx_t raw_out_handler = {
+    .callback = raw_handler,
+    .data = NULL,
+    .flags = 0
+};
+
+/**
+ * Submit closed slots, as many as the endpoint takes. USB ISR context, or
+ * interrupts disabled.
+ */
+static void raw_tx_submit(void) {
+    raw_slot_t *s;
+
+    while(raw_tx_submitted < ATMEGA_XU4_XFER_SLOTS
+            && (uint8_t)(raw_tx_head + raw_tx_submitted) != raw_tx_tail) {
+        s = &raw_tx[(raw_tx_head + raw_tx_submitted) & RAW_SLOT_MASK];
+        if(!atmega_xu4_submit(raw_eps[0], &s->xfer)) {
+            // not configured
+            return;
+        }
+        raw_tx_submitted++;
+    }
+}
+
+/**
+ * Close slot tail, full or not. USB ISR context, or interrupts disabled.
+ */
+static void raw_tx_close(void) {
+    raw_tx[raw_tx_tail & RAW_SLOT_MASK].xfer.len = raw_tx_fill;
+    raw_tx_fill = 0;
+    raw_tx_tail++;
+}
+
+// a packet is in a bank
+static void raw_tx_done(usb_xfer_t *xfer) {
+    raw_tx_head++;
+    raw_tx_submitted--;
+    raw_tx_submit();
+    if(raw_tx_hook) {
+        raw_tx_hook();
+    }
+}
+
+/**
+ * Batching: send the partial slot once nothing else is queued and the host
+ * has taken every bank, ie. would be NAKed otherwise. While the host keeps
+ * up, it gets data without delay; once it is the bottleneck, the slot fills
+ * up while the banks are busy and every packet is full.
+ * USB ISR context, or interrupts disabled, with the IN endpoint selected.
+ */
+static void raw_tx_flush_partial(void) {
+    if(raw_tx_submitted || !raw_tx_fill || raw_tx_writing) {
+        return;
+    }
+    if(UESTA0X & (_BV(NBUSYBK1) | _BV(NBUSYBK0))) {
+        // look again when the host takes a bank: TXINI is set then
+        UEINTX &= ~_BV(TXINI);
+        UEIENX |= _BV(TXINE);
+        return;
+    }
+    raw_tx_close();
+    raw_tx_submit();
+}
+
+static void raw_in_event(usb_ep_ctx_t *ctx) {
+    // after the transfers had their turn. UENUM is the IN endpoint.
+    raw_tx_flush_partial();
+}
+
+/**
+ * Append to the open slots. The caller has checked the space.
+ */
+static void raw_tx_append(const uint8_t *src, uint16_t n) {
+    raw_slot_t *s;
+    uint8_t k;
+
+    while(n) {
+        s = &raw_tx[raw_tx_tail & RAW_SLOT_MASK];
+        k = min(n, (uint16_t)(RAW_BULK_SIZE - raw_tx_fill));
+        memcpy(s->buf + raw_tx_fill, src, k);
+        raw_tx_fill += k;
+        src += k;
+        n -= k;
+        if(raw_tx_fill == RAW_BULK_SIZE) {
+            // full packet, it goes out while the rest is written
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                raw_tx_close();
+                raw_tx_submit();
+            }
+        }
+    }
+}
+
+bool usb_raw_send(const void *buf, uint16_t len) {
+    uint8_t hdr[USB_RAW_HDR_SIZE] = {len & 0xFF, len >> 8};
+    uint16_t space;
+    bool ok;
+
+    // closing a partial slot takes space: keep the ISR away first
+    raw_tx_writing = true;
+    space = (USB_RAW_SLOTS - (uint8_t)(raw_tx_tail - raw_tx_head))
+        * RAW_BULK_SIZE - raw_tx_fill;
+    ok = space >= USB_RAW_HDR_SIZE && len <= space - USB_RAW_HDR_SIZE;
+    if(ok) {
+        raw_tx_append(hdr, sizeof(hdr));
+        raw_tx_append(buf, len);
+    }
+    raw_tx_writing = false;
+    // the ISR may have passed over the partial slot meanwhile
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        UENUM = raw_eps[0];
+        raw_tx_flush_partial();
+    }
+    return ok;
+}
+
+/**
+ * Keep empty slots submitted for the host to fill. USB ISR context, or
+ * interrupts disabled.
+ */
+static void raw_rx_submit(void) {
+    raw_slot_t *s;
+
+    while(raw_rx_submitted < ATMEGA_XU4_XFER_SLOTS
+            && (uint8_t)(raw_rx_tail + raw_rx_submitted - raw_rx_head)
+                < USB_RAW_SLOTS) {
+        s = &raw_rx[(raw_rx_tail + raw_rx_submitted) & RAW_SLOT_MASK];
+        s->xfer.len = RAW_BULK_SIZE;
+        if(!atmega_xu4_submit(raw_eps[1], &s->xfer)) {
+            return;
+        }
+        raw_rx_submitted++;
+    }
+}
+
+// a packet arrived, short ones included
+static void raw_rx_done(usb_xfer_t *xfer) {
+    raw_rx_tail++;
+    raw_rx_submitted--;
+    raw_rx_submit();
+    if(raw_rx_hook) {
+        raw_rx_hook();
+    }
+}
+
+/**
+ * Bytes received and not read yet.
+ */
+static uint16_t raw_rx_count(void) {
+    uint8_t tail = raw_rx_tail;
+    uint16_t n = 0;
+
+    for(uint8_t i = raw_rx_head; i != tail; i++) {
+        n += raw_rx[i & RAW_SLOT_MASK].xfer.actual;
+    }
+    return n - raw_rx_pos;
+}
+
+/**
+ * Copy the next n received bytes without reading them, n at most
+ * raw_rx_count().
+ */
+static void raw_rx_peek(uint8_t *dst, uint8_t n) {
+    uint8_t slot = raw_rx_head;
+    uint8_t pos = raw_rx_pos;
+    raw_slot_t *s;
+
+    while(n) {
+        s = &raw_rx[slot & RAW_SLOT_MASK];
+        if(pos == s->xfer.actual) {
+            slot++;
+            pos = 0;
+            continue;
+        }
+        *dst++ = s->buf[pos++];
+        n--;
+    }
+}
+
+/**
+ * Read the next n received bytes, n at most raw_rx_count(), and give the
+ * slots read up back to the host.
+ * @param dst destination, NULL to drop them
+ */
+static void raw_rx_take(uint8_t *dst, uint16_t n) {
+    raw_slot_t *s;
+    uint8_t k;
+
+    while(n) {
+        s = &raw_rx[raw_rx_head & RAW_SLOT_MASK];
+        k = min(n, (uint16_t)(s->xfer.actual - raw_rx_pos));
+        if(dst) {
+            memcpy(dst, s->buf + raw_rx_pos, k);
+            dst += k;
+        }
+        raw_rx_pos += k;
+        n -= k;
+        if(raw_rx_pos == s->xfer.actual) {
+            raw_rx_pos = 0;
+            raw_rx_head++;
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                raw_rx_submit();
+            }
+        }
+    }
+}
+
+bool usb_raw_recv(void *buf, uint16_t *len) {
+    uint16_t avail = raw_rx_count();
+    uint8_t hdr[USB_RAW_HDR_SIZE];
+    uint16_t frame;
+
+    if(avail < USB_RAW_HDR_SIZE) {
+        return false;
+    }
+    raw_rx_peek(hdr, sizeof(hdr));
+    frame = hdr[0] | (hdr[1] << 8);
+    if(frame > USB_RAW_FRAME_MAX) {
+        // can never be received whole: the stream is lost, drop what is in
+        raw_rx_take(NULL, avail);
+        return false;
+    }
+    if(avail - USB_RAW_HDR_SIZE < frame) {
+        return false;
+    }
+    raw_rx_take(NULL, USB_RAW_HDR_SIZE);
+    raw_rx_take(buf, min(frame, *len));
+    if(frame > *len) {
+        raw_rx_take(NULL, frame - *len);
+    }
+    *len = frame;
+    return true;
+}
+
+void usb_raw_set_hooks(void (*rx)(void), void (*tx)(void)) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        raw_rx_hook = rx;
+        raw_tx_hook = tx;
+    }
+}
+
+/**
+ * Start with empty slots under a new configuration.
+ */
+static void raw_start(void) {
+    for(uint8_t i = 0; i < USB_RAW_SLOTS; i++) {
+        raw_tx[i].xfer = (usb_xfer_t){
+            .buf = raw_tx[i].buf,
+            .complete = raw_tx_done,
+        };
+        raw_rx[i].xfer = (usb_xfer_t){
+            .buf = raw_rx[i].buf,
+            .complete = raw_rx_done,
+        };
+    }
+    raw_tx_head = raw_tx_tail = raw_tx_submitted = raw_tx_fill = 0;
+    raw_rx_head = raw_rx_tail = raw_rx_submitted = raw_rx_pos = 0;
+    atmega_xu4_install_ep_handler(raw_eps[0], &raw_in_handler);
+    atmega_xu4_install_ep_handler(raw_eps[1], &raw_out_handler);
+    raw_rx_submit();
+    // all slots are free
+    if(raw_tx_hook) {
+        raw_tx_hook();
+    }
+}
+#else
+static void raw_start(void) {
+}
+#endif
+
+// END RAW STUFF
+
+// usb_descgen.py plans the banks of EP1-6 and checks them against DPRAM with
+// the smallest EP0, this is the check with the one built in
+_Static_assert(ATMEGA_XU4_EP0_SIZE + USB_EP_DPRAM_SIZE <= ATMEGA_XU4_DPRAM_SIZE,
+    "endpoints do not fit in DPRAM"
+);
+
+// endpoint numbers in the plan, as a bit mask
+#define EP_PLAN_BIT(epnum, cfg0, cfg1) | _BV(epnum)
+#define EP_PLAN_MASK (0 USB_ENDPOINTS(EP_PLAN_BIT))
+
+#if defined(USB_ASM_ISR)
+#if !defined(ACM_BRIDGE)
+#error "USB_ASM_ISR serves the USART1 bridge, it needs ACM_BRIDGE"
+#endif
+// 32u4_usb_isr.S moves whole packets of USB_ISR_BULK_SIZE bytes between
+// the bridged endpoints and the UART rings, the banks must be that size
+#define EP_PLAN_ISR_SIZE(epnum, cfg0, cfg1) \
+    | (((epnum) == USB_ISR_IN_EP || (epnum) == USB_ISR_OUT_EP) \
+        && (((cfg1) >> EPSIZE0) & 0x7) != ATMEGA_XU4_EPSIZE(USB_ISR_BULK_SIZE))
+_Static_assert(!(0 USB_ENDPOINTS(EP_PLAN_ISR_SIZE))
+        && USB_ISR_BULK_SIZE == ACM_BULK_SIZE,
+    "32u4_usb_isr.h does not match the bridge endpoints"
+);
+// and only takes a packet out of the receive ring once it holds one whole
+_Static_assert(UART_RX_LEN >= USB_ISR_BULK_SIZE,
+    "the UART receive ring is smaller than a bridge packet"
+);
+
+// 32u4_usb_isr.S has the vector and jumps to this when its fast path does
+// not apply
+#define USB_COM_ISR USB_COM_SLOW_VECT
+#else
+#define USB_COM_ISR USB_COM_vect
+#endif
+
+/**
+ * Enable and allocate the selected endpoint.
+ * @return false if the hardware rejected the configuration
+ */
+static bool ep_alloc(uint8_t epnum, uint8_t cfg0, uint8_t cfg1) {
+    UENUM = epnum;
+    UECONX |= _BV(EPEN);
+    UECFG0X = cfg0;
+    UECFG1X = cfg1;
+    return UESTA0X & _BV(CFGOK);
+}
+
+/**
+ * Allocate the endpoints of every function and start them.
+ * @return false if the hardware rejected an endpoint
+ */
+static bool configure_endpoints(void) {
+    uint8_t eps = EP_PLAN_MASK;
+
+    // drop transfers submitted under a previous configuration
+    for(int i = 1; i < NUM_EPS; i++) {
+        xfer_rings[i].count = 0;
+        xfer_rings[i].bank_len = 0;
+    }
+
+    UERST |= eps; // reset the endpoints in use
+    UERST &= ~eps; // release reset state
+
+    // every endpoint in the descriptors, in the ascending order the
+    // controller allocates DPRAM in, TRM 22.7, whichever function it
+    // belongs to
+#define EP_PLAN_ALLOC(epnum, cfg0, cfg1) \
+    if(!ep_alloc(epnum, cfg0, cfg1)) { \
+        return false; \
+    }
+    USB_ENDPOINTS(EP_PLAN_ALLOC)
+#undef EP_PLAN_ALLOC
+    acm_start();
+    raw_start();
+    return true;
+}
+
+
+void atmega_xu4_setup_usb(void) {
+
+    clock_init();
+
+    USBCON &= ~_BV(OTGPADE);
+    UHWCON = 1; // enable USB I/O pad 3.3V regulator
+    USBCON = (1 << USBE); // enable module & VBUS pres. detect
+    UDIEN |= _BV(EORSTE) | _BV(SUSPE);
+
+    // initiate connection to host by connecting pullups
+    USBCON = (1 << USBE) | (1 << OTGPADE) | (1 << VBUSTE); // enable module & VBUS pres. detect
+
+    UDCON |= _BV(DETACH);
+    _delay_ms(10);
+    UDCON &= ~_BV(DETACH);
+
+    // connect setup / control handler to ep0
+    usb_ring_reset(&ep0_queue);
+    atmega_xu4_install_ep_handler(0, &ep0_handler);
+    acm_install();
+    atmega_xu4_install_req_handler(USB_REQ_TYPE_VENDOR, USB_REQ_RCPT_DEVICE,
+            0, handle_vendor);
+}
+
+void atmega_xu4_set_suspend_hooks(void (*suspend)(void),
+        void (*resume)(void)) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        suspend_hook = suspend;
+        resume_hook = resume;
+    }
+}
+
+bool atmega_xu4_remote_wakeup(void) {
+    bool ok = false;
+
+    if(!usb_suspended || !usb_remote_wakeup) {
+        return false;
+    }
+    // the bus must have been idle for 5ms, USB 2.0 7.1.7.7. SUSPI is set
+    // after 3ms.
+    _delay_ms(2);
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        // the host may have resumed the bus meanwhile
+        if(usb_suspended) {
+            clock_resume();
+            // needs SUSPI, which stays set until WAKEUPI: the host answers
+            // with a resume of its own, which ends the suspend there
+            UDCON |= _BV(RMWKUP);
+            trace(TRACE_USB_REMOTE_WAKEUP, 0);
+            ok = true;
+        }
+    }
+    return ok;
+}
+
+bool atmega_xu4_install_ep_handler(int epnum, usb_ep_ctx_t *handler_ctx) {
+    bool r = false;
+    if(epnum < NUM_EPS) {
+        usb_ep_handlers[epnum] = handler_ctx;
+        r = true;
+    }
+
+    return r;
+}
+
+void atmega_xu4_set_in_hold(int epnum, uint8_t frames) {
+    if(epnum > 0 && epnum < NUM_EPS) {
+        in_hold_frames[epnum] = min(frames, 127);
+    }
+}
+
+uint16_t atmega_xu4_frame_number(void) {
+    uint8_t hi, lo;
+
+    // no latch for the high byte: read again if the low byte wrapped
+    do {
+        hi = UDFNUMH;
+        lo = UDFNUML;
+    } while(hi != UDFNUMH);
+    return ((uint16_t)hi << 8 | lo) & 0x7FF;
+}
+
+bool atmega_xu4_ep_flush(int epnum) {
+    usb_ep_handlers[epnum]->flags |= (EP_FLUSH);
+    // TODO most times UENUM will already be set correctly. Avoid spurious
+    // instrs by figuring out where to put these.
+    UENUM = epnum;
+    UEINTX &= ~_BV(TXINI);
+    UEINTX &= ~_BV(FIFOCON);
+    UEIENX |= _BV(TXINE); // enable in interrupt
+    return (UESTA0X & 0x3);
+}
+
+// unrolled copy loops below are stepped by the smallest bank size
+#define REPEAT8(x) x; x; x; x; x; x; x; x
+
+/**
+ * Copy n bytes from a buffer into the selected endpoint's bank.
+ */
+static inline void copy_to_fifo(const uint8_t *src, uint16_t n) {
+    for(; n >= 8; n -= 8) {
+        REPEAT8(UEDATX = *src++);
+    }
+    while(n--) {
+        UEDATX = *src++;
+    }
+}
+
+/**
+ * copy_to_fifo from program memory.
+ */
+static inline void copy_to_fifo_P(const uint8_t *src, uint16_t n) {
+    while(n--) {
+        UEDATX = pgm_read_byte(src++);
+    }
+}
+
+/**
+ * Copy up to room bytes from a segment queue into the selected endpoint's
+ * bank, span by span, straight from where each span is.
+ * @return number of bytes copied
+ */
+static uint16_t mqueue_to_fifo(mqueue_t *q, uint16_t room) {
+    const uint_least8_t *span;
+    uint16_t done = 0;
+    size_t n;
+    bool pgm;
+
+    while(done < room && (span = mqueue_peek_span(q, &n, &pgm))) {
+        n = min(n, room - done);
+        if(pgm) {
+            copy_to_fifo_P(span, n);
+        }
+        else {
+            copy_to_fifo(span, n);
+        }
+        mqueue_consume(q, n);
+        done += n;
+    }
+    return done;
+}
+
+/**
+ * Copy n bytes from the selected endpoint's bank into a buffer.
+ */
+static inline void copy_from_fifo(uint8_t *dst, uint16_t n) {
+    for(; n >= 8; n -= 8) {
+        REPEAT8(*dst++ = UEDATX);
+    }
+    while(n--) {
+        *dst++ = UEDATX;
+    }
+}
+
+/**
+ * Copy n bytes from the software queue into the selected endpoint's bank,
+ * one contiguous span at a time. The caller has already checked that both
+ * have room, so there are no per-byte status checks.
+ */
+static inline void burst_to_fifo(byte_ring_t *q, uint8_t n) {
+    const uint8_t *span;
+    uint8_t len;
+
+    while(n) {
+        span = byte_ring_read_span(q, &len);
+        len = min(len, n);
+        copy_to_fifo(span, len);
+        byte_ring_consume(q, len);
+        n -= len;
+    }
+}
 
-// default endpoint 0 handler
-usb_ep_ctx_t ep0_handler = {
-    .callback = handle_setup,
-    .data = &ep0_queue,
-    .flags = 0
-};
+/**
+ * Copy n bytes from the selected endpoint's bank into the software queue.
+ * The caller has already checked that both have room.
+ */
+static inline void burst_from_fifo(byte_ring_t *q, uint8_t n) {
+    uint8_t *span;
+    uint8_t len;
 
-// array of endpoint handlers
-static volatile usb_ep_ctx_t *usb_ep_handlers[NUM_EPS];
+    while(n) {
+        span = byte_ring_write_span(q, &len);
+        len = min(len, n);
+        copy_from_fifo(span, len);
+        byte_ring_commit(q, len);
+        n -= len;
+    }
+}
 
+/**
+ * Bank size of the selected endpoint, TRM 22.18.2, UECFG1X section.
+ */
+static inline uint16_t ep_size(void) {
+    return 8 << ((UECFG1X >> EPSIZE0) & 0x7);
+}
 
-static void clock_init(void) {
-    // 96MHz USB clock
-    PLLCSR = 0x12;
-    PLLFRQ = _BV(PLLUSB) | _BV(PLLTM1) | 0xA;
+/**
+ * Check whether firmware owns the current IN bank of the selected endpoint.
+ * TXINI is set while the control bank can take data, FIFOCON while the
+ * current bank of any other endpoint can (TRM 22.14). With two banks, the
+ * second one is writable while the host is still reading the first.
+ */
+static inline bool in_bank_writable(bool control) {
+    return UEINTX & (control ? _BV(TXINI) : _BV(FIFOCON));
 }
 
-// ACM STUFF
-#define EP1_LEN 16
-#define EP2_LEN 64
-#define EP3_LEN 64
-static void out_handler(usb_ep_ctx_t *ctx);
-static void in_handler(usb_ep_ctx_t *ctx);
-static void config_handler(usb_ep_ctx_t *ctx);
-char ep1_buf[EP1_LEN];
-char ep2_buf[EP2_LEN];
-char ep3_buf[EP3_LEN];
-queue_t ep1_queue;
-queue_t ep2_queue;
-queue_t ep3_queue;
-
-usb_ep_ctx_t ep1_handler = {
-    .callback = config_handler,
-    .data = &ep1_queue,
-    .flags = 0
-};
-usb_ep_ctx_t ep2_handler = {
-    .callback = in_handler,
-    .data = &ep2_queue,
-    .flags = 0
-};
-usb_ep_ctx_t ep3_handler = {
-    .callback = out_handler,
-    .data = &ep3_queue,
-    .flags = 0
-};
-static void out_handler(usb_ep_ctx_t *ctx) {
-    // HAX nack out transactions by doing nothing
+/**
+ * Hand the current IN bank of the selected endpoint to the hardware.
+ * Control endpoints only use TXINI, clearing FIFOCON on them is incorrect
+ * fw behavior: TRM 22.12 paragraph 2. Other endpoints clear TXINI to
+ * acknowledge the interrupt and FIFOCON to switch banks.
+ */
+static inline void release_in_bank(bool control) {
+    UEINTX &= ~_BV(TXINI);
+    if(!control) {
+        UEINTX &= ~_BV(FIFOCON);
+    }
 }
-static void config_handler(usb_ep_ctx_t *ctx) {
-    // stub
+
+/**
+ * Whether the partial packet in the selected IN bank goes now, rather than
+ * wait for more data. The first call for a packet starts the wait and the
+ * SOF interrupt, which sets EP_FLUSH once it is due, see in_hold_sof.
+ */
+static inline bool in_hold_over(uint8_t epnum) {
+    if(!in_hold_frames[epnum] || is_flush_locked(epnum)) {
+        return true;
+    }
+    if(!(in_held & _BV(epnum))) {
+        in_held |= _BV(epnum);
+        in_hold_due[epnum] = UDFNUML + in_hold_frames[epnum];
+        UDIEN |= _BV(SOFE);
+    }
+    return false;
 }
-static char msg[] = "the cake is a lie\r\n";
-static size_t msg_len = sizeof(msg);
-static void in_handler(usb_ep_ctx_t *ctx) {
-    int i = 0;
-    if(is_flush_locked(2)) {
+
+/**
+ * SOF, the 1ms timebase of IN coalescing: flush the held packets that are
+ * due. The interrupt is turned off again once none are held.
+ */
+static void in_hold_sof(void) {
+    uint8_t frame = UDFNUML;
+
+    if(!in_held) {
+        UDIEN &= ~_BV(SOFE);
         return;
     }
-    while(!QUEUE_FULL(&ep2_queue)) {
-        queue_push(&ep2_queue, msg[i]);
-        i = (i == msg_len)? 0:i+1;
+    for(uint8_t epnum = 1; epnum < NUM_EPS; epnum++) {
+        if((in_held & _BV(epnum)) && (int8_t)(frame - in_hold_due[epnum]) >= 0) {
+            set_flush_lock(epnum);
+            trace(TRACE_USB_IN_HOLD_DUE, frame);
+        }
     }
-    set_flush_lock(2);
 }
 
-static void configure_acm_bulk(void) {
-    // reset sw queues
-    queue_init(&ep1_queue, ep1_buf, EP1_LEN);
-    queue_init(&ep2_queue, ep2_buf, EP2_LEN);
-    queue_init(&ep3_queue, ep3_buf, EP3_LEN);
+/**
+ * Write from the software queue to DPRAM, a bank at a time. The free space
+ * in the bank is read once, then as many queued bytes as fit are copied in
+ * one burst before the bank is handed over.
+ */
+static void flush_queue(char epnum) {
+    byte_ring_t *q = usb_ep_handlers[(int)epnum]->data;
+    UENUM = epnum;
+    uint16_t epsize = ep_size();
+    bool control = !(UECFG0X & (0x3 << EPTYPE0));
+    uint16_t room, n;
 
-    UERST |= (7 << 1); // reset endpoints 1-3
-    UERST &= ~(7 << 1); // release reset state
-    UENUM = 1;
-    UECONX |= _BV(EPEN);
-    UECFG0X = 0;
-    UECFG1X |= (16 << EPSIZE0) | _BV(ALLOC);
+    while(byte_ring_count(q) && in_bank_writable(control)) {
+        room = epsize - UEBCX;
+        n = min(byte_ring_count(q), room);
+        burst_to_fifo(q, n);
+        if(n < room) {
+            // queue ran dry before the bank filled up
+            break;
+        }
+        // full packet: switch to the other bank if there is one, else
+        // yield until the next IN
+        release_in_bank(control);
+        in_held &= ~_BV(epnum);
+    }
+    if(!byte_ring_count(q)) {
+        // end of data: send the partial bank as a short packet, or a ZLP if
+        // the last packet was full.
+        // TODO a short packet ends the transfer (USB 5.8.3), so the whole
+        // transfer must be queued before flushing.
+        // Only control transfers need the ZLP, bulk streams just stop, and
+        // their short packets may wait for more data first.
+        if(in_bank_writable(control)
+                && (control || (UEBCX && in_hold_over(epnum)))) {
+            release_in_bank(control);
+            in_held &= ~_BV(epnum);
+        }
+        // disable IN interrupts
+        UEIENX &= ~_BV(TXINE);
+        clear_flush_lock(epnum);
+    }
+}
 
-    UENUM = 2;
-    UECONX |= _BV(EPEN);
-    UECFG0X = (2 << EPTYPE0) | _BV(EPDIR); // IN endpoint
-    UECFG1X |= (16 << EPSIZE0) | _BV(ALLOC); // 16 byte hw queue
+bool atmega_xu4_submit(int epnum, usb_xfer_t *xfer) {
+    xfer_ring_t *r = &xfer_rings[epnum];
+    bool ok = false;
+    uint8_t prev;
 
-    UENUM = 3;
-    UECONX |= _BV(EPEN);
-    UECFG0X = (2 << EPTYPE0); // OUT endpoint
-    UECFG1X |= (16 << EPSIZE0) | _BV(ALLOC); // 16 byte hw queue
-    
-    atmega_xu4_install_ep_handler(1, &ep1_handler);
-    atmega_xu4_install_ep_handler(2, &ep2_handler);
-    atmega_xu4_install_ep_handler(3, &ep3_handler);
+    if(epnum <= 0 || epnum >= NUM_EPS || !usb_ep_handlers[epnum]) {
+        return false;
+    }
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if(r->count < ATMEGA_XU4_XFER_SLOTS) {
+            if(xfer->chain) {
+                xfer->len = MQUEUE_SIZE(xfer->chain);
+            }
+            xfer->actual = 0;
+            xfer->status = USB_XFER_PENDING;
+            r->slots[(r->head + r->count) % ATMEGA_XU4_XFER_SLOTS] = xfer;
+            r->count++;
+            usb_ep_handlers[epnum]->flags |= EP_XFER;
+            // may be called from another ISR, keep its endpoint selected
+            prev = UENUM;
+            UENUM = epnum;
+            UEIENX |= (UECFG0X & _BV(EPDIR)) ? _BV(TXINE) : _BV(RXOUTE);
+            UENUM = prev;
+            ok = true;
+        }
+    }
+    return ok;
 }
 
-// END ACM STUFF
+/**
+ * Retire the oldest transfer of an endpoint and run its completion
+ * callback, which may submit again.
+ */
+static void xfer_complete(char epnum) {
+    xfer_ring_t *r = &xfer_rings[(int)epnum];
+    usb_xfer_t *xfer = r->slots[r->head];
+
+    r->head = (r->head + 1) % ATMEGA_XU4_XFER_SLOTS;
+    r->count--;
+    xfer->status = USB_XFER_DONE;
+    if(xfer->complete) {
+        xfer->complete(xfer);
+        // the callback may have selected another endpoint
+        UENUM = epnum;
+    }
+}
 
+/**
+ * Copy submitted IN transfers into free banks, one packet per bank, and
+ * hand each bank over as soon as it is written.
+ */
+static void xfer_in(char epnum) {
+    xfer_ring_t *r = &xfer_rings[(int)epnum];
+    UENUM = epnum;
+    uint16_t epsize = ep_size();
+    usb_xfer_t *xfer;
+    uint16_t n;
 
-void atmega_xu4_setup_usb(void) {
+    while(r->count && in_bank_writable(false)) {
+        xfer = r->slots[r->head];
+        if(xfer->chain) {
+            n = mqueue_to_fifo(xfer->chain, epsize);
+        }
+        else {
+            n = min(xfer->len - xfer->actual, epsize);
+            copy_to_fifo(xfer->buf + xfer->actual, n);
+        }
+        xfer->actual += n;
+        release_in_bank(false);
+        if(xfer->actual == xfer->len
+                && (n < epsize || !(xfer->flags & USB_XFER_ZLP))) {
+            xfer_complete(epnum);
+        }
+    }
+    if(!r->count) {
+        UEIENX &= ~_BV(TXINE);
+    }
+}
 
-    clock_init();
+/**
+ * Copy received banks into submitted OUT transfers. Without a transfer to
+ * receive into, banks are left full and the host is NAKed.
+ */
+static void xfer_out(char epnum) {
+    xfer_ring_t *r = &xfer_rings[(int)epnum];
+    UENUM = epnum;
+    uint16_t epsize = ep_size();
+    usb_xfer_t *xfer;
+    uint16_t avail, n;
 
-    USBCON &= ~_BV(OTGPADE);
-    UHWCON = 1; // enable USB I/O pad 3.3V regulator
-    USBCON = (1 << USBE); // enable module & VBUS pres. detect
-    UDIEN |= _BV(EORSTE);
+    while(UEINTX & _BV(RXOUTI)) {
+        if(!r->count) {
+            UEIENX &= ~_BV(RXOUTE);
+            return;
+        }
+        xfer = r->slots[r->head];
+        avail = UEBCX;
+        if(!r->bank_len) {
+            r->bank_len = avail;
+        }
+        n = min(avail, xfer->len - xfer->actual);
+        copy_from_fifo(xfer->buf + xfer->actual, n);
+        xfer->actual += n;
+        if(n == avail) {
+            UEINTX &= ~_BV(RXOUTI);
+            UEINTX &= ~_BV(FIFOCON);
+        }
+        // a short packet ends the transfer that takes its last byte
+        if(xfer->actual == xfer->len
+                || (n == avail && r->bank_len < epsize)) {
+            xfer_complete(epnum);
+        }
+        if(n == avail) {
+            r->bank_len = 0;
+        }
+    }
+}
 
-    // initiate connection to host by connecting pullups
-    USBCON = (1 << USBE) | (1 << OTGPADE) | (1 << VBUSTE); // enable module & VBUS pres. detect
+/**
+ * Start the data stage with ep0_in set up.
+ */
+static void ep0_start_in(uint16_t wlength) {
+    ep0_in_short = MQUEUE_SIZE(&ep0_in) < wlength;
+    ep0_stage = EP0_DATA_IN;
+    UENUM = 0;
+    UEIENX |= _BV(TXINE);
+}
 
-    UDCON |= _BV(DETACH);
-    _delay_ms(10);
-    UDCON &= ~_BV(DETACH);
+void atmega_xu4_ep0_send(const void *data, uint16_t len, uint16_t wlength) {
+    mqueue_init(&ep0_in, data, min(len, wlength));
+    ep0_start_in(wlength);
+}
 
-    // connect setup / control handler to ep0
-    queue_init(&ep0_queue, ep0_buf, EP0_LEN);
-    atmega_xu4_install_ep_handler(0, &ep0_handler);
+void atmega_xu4_ep0_send_P(const void *data, uint16_t len,
+        uint16_t wlength) {
+    mqueue_init_P(&ep0_in, data, min(len, wlength));
+    ep0_start_in(wlength);
 }
 
-bool atmega_xu4_install_ep_handler(int epnum, usb_ep_ctx_t *handler_ctx) {
-    bool r = false;
-    if(epnum < NUM_EPS) {
-        usb_ep_handlers[epnum] = handler_ctx;
-        r = true;
+void atmega_xu4_ep0_send_chain(const mqueue_seg_t *seg, uint16_t wlength) {
+    mqueue_init_chain(&ep0_in, seg, wlength);
+    ep0_start_in(wlength);
+}
+
+void atmega_xu4_ep0_recv(void *buf, uint16_t wlength, void (*done)(void)) {
+    ep0_out_buf = buf;
+    ep0_out_len = wlength;
+    ep0_out_pos = 0;
+    ep0_out_done = done;
+    ep0_stage = EP0_DATA_OUT;
+    if(!wlength) {
+        if(done) {
+            done();
+        }
+        atmega_xu4_ep0_status();
     }
+}
 
-    return r;
+/**
+ * Send the zero-length status packet of a no-data or control write
+ * transfer. TXINI is set again once the host has taken it, which completes
+ * the transfer.
+ */
+void atmega_xu4_ep0_status(void) {
+    UENUM = 0;
+    ep0_stage = EP0_STATUS_IN;
+    UEINTX = ~_BV(TXINI);
+    UEIENX |= _BV(TXINE);
 }
 
-bool atmega_xu4_ep_flush(int epnum) {
-    usb_ep_handlers[epnum]->flags |= (EP_FLUSH);
-    // TODO most times UENUM will already be set correctly. Avoid spurious
-    // instrs by figuring out where to put these.
-    UENUM = epnum;
-    UEINTX &= ~_BV(TXINI);
-    UEINTX &= ~_BV(FIFOCON);
-    UEIENX |= _BV(TXINE); // enable in interrupt
-    return (UESTA0X & 0x3);
+/**
+ * Refuse the current control request. The hardware clears the stall on the
+ * next SETUP.
+ */
+static void ep0_stall(void) {
+    atmega_xu4_ep_stall(0, true);
+    ep0_stage = EP0_IDLE;
+    UEIENX &= ~_BV(TXINE);
 }
 
 /**
- * Write from the software queue to DPRAM, writing at most
- * min(UECFG1X[EPSIZE], q->size) bytes.
+ * Copy the next packets of the control IN data stage from their source into
+ * the EP0 bank, one packet per free bank. The stage ends with the first
+ * short packet, or the last full packet if exactly wLength bytes are sent.
  */
-static void flush_queue(char epnum) {
-    queue_t *q = usb_ep_handlers[epnum]->data;
-    UENUM = epnum;
-    /*UEINTX &= ~_BV(TXINI);*/
-    // sizes defined in TRM 22.18.2, UECFG1X section
-    size_t epsize = (UECFG1X & (0x7 << EPSIZE0)) >> EPSIZE0;
-    epsize = 1 << (epsize + 3);
-    while(!QUEUE_EMPTY(q)) {
-        // space available in fifo
-        if(UEBCX < epsize) {
-            UEDATX = queue_pop(q);
-        }
-        //      > 0 non-full banks
-        else if(UESTA0X & 0x3) {
-            // clear FIFOCON to switch banks (IN) or TXINI to start ACKing
-            // IN packets (SETUP)
-            // also clear TXINI to prevent additional interrupts
-            // TODO clearing fifocon on control is supposedly incorrect
-            // fw behavior: TRM 22.12 paragraph 2
-            // TODO will clearing TXINI if the queue is empty, but
-            // the entire transfer is not complete (eg. application fw is not
-            // ready w/ the entire transfer / entire transfer does not fit in
-            // the buffer) cause a short packet, and does that short packet
-            // end the transfer prematurely?
-            // USB section 5.8.3 seems to suggest this is the case... FIXME
-            // this can probably be fixed by only clearing txini if the
-            // remaining bytes in the queue are >= epsize. Only if the flush
-            // lock is set do we forcibly clear txini.
-            UEINTX &= ~_BV(FIFOCON);
-            UEINTX &= ~_BV(TXINI); // two writes to give hw time to set txini
-        }
-        else {
-            // queue not empty, but USB fifo is full
-            // yield until next IN or bank ready
+static void flush_ep0_in(void) {
+    uint16_t n;
+
+    UENUM = 0;
+    while(in_bank_writable(true)) {
+        n = mqueue_to_fifo(&ep0_in, ATMEGA_XU4_EP0_SIZE);
+        release_in_bank(true);
+        if(n < ATMEGA_XU4_EP0_SIZE || (MQUEUE_EMPTY(&ep0_in) && !ep0_in_short)) {
+            // wait for the host's status packet
+            UEIENX &= ~_BV(TXINE);
+            ep0_stage = EP0_STATUS_OUT;
             break;
         }
     }
-    // FIXME hack to get it to transmit when queue is empty
-    UEINTX &= ~_BV(TXINI);
-    // disable IN interrupts
-    if(QUEUE_EMPTY(q)) {
-        UEIENX &= ~_BV(TXINE);
-        // clear flush lock
-        clear_flush_lock(0);
-    }
 }
 
 /**
- * Read from a DPRAM buffer into the software queue, reading at most
- * min(UEBCX, q->size) bytes.
- * flag shall be set to the UEINTX flag which is to be cleared in order to not
- * re-trigger an interrupt - either RXSTPI or FIFOCON.
+ * Read from DPRAM into the software queue, a bank at a time, TRM 22.13.
+ * The byte count of the bank is read once and copied in one burst. A bank is
+ * released only once it is empty: if the software queue fills up first, the
+ * rest stays in the bank and the hardware NAKs the host until the reader
+ * makes room (see usb_cdc_read). RXOUTE is disabled meanwhile, since RXOUTI
+ * stays set.
  */
 static void fill_queue(char epnum) {
-    queue_t *q = usb_ep_handlers[epnum]->data;
+    byte_ring_t *q = usb_ep_handlers[(int)epnum]->data;
     UENUM = epnum;
-    char c;
-    while(!QUEUE_FULL(q)) {
-        //  bank not empty
-        if(UEBCX > 0) {
-            // TODO without the temporary, UEDATX is not read and this loop blocks.
-            // wat.
-            c = UEDATX;
-            queue_push(q, c);
-        }
-        // OUT ep and > 0 non-empty banks: TRM 22.13 OUT EP management
-        else if(UESTA0X & 0x3) {
-            // DPRAM buffer is empty, clear FIFOCON to swap banks
-            // clear RXOUTI again to acknowledge interrupt, TRM 22.13.1,
-            // avoids spurious interrupts if there is room in the queue and
-            // there are non-empty banks remaining.
-            UEINTX &= ~_BV(FIFOCON);
-            UEINTX &= ~_BV(RXOUTI); // two writes to give hw time to set rxouti
+    uint16_t avail, n;
+
+    while(UEINTX & _BV(RXOUTI)) {
+        avail = UEBCX;
+        n = min(avail, byte_ring_space(q));
+        burst_from_fifo(q, n);
+        if(n < avail) {
+            // sw queue full, leave the rest in the bank
+            UEIENX &= ~_BV(RXOUTE);
+            return;
         }
-        else {
-            // all banks empty and sw queue non-full, yield until next OUT
-            // or bank ready
-            UEINTX &= ~_BV(RXOUTI); // clear to prevent further interrupts
-            break;
+        // bank is empty: acknowledge, then clear FIFOCON to swap banks.
+        // RXOUTI is set again right away if the other bank is full too.
+        UEINTX &= ~_BV(RXOUTI);
+        UEINTX &= ~_BV(FIFOCON);
+    }
+}
+
+/**
+ * EP0 IN bank is free (TXINI), with TXINE enabled.
+ */
+static void ep0_txini(void) {
+    switch(ep0_stage) {
+        case EP0_DATA_IN:
+            flush_ep0_in();
+        break;
+
+        case EP0_STATUS_IN:
+            // the host took the status packet: the transfer is complete
+            if(ep0_address_pending) {
+                ep0_address_pending = false;
+                UDADDR |= _BV(ADDEN);
+            }
+            ep0_stage = EP0_IDLE;
+            UEIENX &= ~_BV(TXINE);
+        break;
+
+        default:
+            UEIENX &= ~_BV(TXINE);
+        break;
+    }
+}
+
+/**
+ * EP0 received an OUT packet (RXOUTI).
+ */
+static void ep0_rxouti(void) {
+    uint16_t n;
+
+    if(ep0_stage == EP0_DATA_OUT) {
+        n = min(UEBCX, ep0_out_len - ep0_out_pos);
+        for(uint16_t i = 0; i < n; i++) {
+            ep0_out_buf[ep0_out_pos++] = UEDATX;
+        }
+        UEINTX &= ~_BV(RXOUTI);
+        if(ep0_out_pos == ep0_out_len) {
+            if(ep0_out_done) {
+                ep0_out_done();
+            }
+            atmega_xu4_ep0_status();
         }
     }
+    else {
+        // status stage of a control read, which may come before all of the
+        // data if the host wanted less than it asked for
+        UEINTX &= ~_BV(RXOUTI);
+        UEIENX &= ~_BV(TXINE);
+        ep0_stage = EP0_IDLE;
+    }
 }
 
 /**
@@ -280,28 +1593,24 @@ static void fill_queue(char epnum) {
  * 8 bytes for a low-speed device.
  */
 static inline void handle_control(char epnum) {
-    queue_t *q = usb_ep_handlers[epnum]->data;
+    byte_ring_t *q = usb_ep_handlers[(int)epnum]->data;
     UENUM = epnum;
-    QUEUE_RESET(q);
-    char c;
-    if(q->cap < UEBCX) {
+    byte_ring_reset(q);
+    uint16_t n = UEBCX;
+    if(byte_ring_space(q) < n) {
         // not enough space in the sw queue - stall to indicate failure to host
         atmega_xu4_ep_stall(epnum, true);
     }
     else {
-        while(UEBCX) {
-            // TODO without the temporary, UEDATX is not read and this loop blocks.
-            // wat.
-            c = UEDATX;
-            queue_push(q, c);
-        }
+        burst_from_fifo(q, n);
+        usb_ep_handlers[(int)epnum]->flags |= EP_SETUP;
         // clear RXSTPI to allow IN / OUT requests to be ACK'd
         UEINTX &= ~_BV(RXSTPI);
     }
 }
 
 void atmega_xu4_ep_stall(int epnum, bool stall_state) {
-    UEINTX = epnum;
+    UENUM = epnum;
     if(stall_state) {
         UECONX |= _BV(STALLRQ);
     }
@@ -310,6 +1619,117 @@ void atmega_xu4_ep_stall(int epnum, bool stall_state) {
     }
 }
 
+// class and vendor request handlers: one for the device, then one per
+// interface and one per endpoint, by number
+#define REQ_SLOT_DEVICE 0
+#define REQ_SLOT_INTERFACE 1
+#define REQ_SLOT_ENDPOINT (REQ_SLOT_INTERFACE + USB_NUM_INTERFACES)
+#define REQ_SLOTS (REQ_SLOT_ENDPOINT + NUM_EPS)
+
+// indexed by request type, class then vendor
+static usb_req_handler *req_handlers[2][REQ_SLOTS];
+
+/**
+ * Table slot for a request recipient.
+ * @param rcpt recipient bits of bmRequestType
+ * @param index low byte of wIndex: interface number or endpoint address
+ * @return REQ_SLOTS if there is no such recipient
+ */
+static inline uint8_t req_slot(uint8_t rcpt, uint8_t index) {
+    switch(rcpt) {
+        case USB_REQ_RCPT_DEVICE:
+            return REQ_SLOT_DEVICE;
+
+        case USB_REQ_RCPT_INTERFACE:
+            if(index < USB_NUM_INTERFACES) {
+                return REQ_SLOT_INTERFACE + index;
+            }
+        break;
+
+        case USB_REQ_RCPT_ENDPOINT:
+            // the direction bit does not matter, endpoint numbers are
+            // unique on this controller
+            index &= ~USB_REQ_DIR_IN;
+            if(index < NUM_EPS) {
+                return REQ_SLOT_ENDPOINT + index;
+            }
+        break;
+    }
+    return REQ_SLOTS;
+}
+
+bool atmega_xu4_install_req_handler(usb_req_type_t type, usb_req_type_t rcpt,
+        uint8_t index, usb_req_handler *handler) {
+    uint8_t slot = req_slot(rcpt, index);
+
+    if((type != USB_REQ_TYPE_CLASS && type != USB_REQ_TYPE_VENDOR)
+            || slot == REQ_SLOTS) {
+        return false;
+    }
+    // the USB ISR reads the pointer, which takes two accesses
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        req_handlers[type == USB_REQ_TYPE_VENDOR][slot] = handler;
+    }
+    return true;
+}
+
+/**
+ * Handler for a class or vendor request, NULL if there is none.
+ */
+static inline usb_req_handler *find_req_handler(const usb_req_std_t *req) {
+    uint8_t type = req->bmRequestType & USB_REQ_TYPE_MASK;
+    uint8_t slot = req_slot(req->bmRequestType & USB_REQ_RCPT_MASK,
+            req->wIndex & 0xFF);
+
+    // the fourth type is reserved
+    if(type == USB_REQ_TYPE_MASK || slot == REQ_SLOTS) {
+        return NULL;
+    }
+    return req_handlers[type == USB_REQ_TYPE_VENDOR][slot];
+}
+
+/**
+ * Vendor requests to the device.
+ * TRACE_VENDOR_REQ_READ: device to host, moves up to wLength bytes of
+ * buffered trace records out of the ring.
+ * ISR_STATS_VENDOR_REQ_READ: device to host, the isr_stats_hist_t selected
+ * by wValue.
+ * ISR_STATS_VENDOR_REQ_CLEAR: host to device, no data, clears the histograms.
+ */
+static bool handle_vendor(const usb_req_std_t *req) {
+    static trace_rec_t trace_buf[ATMEGA_XU4_EP0_SIZE / sizeof(trace_rec_t)];
+    uint8_t rcpt = req->bmRequestType & (USB_REQ_DIR_IN | USB_REQ_RCPT_MASK);
+
+    if(rcpt == (USB_REQ_DIR_IN | USB_REQ_RCPT_DEVICE)
+            && req->bRequest == TRACE_VENDOR_REQ_READ) {
+        // trace_buf stays untouched until the data stage is over: a new
+        // SETUP is needed to refill it
+        atmega_xu4_ep0_send(trace_buf, trace_read(trace_buf,
+                    min(req->wLength, sizeof(trace_buf))), req->wLength);
+        return true;
+    }
+#if defined(ISR_STATS)
+    static isr_stats_hist_t hist;
+    if(rcpt == (USB_REQ_DIR_IN | USB_REQ_RCPT_DEVICE)
+            && req->bRequest == ISR_STATS_VENDOR_REQ_READ
+            && req->wValue < ISR_STATS_NUM) {
+        // send a copy, the ISRs keep updating the histogram
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            hist = isr_stats[req->wValue];
+        }
+        atmega_xu4_ep0_send(&hist, sizeof(hist), req->wLength);
+        return true;
+    }
+    if(rcpt == (USB_REQ_DIR_OUT | USB_REQ_RCPT_DEVICE)
+            && req->bRequest == ISR_STATS_VENDOR_REQ_CLEAR) {
+        isr_stats_clear();
+        atmega_xu4_ep0_status();
+        return true;
+    }
+#endif
+    return false;
+}
+
 void handle_setup(usb_ep_ctx_t *ctx) {
     union {
         usb_req_hdr_t hdr;
@@ -317,204 +1737,287 @@ void handle_setup(usb_ep_ctx_t *ctx) {
         usb_req_val_t val;
         usb_req_get_desc_t get_desc;
     } *req;
-    if(is_flush_locked(0)) {
+    // sent from after the request returns
+    static uint8_t status[2];
+    const uint8_t *desc;
+    usb_req_handler *handler;
+    // only act once per SETUP; a new SETUP aborts any transfer in progress
+    if(!(ctx->flags & EP_SETUP)) {
+        return;
+    }
+    ctx->flags &= ~EP_SETUP;
+    req = (void *)ep0_queue.buf;
+    trace(TRACE_USB_SETUP, req->hdr.bRequest);
+    if((req->hdr.bmRequestType & USB_REQ_TYPE_MASK) != USB_REQ_TYPE_STANDARD) {
+        handler = find_req_handler(&req->std);
+        if(!handler || !handler(&req->std)) {
+            trace(TRACE_USB_BAD_REQ, req->hdr.bRequest);
+            trace(TRACE_USB_BAD_REQ_TYPE, req->hdr.bmRequestType);
+            ep0_stall();
+        }
         return;
     }
-    req = ep0_buf;
-    // XXX: reset queue write ptr so we overwrite data w/o calling pop
-    QUEUE_RESET(&ep0_queue);
-    int addr = 0;
     switch(req->hdr.bRequest) {
         case USB_REQ_GET_DESCRIPTOR:
+            trace(TRACE_USB_GET_DESC, req->get_desc.type);
             switch(req->get_desc.type) {
                 case USB_DESC_DEVICE:
-                    uart_puts("device\r\n", 8);
-                    for(size_t i = 0; i < sizeof(usb_device_desc_t); i++) {
-                        queue_push(&ep0_queue, ((uint_least8_t *)&self_device_desc)[i]);
-                    }
-                    set_flush_lock(0);
-                    // enable IN interrupts after SETUP
+                    atmega_xu4_ep0_send_P(usb_device_desc,
+                            USB_DEVICE_DESC_SIZE, req->std.wLength);
                 break;
 
                 case USB_DESC_CONFIGURATION:
-                    uart_puts("config\r\n", 8);
-                    if(req->std.wLength == sizeof(usb_config_desc_t)) {
-                        // send just the config desc first
-                        for(size_t i = 0; i < sizeof(usb_config_desc_t); i++) {
-                            queue_push(&ep0_queue, ((uint_least8_t *)&self_config_desc)[i]);
-                        }
-                        set_flush_lock(0);
+                    // the host usually asks for the config desc alone first,
+                    // then for the entire configuration
+                    atmega_xu4_ep0_send_P(usb_config_desc,
+                            USB_CONFIG_DESC_SIZE, req->std.wLength);
+                break;
+
+                case USB_DESC_STRING:
+                    // only one language is supported, the language ID in
+                    // wIndex is not checked
+                    if(req->get_desc.index < USB_NUM_STRING_DESCS) {
+                        desc = pgm_read_ptr(&usb_string_descs[req->get_desc.index]);
+                        atmega_xu4_ep0_send_P(desc, pgm_read_byte(desc),
+                                req->std.wLength);
                     }
                     else {
-                        // then send entire configuration (repeating the config desc)
-                        for(size_t i = 0; i < sizeof(acm_config_desc_t); i++) {
-                            queue_push(&ep0_queue, ((uint_least8_t *)&self_config_desc)[i]);
-                        }
-                        set_flush_lock(0);
+                        ep0_stall();
                     }
                 break;
 
-#if 0
-                case USB_DESC_STRING:
-                // TODO on hold until utf16-le encoding is ready
-                    /*
-                     *write_usb_ep(0, (char*)str_desc_tab[req->get_desc.index], str_desc_tab[req->get_desc.index]->bLength);
-                     *UEINTX = ~_BV(TXINI);
-                     */
-                break;
-#endif
                 default:
-                    uart_puts("unsupported desc\n", 16);
+                    trace(TRACE_USB_BAD_DESC, req->get_desc.type);
+                    ep0_stall();
                 break;
             }
         break; // END DESC REQUESTS
 
         case USB_REQ_SET_ADDRESS:
-            uart_puts("addr\n", 5);
-            // TODO async this, make it wait on a flag.
-            UEINTX = ~_BV(TXINI);
-            // wait for IN packet before setting address
-            addr = req->std.wValue;
-            while(!(UEINTX & _BV(TXINI)));
-            UDADDR = addr | _BV(ADDEN);
+            trace(TRACE_USB_SET_ADDRESS, req->std.wValue);
+            // the address only applies after the status stage, which is
+            // still sent from address 0: store it now, enable it when the
+            // status packet is done. TRM 22.9
+            UDADDR = req->std.wValue & 0x7F;
+            ep0_address_pending = true;
+            atmega_xu4_ep0_status();
         break;
 
         case USB_REQ_SET_CONFIGURATION:
             // TODO handle actual configuration, this just ACKs the req.
-            uart_puts("set conf\r\n", 10);
-            UEINTX = ~_BV(TXINI);
-            configure_acm_bulk();
+            trace(TRACE_USB_SET_CONFIG, req->std.wValue);
+            // allocate first so the request can be refused if DPRAM is short
+            if(configure_endpoints()) {
+                atmega_xu4_ep0_status();
+            }
+            else {
+                ep0_stall();
+            }
         break;
 
         case USB_REQ_GET_STATUS:
-            // TODO endpoint vs. interface status
-            // TODO actual rm-wake and self-power status
-            // this indicates no rm-wake and bus-powered.
-            uart_puts("status\r\n", 8);
-            queue_push(&ep0_queue, 0);
-            queue_push(&ep0_queue, 0);
-            set_flush_lock(0);
+            // TODO endpoint halt status
+            trace(TRACE_USB_GET_STATUS,
+                    req->hdr.bmRequestType & USB_REQ_RCPT_MASK);
+            status[0] = 0;
+            status[1] = 0;
+            if((req->hdr.bmRequestType & USB_REQ_RCPT_MASK)
+                    == USB_REQ_RCPT_DEVICE) {
+                // USB 2.0 figure 9-4
+                status[0] = ((USB_CONFIG_ATTRIBUTES
+                            & USB_CONFIG_ATTRS_SELF_POWERED) ? 1 : 0)
+                    | (usb_remote_wakeup ? 2 : 0);
+            }
+            atmega_xu4_ep0_send(status, sizeof(status), req->std.wLength);
+        break;
+
+        case USB_REQ_SET_FEATURE:
+        case USB_REQ_CLEAR_FEATURE:
+            // only remote wakeup, and only if the configuration has it
+            if((req->hdr.bmRequestType & USB_REQ_RCPT_MASK)
+                    == USB_REQ_RCPT_DEVICE
+                    && req->std.wValue == USB_FEATURE_DEVICE_REMOTE_WAKEUP
+                    && (USB_CONFIG_ATTRIBUTES
+                        & USB_CONFIG_ATTRS_REMOTE_WAKEUP)) {
+                usb_remote_wakeup = req->hdr.bRequest == USB_REQ_SET_FEATURE;
+                atmega_xu4_ep0_status();
+            }
+            else {
+                trace(TRACE_USB_BAD_REQ, req->hdr.bRequest);
+                ep0_stall();
+            }
         break;
 
         default:
-            uart_puts("unsupported req\r\n", 17);
-            uart_puts(&ep0_buf, 64);
+            trace(TRACE_USB_BAD_REQ, req->hdr.bRequest);
+            trace(TRACE_USB_BAD_REQ_TYPE, req->hdr.bmRequestType);
+            ep0_stall();
             break;
     }
 }
 
 // USB general interrupt
 ISR(USB_GEN_vect) {
+    ISR_STATS_ENTER();
     if(UDINT & _BV(EORSTI)) {
         // usb reset
         UDINT &= ~_BV(EORSTI);
-        /*uart_puts("reset\n", 6);*/
+        trace(TRACE_USB_RESET, 0);
 
         // enable only ep 0
         UENUM = 0;
         UECONX |= (1 << EPEN);
         UECFG0X = 0; // control type, direction is OUT (rx from our perspective)
-        UECFG1X = _BV(EPSIZE0) | _BV(EPSIZE1) | _BV(ALLOC); // 64 byte buffer
-        UEIENX |= _BV(RXSTPE) | _BV(RXOUTI); // enable useful interrupts only
+        UECFG1X = (ATMEGA_XU4_EPSIZE(ATMEGA_XU4_EP0_SIZE) << EPSIZE0) | _BV(ALLOC);
+        UEIENX |= _BV(RXSTPE) | _BV(RXOUTE); // enable useful interrupts only
+        ep0_stage = EP0_IDLE;
+        ep0_address_pending = false;
+        usb_remote_wakeup = false;
+        // the banks are gone, and the next configuration sets its own holds
+        in_held = 0;
+        memset(in_hold_frames, 0, sizeof(in_hold_frames));
         if(!(UESTA0X & _BV(CFGOK))) {
-            /*uart_puts("failed\n", 7);*/
-            return;
+            trace(TRACE_USB_RESET_FAILED, 0);
+            goto done;
         }
         UERST = 0;
     }
     if(USBINT & _BV(VBUSTI)) {
         USBINT &= ~_BV(VBUSTI);
-        /*UDIEN |= _BV(WAKEUPE) | _BV(SUSPE);*/
         UDCON &= ~_BV(DETACH);
-        /*uart_puts("vbus\n", 5);*/
+        trace(TRACE_USB_VBUS, USBSTA & _BV(VBUS));
+    }
+    if((UDINT & _BV(SOFI)) && (UDIEN & _BV(SOFE))) {
+        UDINT &= ~_BV(SOFI);
+        in_hold_sof();
     }
-    if(UDINT & _BV(WAKEUPI)) {
+    // SUSPI and WAKEUPI each stay enabled only while they can end the
+    // current state, their flags are also set meanwhile
+    if((UDINT & _BV(WAKEUPI)) && (UDIEN & _BV(WAKEUPE))) {
+        // bus activity: a resume or a reset from the host. It woke the CPU
+        // from power-down, the clock has to run before the flags can be
+        // cleared, TRM 22.18.
+        clock_resume();
+        UDINT &= ~(_BV(WAKEUPI) | _BV(SUSPI));
+        UDIEN = (UDIEN & ~_BV(WAKEUPE)) | _BV(SUSPE);
+        usb_suspended = false;
+        trace(TRACE_USB_WAKEUP, 0);
+    }
+    if((UDINT & _BV(SUSPI)) && (UDIEN & _BV(SUSPE))) {
+        // 3ms of idle bus. SUSPI stays set while suspended, remote wakeup
+        // needs it. WAKEUPI may be left over from before, and can only be
+        // cleared while the clock runs.
+        UDIEN &= ~_BV(SUSPE);
         UDINT &= ~_BV(WAKEUPI);
-        USBCON &= ~_BV(FRZCLK);
-        /*uart_puts("wake\n", 5);*/
+        UDIEN |= _BV(WAKEUPE);
+        USBCON |= _BV(FRZCLK);
+        PLLCSR &= ~_BV(PLLE);
+        usb_suspended = true;
+        trace(TRACE_USB_SUSPEND, 0);
+        if(suspend_hook) {
+            suspend_hook();
+        }
     }
-    if(UDINT & _BV(SUSPI)) {
-        UDINT &= ~_BV(SUSPI);
-        USBCON &= ~_BV(FRZCLK);
-        /*uart_puts("susp\n", 5);*/
+done:
+    ISR_STATS_EXIT(ISR_STATS_USB_GEN);
+}
+
+/**
+ * Endpoint 0 events: the control transfer state machine.
+ */
+static void service_ep0(uint8_t events) {
+    if(events & _BV(RXSTPI)) {
+        // setup transfer sends host->dev data, but RXOUTI is not triggered.
+        // endpoint will contain the request descriptor
+        // a SETUP aborts the transfer in progress
+        UEIENX &= ~_BV(TXINE);
+        ep0_stage = EP0_IDLE;
+        handle_control(0);
+        return;
+    }
+    if(events & _BV(RXOUTI)) {
+        // OUT data or status stage
+        trace(TRACE_USB_EP0_OUT, ep0_stage);
+        ep0_rxouti();
+    }
+    if(events & _BV(TXINI)) {
+        // IN data or status stage
+        trace(TRACE_USB_EP0_IN, ep0_stage);
+        ep0_txini();
     }
 }
 
-// USB communication / USB endpoint interrupt
-ISR(USB_COM_vect) {
-    uint8_t eps_to_service = UEINT;
+/**
+ * Events of any other endpoint: data moves between the banks and either the
+ * submitted transfers or the software queue of the installed handler.
+ */
+static void service_ep(uint8_t epnum, uint8_t events) {
+    bool xfer = usb_ep_handlers[epnum]->flags & EP_XFER;
+    // a handler without a queue has nowhere to move data: silence the event
+    // instead, UENUM is still selected
+    bool queue = usb_ep_handlers[epnum]->data != NULL;
 
-    UEINT &= ~eps_to_service;
-    if(eps_to_service & 1) {
-        UENUM = 0;
-        uint8_t events = UEINTX;
-#if 0
-        // TODO this exits if r/w is not allowed on non-control endpoints...
-        // but that flag is based on the current bank (I think).
-        // might be best not to early-exit until all banks have been checked.
-        //   not control ep           r/w allowed
-        if(!is_control_ep && !(UEINTX & _BV(RWAL))) {
-            return;
+    if(events & _BV(RXSTPI)) {
+        handle_control(epnum);
+    }
+    if(events & _BV(RXOUTI)) {
+        // OUT transfer, a bank is full: drain as many as fit
+        if(xfer) {
+            xfer_out(epnum);
         }
-#endif
-        if(events & _BV(RXSTPI)) {
-            // setup transfer sends host->dev data, but RXOUTI is not triggered.
-            // endpoint will contain the request descriptor
-            uart_puts("SETUP0\r\n", 8);
-            handle_control(0);
-        }
-        else if(events & _BV(TXINI)) {
-            // IN transfer
-            uart_puts("IN\r\n", 4);
-            // clear TXINI for control endpoints, else FIFOCON
-            // TODO flush also needs to repeatedly clear TXINI for non-setup
-            // transactions.
-            // may still need to statefully track setup, re:
-            //  - txini vs. fifocon clearing (or both)
-            //  - abort stage for IN packets during setup (control transfer)
-            //  - whether or not to clear FIFOCON on OUT transactions
-            //      - CONTROL endpoints are not allowed to use FIFOCON/RWAL or
-            //        double-buffering, for some reason.
-            flush_queue(0);
-        }
-        if(events & _BV(RXOUTI)) {
-            // OUT transfer
-            uart_puts("OUT\r\n", 5);
-            fill_queue(0);
-        }
-        usb_ep_handlers[0]->callback(usb_ep_handlers[0]);
-        /*UEINTX &= ~events;*/
-    }
-    if(eps_to_service & (1 << 1)) {
-        UENUM = 0;
-        uint8_t events = UEINTX;
-        if(events & _BV(RXSTPI)) {
-            // setup transfer sends host->dev data, but RXOUTI is not triggered.
-            // endpoint will contain the request descriptor
-            uart_puts("SETUP1\r\n", 8);
-            handle_control(1);
+        else if(queue) {
+            fill_queue(epnum);
+        }
+        else {
+            UEIENX &= ~_BV(RXOUTE);
         }
-        usb_ep_handlers[1]->callback(usb_ep_handlers[1]);
     }
-    if(eps_to_service & (1 << 2)) {
-        UENUM = 0;
-        uint8_t events = UEINTX;
-        if(events & _BV(TXINI)) {
-            // IN transfer
-            uart_puts("IN\r\n", 4);
-            // clear TXINI for control endpoints, else FIFOCON
-            // TODO flush also needs to repeatedly clear TXINI for non-setup
-            // transactions.
-            // may still need to statefully track setup, re:
-            //  - txini vs. fifocon clearing (or both)
-            //  - abort stage for IN packets during setup (control transfer)
-            //  - whether or not to clear FIFOCON on OUT transactions
-            //      - CONTROL endpoints are not allowed to use FIFOCON/RWAL or
-            //        double-buffering, for some reason.
-            flush_queue(0);
-        }
-        usb_ep_handlers[2]->callback(usb_ep_handlers[2]);
+    if(events & _BV(TXINI)) {
+        // IN transfer, a bank is free: fill both if there is data
+        if(xfer) {
+            xfer_in(epnum);
+        }
+        else if(queue) {
+            flush_queue(epnum);
+        }
+        else {
+            UEIENX &= ~_BV(TXINE);
+        }
+    }
+}
+
+// USB communication / USB endpoint interrupt. With USB_ASM_ISR, only for
+// what the fast path in 32u4_usb_isr.S leaves to it, and only that is
+// timed by ISR_STATS.
+ISR(USB_COM_ISR) {
+    // EPINTx is set for each endpoint with an enabled interrupt flag, and is
+    // read-only: it clears once the endpoint's flags are served
+    ISR_STATS_ENTER();
+    uint8_t pending = UEINT;
+    uint8_t events;
+
+    for(uint8_t epnum = 0; pending; epnum++, pending >>= 1) {
+        if(!(pending & 1)) {
+            continue;
+        }
+        UENUM = epnum;
+        if(!usb_ep_handlers[epnum]) {
+            // nobody to serve it, silence the endpoint
+            UEIENX = 0;
+            continue;
+        }
+        // the enable bits in UEIENX sit at the positions of their flags in
+        // UEINTX: only act on enabled events
+        events = UEINTX & UEIENX;
+        if(epnum == 0) {
+            service_ep0(events);
+        }
+        else {
+            service_ep(epnum, events);
+        }
+        usb_ep_handlers[epnum]->callback(usb_ep_handlers[epnum]);
     }
+    ISR_STATS_EXIT(ISR_STATS_USB_COM);
 }
 
 static inline void set_flush_lock(int epnum) {
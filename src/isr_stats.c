@@ -0,0 +1,65 @@
+#include "isr_stats.h"
+#include "trace.h"
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+
+#include <string.h>
+
+#if defined(ISR_STATS)
+
+isr_stats_hist_t isr_stats[ISR_STATS_NUM];
+
+void isr_stats_clear(void) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        memset(isr_stats, 0, sizeof(isr_stats));
+        for(uint8_t i = 0; i < ISR_STATS_NUM; i++) {
+            isr_stats[i].min = UINT16_MAX;
+        }
+    }
+}
+
+void isr_stats_init(void) {
+    isr_stats_clear();
+    // same free-running timebase as the trace, see trace_init
+    TCCR1A = 0;
+    TCCR1B = TRACE_TIMER_CS;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        OCR1A = TCNT1 + ISR_STATS_PROBE_PERIOD;
+    }
+    TIFR1 = _BV(OCF1A);
+    TIMSK1 |= _BV(OCIE1A);
+}
+
+void isr_stats_record(isr_stats_id_t id, uint16_t ticks) {
+    isr_stats_hist_t *hist = &isr_stats[id];
+    uint8_t bin = 0;
+
+    // log2 bin: position of the highest set bit
+    for(uint16_t t = ticks; t && bin < ISR_STATS_BINS - 1; t >>= 1) {
+        bin++;
+    }
+    if(hist->bins[bin] != UINT16_MAX) {
+        hist->bins[bin]++;
+    }
+    if(hist->count != UINT16_MAX) {
+        hist->count++;
+    }
+    if(ticks < hist->min) {
+        hist->min = ticks;
+    }
+    if(ticks > hist->max) {
+        hist->max = ticks;
+    }
+}
+
+// latency probe: the compare match happened at OCR1A
+ISR(TIMER1_COMPA_vect) {
+    uint16_t match = OCR1A;
+
+    isr_stats_record(ISR_STATS_LATENCY, TCNT1 - match);
+    OCR1A = match + ISR_STATS_PROBE_PERIOD;
+}
+
+#endif
@@ -1,6 +1,6 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
-#include <util/delay.h>
+#include <avr/sleep.h>
 #include <stdint.h>
 #include "usb_base_descriptors.h"
 #include "usb_requests.h"
@@ -9,36 +9,142 @@
 #include "32u4_usb.h"
 
 #include <drivers/uart.h>
-#include "monoqueue.h"
+#include "trace.h"
+#include "isr_stats.h"
+#include "sched.h"
 
 #include <stdbool.h>
 
-char uart_bufs[2][512] = {0};
+// Timer0 tick: CTC mode, clk/64
+#define TICK_HZ 1000
+#define TICK_OCR (F_CPU / 64 / TICK_HZ - 1)
+_Static_assert(TICK_OCR <= 0xFF, "Timer0 tick out of range");
+#define HEARTBEAT_TICKS 500
 
-mqueue_t test_queue;
+static uint8_t heartbeat_work;
+// the USB bus is suspended, the LED stays off
+static volatile bool suspended;
+#if !defined(ACM_BRIDGE)
+static uint8_t trace_work;
+#endif
+
+#if USB_NUM_RAW_FUNCTIONS
+// raw bulk demo for host-side throughput tests: a source of numbered frames
+// that each fill one packet, and a sink for whatever the host sends
+static uint8_t raw_source_work;
+static uint8_t raw_sink_work;
+
+static void raw_source(void) {
+    static uint8_t frame[64 - USB_RAW_HDR_SIZE];
+
+    while(usb_raw_send(frame, sizeof(frame))) {
+        frame[0]++;
+    }
+}
+
+static void raw_sink(void) {
+    static uint8_t frame[USB_RAW_FRAME_MAX];
+    uint16_t len = sizeof(frame);
+
+    while(usb_raw_recv(frame, &len)) {
+        len = sizeof(frame);
+    }
+}
+
+static void raw_rx_hook(void) {
+    sched_post(raw_sink_work);
+}
+
+static void raw_tx_hook(void) {
+    sched_post(raw_source_work);
+}
+#endif
+
+static void heartbeat(void) {
+    if(!suspended) {
+        PINC |= (1 << 7); // writing logical 1 to PIN toggles PORT (refman. 10.2.2)
+    }
+}
+
+#if defined(ACM_BRIDGE)
+// bytes arriving on the bridged UART wake the host up
+static uint8_t wakeup_work;
+
+static void remote_wakeup(void) {
+    atmega_xu4_remote_wakeup();
+}
+
+static void uart_line_hook(void) {
+    sched_post(wakeup_work);
+}
+#endif
+
+// from the USB ISR: power down until the bus resumes. Timer0 stops too.
+static void usb_suspend(void) {
+    suspended = true;
+    PORTC &= ~(1 << 7);
+    sched_set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+#if defined(ACM_BRIDGE)
+    uart_set_line_hook(uart_line_hook);
+#endif
+}
+
+static void usb_resume(void) {
+    suspended = false;
+    sched_set_sleep_mode(SLEEP_MODE_IDLE);
+#if defined(ACM_BRIDGE)
+    uart_set_line_hook(NULL);
+#endif
+}
+
+static void tick_init(void) {
+    TCCR0A = _BV(WGM01);
+    OCR0A = TICK_OCR;
+    TIMSK0 = _BV(OCIE0A);
+    TCCR0B = _BV(CS01) | _BV(CS00);
+}
+
+ISR(TIMER0_COMPA_vect) {
+    static uint16_t ticks;
+
+    if(++ticks == HEARTBEAT_TICKS) {
+        ticks = 0;
+        sched_post(heartbeat_work);
+    }
+#if !defined(ACM_BRIDGE)
+    // ISRs only record trace events, they go out over the UART from the
+    // main loop. The bridge owns the UART, use TRACE_VENDOR_REQ_READ instead.
+    if(trace_head != trace_tail || trace_dropped) {
+        sched_post(trace_work);
+    }
+#endif
+}
 
 int main(void) {
     cli();
     DDRC |= (1 << 7);
     PORTC &= ~(1 << 7); // disable pullup
-    configure_uart(115200, uart_bufs[0], uart_bufs[1], 512, 512);
+    configure_uart(115200);
+    trace_init();
+#if defined(ISR_STATS)
+    isr_stats_init();
+#endif
+    heartbeat_work = sched_add(heartbeat, SCHED_PRIO_LOW);
+#if defined(ACM_BRIDGE)
+    wakeup_work = sched_add(remote_wakeup, SCHED_PRIO_HIGH);
+#endif
+#if !defined(ACM_BRIDGE)
+    trace_work = sched_add(trace_drain, SCHED_PRIO_LOW);
+#endif
+#if USB_NUM_RAW_FUNCTIONS
+    raw_source_work = sched_add(raw_source, SCHED_PRIO_LOW);
+    raw_sink_work = sched_add(raw_sink, SCHED_PRIO_HIGH);
+    usb_raw_set_hooks(raw_rx_hook, raw_tx_hook);
+#endif
+    tick_init();
     atmega_xu4_setup_usb();
+    atmega_xu4_set_suspend_hooks(usb_suspend, usb_resume);
     sei();
-    char c;
-    for(;;) {
-        /*uart_puts("hello world\r\n", 13);*/
-        /*mqueue_init(&test_queue, "hello world\r\n", 13);*/
-        /*while(!MQUEUE_EMPTY(&test_queue)) {*/
-            /*c = mqueue_pop(&test_queue);*/
-            /*uart_puts(&c, 1);*/
-        /*}*/
-        PINC |= (1 << 7); // writing logical 1 to PIN toggles PORT (refman. 10.2.2)
-        _delay_ms(500);
-        // don't remove these... haven't figured out where they're supposed to be yet
-        USBCON &= ~_BV(FRZCLK);
-        UDCON &= ~_BV(DETACH);
-        // heartbeat led
-
-    }
+    sched_loop();
     return 0;
 }
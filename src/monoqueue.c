@@ -1,18 +1,62 @@
 #include "monoqueue.h"
 
-#include <limits.h>
+#include <avr/pgmspace.h>
+
+#include <string.h>
+
+#define min(x, y) (((x) > (y)) ? (y):(x))
+
+/**
+ * Make the next non-empty segment the current span. The queue ends where
+ * left runs out, even within a segment.
+ */
+static void load_span(mqueue_t *self, const mqueue_seg_t *seg) {
+    while(seg && !seg->len) {
+        seg = seg->next;
+    }
+    if(!seg || !self->left) {
+        self->head = self->limit = NULL;
+        self->next = NULL;
+        self->left = 0;
+        return;
+    }
+    self->head = seg->buf;
+    self->limit = seg->buf + min(seg->len, self->left);
+    self->pgm = seg->flags & MQUEUE_SEG_PGM;
+    self->next = seg->next;
+}
 
 mqueue_t *mqueue_init(mqueue_t *self, const uint_least8_t *buf, size_t size) {
-    self->limit = buf + (size * (CHAR_BIT >> 3));
+    self->limit = buf + size;
     self->head = buf;
+    self->left = size;
+    self->next = NULL;
+    self->pgm = false;
+    return self;
+}
+
+mqueue_t *mqueue_init_P(mqueue_t *self, const uint_least8_t *buf, size_t size) {
+    mqueue_init(self, buf, size);
+    self->pgm = true;
+    return self;
+}
+
+mqueue_t *mqueue_init_chain(mqueue_t *self, const mqueue_seg_t *seg,
+        size_t max) {
+    size_t total = 0;
+
+    for(const mqueue_seg_t *s = seg; s && total < max; s = s->next) {
+        total += min(s->len, max - total);
+    }
+    self->left = total;
+    load_span(self, seg);
     return self;
 }
 
 uint_least8_t mqueue_pop(mqueue_t *self) {
-    uint_least8_t val = 0;
+    uint_least8_t val = mqueue_peek(self);
     if(!MQUEUE_EMPTY(self)) {
-        val = *self->head;
-        self->head++;
+        mqueue_consume(self, 1);
     }
     return val;
 }
@@ -20,7 +64,54 @@ uint_least8_t mqueue_pop(mqueue_t *self) {
 uint_least8_t mqueue_peek(mqueue_t *self) {
     uint_least8_t val = 0;
     if(!MQUEUE_EMPTY(self)) {
-        val = *self->head;
+        val = self->pgm ? pgm_read_byte(self->head) : *self->head;
     }
     return val;
 }
+
+const uint_least8_t *mqueue_peek_span(mqueue_t *self, size_t *n, bool *pgm) {
+    *n = self->limit - self->head;
+    if(pgm) {
+        *pgm = self->pgm;
+    }
+    return MQUEUE_EMPTY(self) ? NULL : self->head;
+}
+
+void mqueue_consume(mqueue_t *self, size_t n) {
+    self->head += n;
+    self->left -= n;
+    if(self->head == self->limit) {
+        load_span(self, self->next);
+    }
+}
+
+const uint_least8_t *mqueue_take(mqueue_t *self, size_t *n) {
+    const uint_least8_t *span = self->head;
+    if(*n > (size_t)(self->limit - self->head)) {
+        *n = self->limit - self->head;
+    }
+    if(*n) {
+        mqueue_consume(self, *n);
+    }
+    return span;
+}
+
+size_t mqueue_read(mqueue_t *self, void *dst, size_t n) {
+    uint8_t *to = dst;
+    const uint_least8_t *span;
+    size_t done = 0, len;
+    bool pgm;
+
+    while(done < n && (span = mqueue_peek_span(self, &len, &pgm))) {
+        len = min(len, n - done);
+        if(pgm) {
+            memcpy_P(to + done, span, len);
+        }
+        else {
+            memcpy(to + done, span, len);
+        }
+        mqueue_consume(self, len);
+        done += len;
+    }
+    return done;
+}
@@ -0,0 +1,106 @@
+#include "sched.h"
+#include "ring.h"
+
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <util/atomic.h>
+
+RING_DEFINE(sched_ring, SCHED_MAX_WORK)
+
+typedef struct {
+    sched_fn *fn;
+    uint8_t prio;
+    // in a ring: posting again is a no-op until it starts running
+    volatile bool queued;
+} sched_work_t;
+
+static sched_work_t works[SCHED_MAX_WORK];
+static uint8_t num_works;
+// IDs of queued work, by priority. Producers are serialized by
+// sched_post, the main loop is the only consumer.
+static sched_ring_t queues[SCHED_NUM_PRIOS];
+// SMCR is only written with interrupts off, ISRs change this instead
+static volatile uint8_t sleep_mode = SLEEP_MODE_IDLE;
+
+uint8_t sched_add(sched_fn *fn, sched_prio_t prio) {
+    if(num_works == SCHED_MAX_WORK || prio >= SCHED_NUM_PRIOS) {
+        return SCHED_NONE;
+    }
+    works[num_works].fn = fn;
+    works[num_works].prio = prio;
+    works[num_works].queued = false;
+    return num_works++;
+}
+
+void sched_post(uint8_t id) {
+    sched_work_t *w = &works[id];
+
+    // ISRs do not nest, but the main loop posts too
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if(!w->queued) {
+            w->queued = true;
+            // cannot fail, each ring has room for every item
+            sched_ring_push(&queues[w->prio], id);
+        }
+    }
+}
+
+/**
+ * Take the next queued item, highest priority first.
+ * @return SCHED_NONE if nothing is queued
+ */
+static uint8_t sched_next(void) {
+    uint8_t id;
+
+    for(uint8_t p = 0; p < SCHED_NUM_PRIOS; p++) {
+        if(sched_ring_pop(&queues[p], &id)) {
+            return id;
+        }
+    }
+    return SCHED_NONE;
+}
+
+static bool sched_pending(void) {
+    for(uint8_t p = 0; p < SCHED_NUM_PRIOS; p++) {
+        if(sched_ring_count(&queues[p])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool sched_run(void) {
+    bool ran = false;
+    uint8_t id;
+
+    while((id = sched_next()) != SCHED_NONE) {
+        // cleared first: a post while it runs queues it again
+        works[id].queued = false;
+        works[id].fn();
+        ran = true;
+    }
+    return ran;
+}
+
+void sched_set_sleep_mode(uint8_t mode) {
+    sleep_mode = mode;
+}
+
+void sched_loop(void) {
+    for(;;) {
+        sched_run();
+        // an interrupt between the check and sleep_cpu would post work and
+        // then leave the CPU asleep. sei takes effect after the following
+        // instruction, so no interrupt can come in between.
+        cli();
+        if(!sched_pending()) {
+            set_sleep_mode(sleep_mode);
+            sleep_enable();
+            sei();
+            sleep_cpu();
+            cli();
+            sleep_disable();
+        }
+        sei();
+    }
+}
@@ -0,0 +1,101 @@
+#include "trace.h"
+
+#include <drivers/uart.h>
+
+#include <avr/io.h>
+#include <util/atomic.h>
+
+#include <stdbool.h>
+#include <string.h>
+
+trace_rec_t trace_ring[TRACE_LEN];
+volatile uint8_t trace_head, trace_tail;
+volatile uint8_t trace_dropped;
+
+void trace_init(void) {
+    // normal mode, no compare outputs: TCNT1 counts up and wraps
+    TCCR1A = 0;
+    TCCR1B = TRACE_TIMER_CS;
+    trace_head = 0;
+    trace_tail = 0;
+    trace_dropped = 0;
+}
+
+/**
+ * Take the lost-record count, if any, as a TRACE_DROPPED record.
+ */
+static bool take_dropped(trace_rec_t *rec) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        rec->arg = trace_dropped;
+        trace_dropped = 0;
+        rec->stamp = TCNT1;
+    }
+    rec->id = TRACE_DROPPED;
+    return rec->arg != 0;
+}
+
+size_t trace_read(void *buf, size_t len) {
+    trace_rec_t *out = buf;
+    size_t n = 0;
+
+    if(len < sizeof(trace_rec_t)) {
+        return 0;
+    }
+    if(take_dropped(out)) {
+        n++;
+    }
+    // trace_drain reads the ring too: copy out and move tail in one go, so
+    // neither reader sees a record the other has taken. Called from the USB
+    // ISR, this costs no more than saving SREG.
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        uint8_t tail = trace_tail;
+        while((n + 1) * sizeof(trace_rec_t) <= len && tail != trace_head) {
+            out[n++] = trace_ring[tail & (TRACE_LEN - 1)];
+            tail++;
+        }
+        trace_tail = tail;
+    }
+    return n * sizeof(trace_rec_t);
+}
+
+/**
+ * Take the oldest record, if any. trace_read may run in between from the USB
+ * ISR, so tail is read, the record copied and tail advanced atomically.
+ */
+static bool take_record(trace_rec_t *rec) {
+    bool taken = false;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        uint8_t tail = trace_tail;
+        if(tail != trace_head) {
+            *rec = trace_ring[tail & (TRACE_LEN - 1)];
+            trace_tail = tail + 1;
+            taken = true;
+        }
+    }
+    return taken;
+}
+
+/**
+ * Queue one framed record on the UART.
+ */
+static void send_record(const trace_rec_t *rec) {
+    char frame[2 + sizeof(trace_rec_t)] = {TRACE_SYNC0, TRACE_SYNC1};
+
+    memcpy(&frame[2], rec, sizeof(trace_rec_t));
+    uart_puts_noblock(frame, sizeof(frame));
+}
+
+void trace_drain(void) {
+    const int frame = 2 + sizeof(trace_rec_t);
+    trace_rec_t rec;
+
+    // frames are only queued whole, so the decoder never has to resync on
+    // a frame cut short by a full UART queue
+    if(uart_tx_room() >= frame && take_dropped(&rec)) {
+        send_record(&rec);
+    }
+    while(uart_tx_room() >= frame && take_record(&rec)) {
+        send_record(&rec);
+    }
+}
@@ -1,104 +1,346 @@
 #include <drivers/uart.h>
-#include <queue/queue.h>
+#include <drivers/uart_isr.h>
+#include "isr_stats.h"
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
 #include <util/atomic.h>
 
+#include <stddef.h>
+
 /**
  * Convenience macro to enable transmission - enables interrupt on UDRE0 = 1
  */
 #define uart_en_tx() (UCSR1B |= (1 << UDRIE1))
 
+#define min(x, y) (((x) > (y)) ? (y):(x))
+
+
+RING_DEFINE(uart_rx_ring, UART_RX_LEN)
+RING_DEFINE(uart_tx_ring, UART_TX_LEN)
+
+// the RX ISR produces into uart_rx and the main loop consumes, the other way
+// around for uart_tx. Not static: uart_isr.S works on them too.
+uart_rx_ring_t uart_rx = RING_INIT(UART_RX_LEN);
+uart_tx_ring_t uart_tx = RING_INIT(UART_TX_LEN);
+
+_Static_assert(offsetof(uart_rx_ring_t, head) == UART_RING_HEAD
+        && offsetof(uart_rx_ring_t, tail) == UART_RING_TAIL
+        && offsetof(uart_rx_ring_t, buf) == UART_RING_BUF,
+    "uart_isr.h does not match the ring header"
+);
+
+#if defined(UART_ASM_ISR)
+// uart_isr.S has the vectors and jumps to these when its fast path does not
+// apply
+#define UART_RX_ISR UART_RX_SLOW_VECT
+#define UART_UDRE_ISR UART_UDRE_SLOW_VECT
+#else
+#define UART_RX_ISR USART1_RX_vect
+#define UART_UDRE_ISR USART1_UDRE_vect
+#endif
 
-static queue_t uart_rx, uart_tx;
+static void (*rx_hook)(void);
+static void (*tx_hook)(void);
+static void (*err_hook)(uint8_t errors);
+static void (*line_hook)(void);
+// a break is being sent, transmission waits until it ends
+static volatile bool tx_break;
+
+// chain sent in place, ahead of the transmit ring, see uart_send_chain.
+// Its current span is read a byte per interrupt.
+static mqueue_t *volatile tx_chain;
+static void (*tx_chain_done)(void);
+static const uint_least8_t *tx_span;
+static size_t tx_span_len, tx_span_pos;
+static bool tx_span_pgm;
+
+/**
+ * Keep the UDRE fast path out of the way of a break or a chain. Called with
+ * interrupts off.
+ */
+static inline void tx_slow_update(void) {
+    if(tx_break || tx_chain) {
+        UART_FLAGS |= _BV(UART_TX_SLOW);
+    }
+    else {
+        UART_FLAGS &= ~_BV(UART_TX_SLOW);
+    }
+}
 
-void configure_uart(
-        unsigned long baud,
-        char *rxb, char *txb,
-        int rx_sz, int tx_sz
-) {
+void configure_uart(unsigned long baud) {
     cli();
     // configure fifos
-    queue_init(&uart_rx, rxb, rx_sz);
-    queue_init(&uart_tx, txb, tx_sz);
+    uart_rx_ring_reset(&uart_rx);
+    uart_tx_ring_reset(&uart_tx);
+    rx_hook = NULL;
+    tx_hook = NULL;
+    err_hook = NULL;
+    tx_break = false;
+    tx_chain = NULL;
+    UART_FLAGS &= ~(_BV(UART_RX_WAKE) | _BV(UART_TX_SLOW));
+    UART_TX_WAKE_AT = 0;
 
-    // UART, no parity, 1 stop bit, 8 bit char, + polarity
-    UCSR1C &= ~(1 << UMSEL11);
-    UCSR1C &= ~(1 << UMSEL10); 
     // RXi enable, TX ready i enable, RX enable, TX enable
     //(1 << UDRIE0) | 
     UCSR1B = (1 << RXCIE1) | (1 << RXEN1) | (1 << TXEN1);
     // U2X0 = 1 (double data rate)
     UCSR1A |= (1 << U2X1);
-    // eqn on page 146 of atmega328p manual
-    int ubrr = F_CPU/((((UCSR1A & (1 << U2X1)) ? 8UL:16UL)*baud))-1UL;
-    // from nongnu avr-gcc faq...
-    /*
-     *int ubrr = ((F_CPU + baud * 8L)/(baud * 16L) - 1);
-     */
+    uart_set_line(baud, 8, UART_PARITY_NONE, 1);
+    sei();
+}
+
+bool uart_set_line(unsigned long baud, uint8_t data_bits,
+        uart_parity_t parity, uint8_t stop_bits) {
+    unsigned long ubrr, actual;
+    // asynchronous mode, UMSEL = 0. UPM is 0b10 for even, 0b11 for odd
+    static const uint8_t upm[] = {
+        [UART_PARITY_NONE] = 0,
+        [UART_PARITY_ODD] = (1 << UPM11) | (1 << UPM10),
+        [UART_PARITY_EVEN] = (1 << UPM11),
+    };
+
+    if(!baud || data_bits < 5 || data_bits > 8 || parity > UART_PARITY_EVEN
+            || stop_bits < 1 || stop_bits > 2) {
+        return false;
+    }
+    // U2X is always set: baud = F_CPU / (8 * (UBRR + 1)), TRM 18.3.1.
+    // Rounded to the nearest divisor, 1Mbaud is exact at 16MHz.
+    ubrr = (F_CPU / 8 + baud / 2) / baud;
+    if(ubrr < 1 || ubrr > 4096) {
+        return false;
+    }
+    actual = F_CPU / 8 / ubrr;
+    // the usual 115200 at 16MHz is 2.1% off
+    if((actual > baud ? actual - baud : baud - actual) > baud / 100 * 3) {
+        return false;
+    }
+    ubrr--;
     UBRR1H = (ubrr >> 8);
     UBRR1L = (ubrr & 0xff);
-    sei();
+    // UCSZ12 stays clear, no 9 bit frames
+    UCSR1C = upm[parity] | ((stop_bits - 1) << USBS1)
+        | ((data_bits - 5) << UCSZ10);
+    return true;
 }
 
 void uart_puts(char *data, int len) {
     int i = 0;
     while(i < len) {
-        i += uart_puts_noblock(data + i, len);
+        i += uart_puts_noblock(data + i, len - i);
     }
 }
 
 int uart_puts_noblock(char *data, int len) {
-    int i = 0;
-    while(i < len) {
-        queue_push(&uart_tx, data[i]);
-        if(!uart_tx.op_ok) {
-            break;
-        }
-        i++;
+    int i = uart_tx_ring_write(&uart_tx, data, min(len, UART_TX_LEN));
+    if(i) {
+        uart_en_tx();
     }
-    uart_tx.op_ok = true;
-    uart_en_tx();
     return i;
 }
 
+int uart_tx_room(void) {
+    return uart_tx_ring_space(&uart_tx);
+}
+
 int uart_gets(char *buf, int len) {
-    int i = 0;
-    if(len == 0 || !uart_rx.op_ok) {
-        goto done;
+    return uart_rx_ring_read(&uart_rx, buf, min(len, UART_RX_LEN));
+}
+
+byte_ring_t *uart_rx_ring(void) {
+    return uart_rx_ring_any(&uart_rx);
+}
+
+byte_ring_t *uart_tx_ring(void) {
+    return uart_tx_ring_any(&uart_tx);
+}
+
+void uart_tx_kick(void) {
+    uart_en_tx();
+}
+
+void uart_set_break(bool on) {
+    if(on) {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            tx_break = true;
+            tx_slow_update();
+        }
+        // TXD1 is PD3: hold it low once the transmitter lets go of it, which
+        // is after the byte being shifted out
+        PORTD &= ~_BV(PD3);
+        DDRD |= _BV(PD3);
+        UCSR1B &= ~(_BV(TXEN1) | _BV(UDRIE1));
     }
-    while(i < len && uart_rx.size > 0) {
-        char c = queue_pop(&uart_rx);
-        buf[i] = c;
-        i++;
+    else {
+        UCSR1B |= _BV(TXEN1);
+        DDRD &= ~_BV(PD3);
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            tx_break = false;
+            tx_slow_update();
+        }
+        uart_en_tx();
+    }
+}
+
+void uart_set_hooks(void (*rx)(void), void (*tx)(void)) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        rx_hook = rx;
+        tx_hook = tx;
+    }
+}
+
+void uart_rx_wake(void) {
+    // a single sbi, which an ISR cannot come in the middle of
+    UART_FLAGS |= _BV(UART_RX_WAKE);
+}
+
+void uart_tx_wake(uint8_t level) {
+    UART_TX_WAKE_AT = level + 1;
+}
+
+bool uart_send_chain(mqueue_t *q, void (*done)(void)) {
+    bool ok = false;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if(!tx_chain && !uart_tx_ring_count(&uart_tx) && !MQUEUE_EMPTY(q)) {
+            tx_span = mqueue_peek_span(q, &tx_span_len, &tx_span_pgm);
+            tx_span_pos = 0;
+            tx_chain_done = done;
+            tx_chain = q;
+            tx_slow_update();
+            ok = true;
+        }
+    }
+    if(ok) {
+        uart_en_tx();
+    }
+    return ok;
+}
+
+/**
+ * Send the next byte of tx_chain, moving to the next span or ending the
+ * chain as needed.
+ */
+static inline void send_chain_byte(void) {
+    void (*done)(void);
+
+    UDR1 = tx_span_pgm ? pgm_read_byte(&tx_span[tx_span_pos])
+        : tx_span[tx_span_pos];
+    if(++tx_span_pos < tx_span_len) {
+        return;
+    }
+    mqueue_consume(tx_chain, tx_span_len);
+    tx_span_pos = 0;
+    tx_span = mqueue_peek_span(tx_chain, &tx_span_len, &tx_span_pgm);
+    if(!tx_span) {
+        done = tx_chain_done;
+        tx_chain = NULL;
+        tx_slow_update();
+        if(done) {
+            done();
+        }
+    }
+}
+
+void uart_set_error_hook(void (*err)(uint8_t errors)) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        err_hook = err;
+    }
+}
+
+void uart_set_line_hook(void (*hook)(void)) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        line_hook = hook;
+        if(hook) {
+            // low level: edges need the I/O clock to be seen
+            EICRA &= ~(_BV(ISC21) | _BV(ISC20));
+            EIMSK |= _BV(INT2);
+        }
+        else {
+            EIMSK &= ~_BV(INT2);
+        }
     }
-done:
-    return i;
 }
 
 /******************************************************************************/
 
 /**
- * Receive byte interrupt
+ * RXD1 went low with the line hook armed. A level interrupt fires for as
+ * long as the line stays low, so it disarms itself first.
+ */
+ISR(INT2_vect) {
+    void (*hook)(void) = line_hook;
+
+    EIMSK &= ~_BV(INT2);
+    line_hook = NULL;
+    if(hook) {
+        hook();
+    }
+}
+
+/**
+ * Receive byte interrupt. With UART_ASM_ISR, only for what the fast path in
+ * uart_isr.S leaves to it, and only that is timed by ISR_STATS.
  */
 
-ISR(USART1_RX_vect) {
-    // TODO this may not actually read UDR1, try using a temporary variable.
-    queue_push(&uart_rx, UDR1);
+ISR(UART_RX_ISR) {
+    ISR_STATS_ENTER();
+    // the error flags belong to the byte in UDR1, read them first
+    uint8_t status = UCSR1A;
+    uint8_t c = UDR1;
+    uint8_t errors = 0;
+
+    if(status & (_BV(FE1) | _BV(DOR1) | _BV(UPE1))) {
+        errors = ((status & _BV(FE1)) ? UART_ERR_FRAMING : 0)
+            | ((status & _BV(UPE1)) ? UART_ERR_PARITY : 0)
+            | ((status & _BV(DOR1)) ? UART_ERR_OVERRUN : 0);
+        // a break reads as a zero byte with a framing error, and is
+        // neither data nor a framing error
+        if((status & _BV(FE1)) && !c) {
+            errors = (errors & ~UART_ERR_FRAMING) | UART_ERR_BREAK;
+        }
+    }
+    // dropped if the consumer has fallen behind
+    if(!(errors & UART_ERR_BREAK) && !uart_rx_ring_push(&uart_rx, c)) {
+        errors |= UART_ERR_OVERRUN;
+    }
+    if(errors && err_hook) {
+        err_hook(errors);
+    }
+    if(UART_FLAGS & _BV(UART_RX_WAKE)) {
+        UART_FLAGS &= ~_BV(UART_RX_WAKE);
+        if(rx_hook) {
+            rx_hook();
+        }
+    }
+    ISR_STATS_EXIT(ISR_STATS_USART1_RX);
 }
 
 
 /*
- * ready-to-send byte interrupt
+ * ready-to-send byte interrupt, see UART_RX_ISR for UART_ASM_ISR
  */
-ISR(USART1_UDRE_vect) {
-    char c = queue_pop(&uart_tx);
-    if(!uart_tx.op_ok) {
+ISR(UART_UDRE_ISR) {
+    ISR_STATS_ENTER();
+    uint8_t c;
+    if(tx_break) {
+        UCSR1B &= ~(1 << UDRIE1); // disable txi
+    }
+    else if(tx_chain) {
+        send_chain_byte();
+    }
+    else if(!uart_tx_ring_pop(&uart_tx, &c)) {
         UCSR1B &= ~(1 << UDRIE1); // disable txi
-        uart_tx.op_ok = true;
     }
     else {
         UDR1 = c;
+        if(uart_tx_ring_count(&uart_tx) < UART_TX_WAKE_AT) {
+            UART_TX_WAKE_AT = 0;
+            if(tx_hook) {
+                tx_hook();
+            }
+        }
     }
+    ISR_STATS_EXIT(ISR_STATS_USART1_UDRE);
 }
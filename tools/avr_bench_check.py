@@ -0,0 +1,88 @@
+"""
+Cycle count regression check.  Runs simavr/avr_bench on a firmware image and
+compares its metrics, "<name> <value>" lines, with a stored baseline in the
+same format.  Every metric is a cost: the check fails when one is larger than
+its baseline by more than the tolerance.  Smaller values pass, and are
+reported so the baseline can be tightened with --update-baseline.
+
+A missing baseline file fails the check, so the gate cannot quietly stop
+running: store one with --update-baseline.
+
+usage: avr_bench_check.py [--tolerance 2] [--update-baseline] <baseline>
+                          <avr_bench>
+                          [avr_bench arguments] <main.elf>
+"""
+
+
+import argparse
+import subprocess
+import sys
+
+
+def parse_metrics(text):
+    metrics = {}
+    for line in text.splitlines():
+        line = line.split('#', 1)[0].strip()
+        if not line:
+            continue
+        name, value = line.split()
+        metrics[name] = float(value)
+    return metrics
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n\n')[0])
+    parser.add_argument('--tolerance', type=float, default=2.0,
+                        help='allowed growth, in percent')
+    parser.add_argument('--update-baseline', action='store_true',
+                        help='store the measured metrics as the baseline')
+    parser.add_argument('baseline')
+    parser.add_argument('bench', nargs=argparse.REMAINDER,
+                        help='avr_bench and its arguments')
+    args = parser.parse_args()
+
+    out = subprocess.run(args.bench, check=True,
+                         stdout=subprocess.PIPE).stdout.decode('utf-8')
+    measured = parse_metrics(out)
+
+    if args.update_baseline:
+        with open(args.baseline, 'w') as f:
+            f.write('# simavr cycle counts, see tools/avr_bench_check.py\n')
+            f.write(out)
+        print('baseline stored in {}'.format(args.baseline))
+        return 0
+
+    try:
+        with open(args.baseline) as f:
+            baseline = parse_metrics(f.read())
+    except FileNotFoundError:
+        sys.stdout.write(out)
+        print('no baseline in {}, store one with --update-baseline'.format(
+            args.baseline))
+        return 1
+
+    failed = False
+    for name, base in sorted(baseline.items()):
+        if name not in measured:
+            print('{}: missing'.format(name))
+            failed = True
+            continue
+        value = measured[name]
+        limit = base * (1 + args.tolerance / 100)
+        if value > limit:
+            verdict = 'REGRESSED'
+            failed = True
+        elif value < base:
+            verdict = 'improved'
+        else:
+            verdict = 'ok'
+        print('{:40} {:>12.1f} {:>12.1f}  {}'.format(
+            name, base, value, verdict))
+    for name in sorted(set(measured) - set(baseline)):
+        print('{:40} {:>12} {:>12.1f}  new'.format(
+            name, '-', measured[name]))
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,148 @@
+"""
+Trace decoder.  Turns the binary trace records recorded by the firmware (see
+include/trace.h) back into text, using the event list and format strings in
+include/trace_events.h.
+
+Records come either from the UART, framed with two sync bytes, or unframed
+from the TRACE_VENDOR_REQ_READ request on EP0.  Timestamps are Timer1 ticks;
+the 16-bit counter is unwrapped assuming consecutive records are less than
+one timer period apart, so long idle gaps show up shorter than they were.
+
+usage: trace_decode.py [--events trace_events.h] [--tick-us 0.5]
+                       (--uart <capture or tty> | --usb <vid:pid>)
+"""
+
+
+import argparse
+import os
+import re
+import struct
+import sys
+import time
+
+
+SYNC = b'\xa5\x5a'
+RECORD = struct.Struct('<BBH')
+TRACE_VENDOR_REQ_READ = 0x01
+
+DEFAULT_EVENTS = os.path.join(
+    os.path.dirname(os.path.abspath(__file__)), '..', 'include', 'trace_events.h')
+
+EVENT_RE = re.compile(r'X\(\s*(\w+)\s*,\s*"((?:[^"\\]|\\.)*)"\s*\)')
+
+
+def load_events(path):
+    """
+    Event formats in declaration order, which is the order of their IDs.
+    """
+    with open(path, 'r') as events_file:
+        return EVENT_RE.findall(events_file.read())
+
+
+class Decoder:
+    def __init__(self, events, tick_us):
+        self.events = events
+        self.tick_us = tick_us
+        self.last = None
+        self.time = 0
+
+    def format(self, event_id, arg, stamp):
+        if self.last is not None:
+            self.time += (stamp - self.last) & 0xFFFF
+        self.last = stamp
+        if event_id < len(self.events):
+            name, fmt = self.events[event_id]
+            try:
+                text = fmt % arg if '%' in fmt else fmt
+            except (TypeError, ValueError):
+                text = '{} {}'.format(fmt, arg)
+        else:
+            name, text = 'unknown', 'event {} arg {}'.format(event_id, arg)
+        return '{:12.1f} us  {:<24} {}'.format(self.time * self.tick_us, name, text)
+
+    def records(self, data):
+        """
+        Decode unframed records, as returned over USB.
+        """
+        for i in range(0, len(data) - RECORD.size + 1, RECORD.size):
+            yield self.format(*RECORD.unpack_from(data, i))
+
+    def frames(self, data):
+        """
+        Decode framed records out of a UART byte stream.
+        @return the lines and any trailing bytes of an incomplete frame
+        """
+        lines = []
+        while True:
+            start = data.find(SYNC)
+            if start < 0:
+                # keep a possible first sync byte
+                return lines, data[-1:] if data.endswith(SYNC[:1]) else b''
+            if len(data) < start + len(SYNC) + RECORD.size:
+                return lines, data[start:]
+            event_id, arg, stamp = RECORD.unpack_from(data, start + len(SYNC))
+            if event_id >= len(self.events):
+                # a sync pattern inside another frame, skip it
+                data = data[start + 1:]
+                continue
+            lines.append(self.format(event_id, arg, stamp))
+            data = data[start + len(SYNC) + RECORD.size:]
+
+
+def read_uart(decoder, path):
+    pending = b''
+    with open(path, 'rb', buffering=0) as stream:
+        while True:
+            chunk = stream.read(256)
+            if not chunk:
+                break
+            lines, pending = decoder.frames(pending + chunk)
+            for line in lines:
+                print(line, flush=True)
+
+
+def read_usb(decoder, ids, interval):
+    import usb.core
+    vid, pid = (int(x, 16) for x in ids.split(':'))
+    dev = usb.core.find(idVendor=vid, idProduct=pid)
+    if dev is None:
+        raise RuntimeError('no device {}'.format(ids))
+    while True:
+        # bmRequestType 0xC0: device to host, vendor, device recipient
+        data = bytes(dev.ctrl_transfer(0xC0, TRACE_VENDOR_REQ_READ, 0, 0, 64))
+        for line in decoder.records(data):
+            print(line, flush=True)
+        # every read records its own SETUP, so a short read means caught up
+        if len(data) < 64:
+            time.sleep(interval)
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(description='decode firmware trace records')
+    parser.add_argument('--events', default=DEFAULT_EVENTS,
+                        help='trace_events.h the firmware was built with')
+    parser.add_argument('--tick-us', type=float, default=0.5,
+                        help='Timer1 tick in microseconds (clk/8 at 16MHz: 0.5)')
+    source = parser.add_mutually_exclusive_group(required=True)
+    source.add_argument('--uart', help='UART capture file or configured tty')
+    source.add_argument('--usb', help='device vid:pid, hex, read over EP0')
+    parser.add_argument('--interval', type=float, default=0.05,
+                        help='USB polling interval in seconds when idle')
+    args = parser.parse_args(argv[1:])
+
+    decoder = Decoder(load_events(args.events), args.tick_us)
+    try:
+        if args.uart:
+            read_uart(decoder, args.uart)
+        else:
+            read_usb(decoder, args.usb, args.interval)
+    except KeyboardInterrupt:
+        pass
+    except (OSError, RuntimeError, ImportError) as e:
+        sys.stderr.write('{}\n'.format(e))
+        return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
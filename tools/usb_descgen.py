@@ -0,0 +1,467 @@
+"""
+USB descriptor compiler.  Turns a declarative device description (JSON) into
+flash-resident descriptor byte arrays for the ATmega32U4 USB driver.
+
+Lengths, wTotalLength, interface and endpoint counts, interface numbers and
+string indices are computed here, and string descriptors are UTF-16LE
+encoded, so none of them are maintained by hand.  The description is checked
+against the USB 2.0 (full-speed) and ATmega32U4 endpoint rules before
+anything is written.
+
+The endpoint hardware configuration is planned from the same endpoint
+descriptors: bank size and count, type and direction as UECFG0X/UECFG1X
+values in allocation order, checked against the DPRAM the controller has.
+
+usage: usb_descgen.py <description.json> <output.c> <output.h>
+"""
+
+
+import json
+import os
+import re
+import sys
+
+
+USB_DESC_DEVICE = 1
+USB_DESC_CONFIGURATION = 2
+USB_DESC_STRING = 3
+USB_DESC_INTERFACE = 4
+USB_DESC_ENDPOINT = 5
+USB_DESC_INTERFACE_ASSOC = 11
+USB_CDC_DESC_CS_INTERFACE = 0x24
+
+EP_TYPES = {'control': 0, 'isochronous': 1, 'bulk': 2, 'interrupt': 3}
+
+# ATmega32U4: endpoints 1-6, EP1 banks may be up to 256 bytes, TRM 22.18.2
+NUM_EPS = 7
+EP_MAX_SIZE = {1: 256}
+EP_DEFAULT_MAX_SIZE = 64
+# full-speed wMaxPacketSize limits, USB 2.0 5.7.3, 5.8.3 and 5.6.3: only
+# isochronous endpoints may exceed 64 bytes, the banks above still apply
+FS_MAX_PACKET = {'bulk': 64, 'interrupt': 64, 'isochronous': 1023}
+# endpoint FIFO memory shared by all endpoints, TRM 22.1, and the smallest
+# EP0 the driver can be built with, the rest is checked in C
+DPRAM_SIZE = 832
+EP0_MIN_SIZE = 8
+# banks per endpoint unless the description says otherwise: the firmware
+# fills one while the host empties the other
+EP_DEFAULT_BANKS = {'bulk': 2, 'isochronous': 2, 'interrupt': 1}
+
+# bMaxPacketSize0 is chosen by the driver, not the description
+EP0_SIZE_MACRO = 'ATMEGA_XU4_EP0_SIZE'
+
+
+class DescriptionError(Exception):
+    pass
+
+
+def num(value, what, lo=0, hi=0xFF):
+    """
+    Parse an integer field, which may be given as a hex string.
+    """
+    if isinstance(value, str):
+        try:
+            value = int(value, 0)
+        except ValueError:
+            raise DescriptionError('{}: "{}" is not a number'.format(what, value))
+    if not isinstance(value, int) or isinstance(value, bool):
+        raise DescriptionError('{}: expected a number'.format(what))
+    if not lo <= value <= hi:
+        raise DescriptionError('{}: {} not in [{}, {}]'.format(what, value, lo, hi))
+    return value
+
+
+def u16(value):
+    return [value & 0xFF, value >> 8]
+
+
+class StringTable:
+    """
+    String descriptors, deduplicated.  Index 0 is the language ID list.
+    """
+    def __init__(self, languages):
+        self.strings = []
+        self.langids = [num(l, 'languages', hi=0xFFFF) for l in languages]
+        if not self.langids:
+            raise DescriptionError('languages: at least one language ID is required')
+
+    def index(self, string, what):
+        if string is None:
+            return 0
+        if not isinstance(string, str):
+            raise DescriptionError('{}: expected a string'.format(what))
+        if 2 + len(string.encode('utf-16-le')) > 0xFF:
+            raise DescriptionError('{}: "{}" does not fit in a descriptor'.format(what, string))
+        if string not in self.strings:
+            self.strings.append(string)
+        return self.strings.index(string) + 1
+
+    def descriptors(self):
+        langids = sum((u16(l) for l in self.langids), [])
+        descs = [('language IDs', [2 + len(langids), USB_DESC_STRING] + langids)]
+        for s in self.strings:
+            encoded = list(s.encode('utf-16-le'))
+            descs.append(('"{}"'.format(s), [2 + len(encoded), USB_DESC_STRING] + encoded))
+        return descs
+
+
+class Config:
+    """
+    A configuration descriptor and everything that follows it, as a list of
+    (comment, bytes) pairs.
+    """
+    def __init__(self, desc, strings):
+        self.desc = desc
+        self.strings = strings
+        self.parts = []
+        self.interfaces = {}
+        self.intf_descs = {}
+        self.numbers = {}
+        self.num_interfaces = 0
+        self.endpoints = {}
+        # endpoint number: (type, IN, wMaxPacketSize, banks)
+        self.hw_endpoints = {}
+
+    def compile(self):
+        desc = self.desc
+        functions = desc.get('functions', [])
+        if not functions:
+            raise DescriptionError('configuration: no functions')
+        # interface numbers are assigned in order, so names can be resolved
+        # before any class descriptor refers to them
+        for f in functions:
+            for intf in f.get('interfaces', []):
+                name = intf.get('name', 'interface {}'.format(self.num_interfaces))
+                if name in self.interfaces:
+                    raise DescriptionError('interface {}: duplicate name'.format(name))
+                self.interfaces[name] = self.num_interfaces
+                self.intf_descs[self.num_interfaces] = intf
+                self.numbers[id(intf)] = self.num_interfaces
+                self.num_interfaces += 1
+        if self.num_interfaces == 0:
+            raise DescriptionError('configuration: no interfaces')
+
+        for f in functions:
+            self.function(f)
+
+        attrs = num(desc.get('bmAttributes', 0x80), 'bmAttributes')
+        if not attrs & 0x80 or attrs & 0x1F:
+            raise DescriptionError('bmAttributes: bit 7 must be set, bits 0-4 clear')
+        self.attrs = attrs
+        body = sum((b for _, b in self.parts), [])
+        total = 9 + len(body)
+        if total > 0xFFFF:
+            raise DescriptionError('configuration: wTotalLength {} too large'.format(total))
+        head = [
+            9, USB_DESC_CONFIGURATION, *u16(total),
+            self.num_interfaces,
+            num(desc.get('bConfigurationValue', 1), 'bConfigurationValue', lo=1),
+            self.strings.index(desc.get('string'), 'configuration string'),
+            attrs,
+            num(desc.get('bMaxPower', 50), 'bMaxPower'),
+        ]
+        self.parts.insert(0, ('configuration', head))
+        return self.parts
+
+    def function(self, f):
+        interfaces = f.get('interfaces', [])
+        if len(interfaces) > 1:
+            self.parts.append(('interface association', [
+                8, USB_DESC_INTERFACE_ASSOC,
+                self.numbers[id(interfaces[0])],
+                len(interfaces),
+                num(f.get('bFunctionClass', 0), 'bFunctionClass'),
+                num(f.get('bFunctionSubClass', 0), 'bFunctionSubClass'),
+                num(f.get('bFunctionProtocol', 0), 'bFunctionProtocol'),
+                self.strings.index(f.get('string'), 'function string'),
+            ]))
+        for intf in interfaces:
+            self.interface(intf)
+
+    def acm_functions(self):
+        """
+        The CDC-ACM ports, in order, as (comm interface, notification IN,
+        bulk IN, bulk OUT endpoint numbers): what the firmware needs to set
+        up a port. The data interface is the first subordinate of the union.
+        """
+        ports = []
+        for number, intf in sorted(self.intf_descs.items()):
+            if (num(intf.get('bInterfaceClass', 0), 'bInterfaceClass') != 2
+                    or num(intf.get('bInterfaceSubClass', 0), 'bInterfaceSubClass') != 2):
+                continue
+            name = intf.get('name', 'interface {}'.format(number))
+            unions = [cs for cs in intf.get('class_descriptors', [])
+                    if cs.get('type') == 'cdc_union']
+            if not unions:
+                raise DescriptionError('{}: CDC-ACM needs a cdc_union'.format(name))
+            data = self.intf_descs[self.resolve(unions[0]['bSubordinateInterface'][0],
+                    name + ': bSubordinateInterface')]
+            notify = self.find_endpoint(intf, 'interrupt', 0x80, name)
+            bulk_in = self.find_endpoint(data, 'bulk', 0x80, name + ' data')
+            bulk_out = self.find_endpoint(data, 'bulk', 0x00, name + ' data')
+            ports.append((number, notify, bulk_in, bulk_out))
+        return ports
+
+    def raw_functions(self):
+        """
+        The vendor-specific (class 0xFF) interfaces with a bulk IN and a bulk
+        OUT endpoint, for the raw bulk transport, as (interface, bulk IN,
+        bulk OUT endpoint numbers).
+        """
+        raws = []
+        for number, intf in sorted(self.intf_descs.items()):
+            if num(intf.get('bInterfaceClass', 0), 'bInterfaceClass') != 0xFF:
+                continue
+            name = intf.get('name', 'interface {}'.format(number))
+            raws.append((number,
+                    self.find_endpoint(intf, 'bulk', 0x80, name),
+                    self.find_endpoint(intf, 'bulk', 0x00, name)))
+        return raws
+
+    def find_endpoint(self, intf, kind, direction, what):
+        for ep in intf.get('endpoints', []):
+            address = num(ep.get('bEndpointAddress'), what + ': bEndpointAddress')
+            if ep.get('type') == kind and address & 0x80 == direction:
+                return address & 0x0F
+        raise DescriptionError('{}: no {} {} endpoint'.format(
+            what, kind, 'IN' if direction else 'OUT'))
+
+    def endpoint_plan(self):
+        """
+        UECFG0X and UECFG1X of every endpoint, in the ascending order the
+        controller needs them allocated in, TRM 22.7, as (number, UECFG0X,
+        UECFG1X) C expressions, and the DPRAM they take.
+        """
+        plan = []
+        dpram = 0
+        for number, (kind, is_in, size, banks) in sorted(self.hw_endpoints.items()):
+            cfg0 = '({} << EPTYPE0){}'.format(EP_TYPES[kind], ' | _BV(EPDIR)' if is_in else '')
+            # EPSIZE is log2(size / 8), sizes are powers of two from 8
+            cfg1 = '({} << EPSIZE0){} | _BV(ALLOC)'.format(
+                size.bit_length() - 4, ' | _BV(EPBK0)' if banks == 2 else '')
+            plan.append((number, cfg0, cfg1))
+            dpram += size * banks
+        if EP0_MIN_SIZE + dpram > DPRAM_SIZE:
+            raise DescriptionError('endpoints: {} bytes of banks do not fit in {} bytes of '
+                    'DPRAM'.format(dpram, DPRAM_SIZE - EP0_MIN_SIZE))
+        return plan, dpram
+
+    def resolve(self, ref, what):
+        if isinstance(ref, str) and ref in self.interfaces:
+            return self.interfaces[ref]
+        value = num(ref, what)
+        if value >= self.num_interfaces:
+            raise DescriptionError('{}: no interface {}'.format(what, value))
+        return value
+
+    def interface(self, intf):
+        number = self.numbers[id(intf)]
+        name = intf.get('name', 'interface {}'.format(number))
+        endpoints = intf.get('endpoints', [])
+        self.parts.append(('interface {} ({})'.format(number, name), [
+            9, USB_DESC_INTERFACE,
+            number,
+            0, # alternate settings are not supported
+            len(endpoints),
+            num(intf.get('bInterfaceClass', 0), name + ': bInterfaceClass'),
+            num(intf.get('bInterfaceSubClass', 0), name + ': bInterfaceSubClass'),
+            num(intf.get('bInterfaceProtocol', 0), name + ': bInterfaceProtocol'),
+            self.strings.index(intf.get('string'), name + ': string'),
+        ]))
+        for cs in intf.get('class_descriptors', []):
+            self.class_descriptor(cs, name)
+        for ep in endpoints:
+            self.endpoint(ep, name)
+
+    def class_descriptor(self, cs, intf_name):
+        kind = cs.get('type')
+        what = '{}: {}'.format(intf_name, kind)
+        if kind == 'cdc_header':
+            payload = [0x00, *u16(num(cs.get('bcdCDC', 0x0110), what, hi=0xFFFF))]
+        elif kind == 'cdc_call_mgmt':
+            payload = [0x01, num(cs.get('bmCapabilities', 0), what),
+                    self.resolve(cs['bDataInterface'], what + ': bDataInterface')]
+        elif kind == 'cdc_acm':
+            payload = [0x02, num(cs.get('bmCapabilities', 0), what, hi=0x0F)]
+        elif kind == 'cdc_union':
+            subordinates = cs.get('bSubordinateInterface', [])
+            if not subordinates:
+                raise DescriptionError(what + ': no subordinate interfaces')
+            payload = [0x06, self.resolve(cs['bControlInterface'], what + ': bControlInterface')]
+            payload += [self.resolve(s, what + ': bSubordinateInterface') for s in subordinates]
+        elif kind == 'raw':
+            payload = [num(b, what) for b in cs.get('bytes', [])]
+            self.parts.append((what, [2 + len(payload), num(cs.get('bDescriptorType'), what)] + payload))
+            return
+        else:
+            raise DescriptionError('{}: unknown class descriptor type'.format(what))
+        self.parts.append((kind, [2 + len(payload), USB_CDC_DESC_CS_INTERFACE] + payload))
+
+    def endpoint(self, ep, intf_name):
+        address = num(ep.get('bEndpointAddress'), intf_name + ': bEndpointAddress')
+        number = address & 0x0F
+        what = '{}: endpoint 0x{:02x}'.format(intf_name, address)
+        if address & 0x70 or not 1 <= number < NUM_EPS:
+            raise DescriptionError('{}: must be 1-{}, IN or OUT'.format(what, NUM_EPS - 1))
+        # one direction per endpoint number on this controller
+        if number in self.endpoints:
+            raise DescriptionError('{}: endpoint {} already used by {}'.format(
+                what, number, self.endpoints[number]))
+        self.endpoints[number] = intf_name
+
+        kind = ep.get('type')
+        if kind not in EP_TYPES or kind == 'control':
+            raise DescriptionError('{}: type must be one of isochronous, bulk, interrupt'.format(what))
+        size = num(ep.get('wMaxPacketSize'), what + ': wMaxPacketSize', lo=8,
+                hi=EP_MAX_SIZE.get(number, EP_DEFAULT_MAX_SIZE))
+        if size & (size - 1):
+            raise DescriptionError('{}: wMaxPacketSize must be a power of two'.format(what))
+        if size > FS_MAX_PACKET[kind]:
+            raise DescriptionError('{}: full-speed {} packets are at most {} bytes'.format(
+                what, kind, FS_MAX_PACKET[kind]))
+
+        if kind == 'bulk':
+            if 'bInterval' in ep and num(ep['bInterval'], what) != 0:
+                raise DescriptionError('{}: bulk endpoints have no bInterval'.format(what))
+            interval = 0
+        elif kind == 'interrupt':
+            interval = num(ep.get('bInterval'), what + ': bInterval (ms)', lo=1)
+        else:
+            interval = num(ep.get('bInterval', 1), what + ': bInterval', lo=1, hi=16)
+
+        banks = num(ep.get('banks', EP_DEFAULT_BANKS[kind]), what + ': banks', lo=1, hi=2)
+        self.hw_endpoints[number] = (kind, bool(address & 0x80), size, banks)
+
+        attrs = EP_TYPES[kind]
+        self.parts.append(('endpoint 0x{:02x}, {}'.format(address, kind), [
+            7, USB_DESC_ENDPOINT, address, attrs, *u16(size), interval,
+        ]))
+
+
+def device_descriptor(desc, strings):
+    return [
+        18, USB_DESC_DEVICE,
+        *u16(num(desc.get('bcdUSB', 0x0110), 'bcdUSB', hi=0xFFFF)),
+        num(desc.get('bDeviceClass', 0), 'bDeviceClass'),
+        num(desc.get('bDeviceSubClass', 0), 'bDeviceSubClass'),
+        num(desc.get('bDeviceProtocol', 0), 'bDeviceProtocol'),
+        EP0_SIZE_MACRO,
+        *u16(num(desc.get('idVendor'), 'idVendor', hi=0xFFFF)),
+        *u16(num(desc.get('idProduct'), 'idProduct', hi=0xFFFF)),
+        *u16(num(desc.get('bcdDevice', 0), 'bcdDevice', hi=0xFFFF)),
+        strings.index(desc.get('manufacturer'), 'manufacturer'),
+        strings.index(desc.get('product'), 'product'),
+        strings.index(desc.get('serial'), 'serial'),
+        1, # bNumConfigurations
+    ]
+
+
+def c_bytes(data, indent='    '):
+    items = [b if isinstance(b, str) else '0x{:02x}'.format(b) for b in data]
+    lines = []
+    for i in range(0, len(items), 8):
+        lines.append(indent + ', '.join(items[i:i + 8]) + ',')
+    return lines
+
+
+def c_array(name, size, parts, storage=''):
+    lines = ['{}const uint8_t {}[{}] PROGMEM = {{'.format(storage, name, size)]
+    for comment, data in parts:
+        lines.append('    // ' + comment)
+        lines += c_bytes(data)
+    lines.append('};')
+    return lines
+
+
+def compile_description(desc, source):
+    strings = StringTable(desc.get('languages', ['0x0409']))
+    if 'device' not in desc or 'configuration' not in desc:
+        raise DescriptionError('a device and a configuration are required')
+    device = device_descriptor(desc['device'], strings)
+    config = Config(desc['configuration'], strings)
+    config_parts = config.compile()
+    config_size = sum(len(d) for _, d in config_parts)
+    string_descs = strings.descriptors()
+
+    banner = '// generated by usb_descgen.py from {}, do not edit'.format(source)
+    c = [banner, '', '#include "usb_descriptors.h"', '#include "32u4_usb.h"', '']
+    c += c_array('usb_device_desc', 'USB_DEVICE_DESC_SIZE', [('device', device)])
+    c.append('')
+    c += c_array('usb_config_desc', 'USB_CONFIG_DESC_SIZE', config_parts)
+    c.append('')
+    for i, (comment, data) in enumerate(string_descs):
+        c += c_array('usb_string_desc_{}'.format(i), len(data), [(comment, data)], 'static ')
+        c.append('')
+    c.append('const uint8_t *const usb_string_descs[USB_NUM_STRING_DESCS] PROGMEM = {')
+    c += ['    usb_string_desc_{},'.format(i) for i in range(len(string_descs))]
+    c.append('};')
+
+    h = [
+        '#pragma once',
+        banner,
+        '',
+        '#define USB_DEVICE_DESC_SIZE {}'.format(len(device)),
+        '#define USB_CONFIG_DESC_SIZE {}'.format(config_size),
+        '#define USB_NUM_INTERFACES {}'.format(config.num_interfaces),
+        '#define USB_NUM_STRING_DESCS {}'.format(len(string_descs)),
+        '// bmAttributes of the configuration: {}'.format(', '.join(
+            ['self-powered' if config.attrs & 0x40 else 'bus-powered']
+            + (['remote wakeup'] if config.attrs & 0x20 else []))),
+        '#define USB_CONFIG_ATTRIBUTES 0x{:02X}'.format(config.attrs),
+        '',
+        '// interface numbers by name, eg. for class request handlers',
+    ]
+    h += ['#define USB_INTERFACE_{} {}'.format(name.upper(), number)
+            for name, number in config.interfaces.items()
+            if re.fullmatch(r'[A-Za-z_]\w*', name)]
+    acm = config.acm_functions()
+    h += [
+        '',
+        '// CDC-ACM ports: X(comm interface, notification IN, bulk IN, bulk OUT)',
+        '#define USB_NUM_ACM_FUNCTIONS {}'.format(len(acm)),
+        '#define USB_ACM_FUNCTIONS(X)' + (' \\' if acm else ''),
+    ]
+    h += ['    X({}, {}, {}, {}){}'.format(*port, ' \\' if i + 1 < len(acm) else '')
+            for i, port in enumerate(acm)]
+    raw = config.raw_functions()
+    h += [
+        '',
+        '// raw bulk interfaces: X(interface, bulk IN, bulk OUT)',
+        '#define USB_NUM_RAW_FUNCTIONS {}'.format(len(raw)),
+        '#define USB_RAW_FUNCTIONS(X)' + (' \\' if raw else ''),
+    ]
+    h += ['    X({}, {}, {}){}'.format(*intf, ' \\' if i + 1 < len(raw) else '')
+            for i, intf in enumerate(raw)]
+    plan, dpram = config.endpoint_plan()
+    h += [
+        '',
+        '// endpoint hardware configuration, in allocation order:',
+        '// X(endpoint number, UECFG0X, UECFG1X), and the DPRAM it takes besides EP0',
+        '#define USB_EP_DPRAM_SIZE {}'.format(dpram),
+        '#define USB_ENDPOINTS(X)' + (' \\' if plan else ''),
+    ]
+    h += ['    X({}, {}, {}){}'.format(*ep, ' \\' if i + 1 < len(plan) else '')
+            for i, ep in enumerate(plan)]
+    return '\n'.join(c) + '\n', '\n'.join(h) + '\n'
+
+
+def main(argv):
+    if len(argv) != 4:
+        sys.stderr.write('usage: {} <description.json> <output.c> <output.h>\n'.format(argv[0]))
+        return 1
+    with open(argv[1], 'r') as desc_file:
+        desc = json.load(desc_file)
+    try:
+        c, h = compile_description(desc, os.path.basename(argv[1]))
+    except (DescriptionError, KeyError) as e:
+        sys.stderr.write('{}: {}\n'.format(argv[1], e))
+        return 1
+    with open(argv[2], 'w') as c_file:
+        c_file.write(c)
+    with open(argv[3], 'w') as h_file:
+        h_file.write(h)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))